@@ -1,81 +1,430 @@
-//compiled with gcc -g -lssl -UOPENSSL_NO_EC SO2228860.c -lcrypto
-#include <openssl/ec.h>      // for EC_GROUP_new_by_curve_name, EC_GROUP_free, EC_KEY_new, EC_KEY_set_group, EC_KEY_generate_key, EC_KEY_free
+// ECDSA keygen/sign/verify benchmark.
+//
+// Measures ops/s and p50/p99 latency per curve, thread count and backend:
+//   sw      OpenSSL software ECDSA
+//   engine  signing through an OpenSSL engine (default tpm20e_v2) with a
+//           TPM key, e.g. against a TPM simulator behind the resource manager
+//
+// Examples:
+//   ./ecdsa -c secp256k1,prime256v1,secp384r1,secp521r1 -t 1,2,4 -n 1000
+//   ./ecdsa -b engine -e tpm20e_v2 -k "0x81020001;leaf123" -t 1,4 -f json
+#include <openssl/ec.h>      // for EC_KEY_new_by_curve_name, EC_KEY_generate_key, EC_KEY_free
 #include <openssl/ecdsa.h>   // for ECDSA_do_sign, ECDSA_do_verify
-#include <openssl/obj_mac.h> // for NID_secp192k1
-#include <string.h>
+#include <openssl/obj_mac.h> // for NID_secp256k1, NID_X9_62_prime256v1, ...
+#include <openssl/objects.h> // for OBJ_sn2nid, OBJ_nid2sn
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <openssl/rand.h>
+#include <openssl/err.h>
 
-static int create_signature(unsigned char* hash)
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+enum Op { OP_KEYGEN, OP_SIGN, OP_VERIFY, OP_COUNT };
+static const char *opNames[OP_COUNT] = { "keygen", "sign", "verify" };
+
+struct Config
+{
+    std::vector<std::string> curves;
+    std::vector<int>         threads;
+    std::string              backend;     // "sw" or "engine"
+    std::string              engineId;
+    std::string              keyId;       // engine key id
+    std::vector<std::string> engineCtrls; // NAME=VALUE, applied before init
+    int                      iterations;  // per thread and operation
+    std::string              format;      // "csv" or "json"
+    std::string              outFile;
+};
+
+struct Result
+{
+    std::string backend;
+    std::string curve;
+    int         threads;
+    Op          op;
+    long        ops;
+    long        errors;
+    double      seconds;
+    double      p50us;
+    double      p99us;
+};
+
+// State of one benchmark thread
+struct ThreadWork
 {
-    int function_status = -1;
-    EC_KEY *eckey=EC_KEY_new();
-    if (NULL == eckey)
+    int                               nid;
+    EC_KEY                           *key;        // signing key (sw: own, engine: shared)
+    std::vector<std::vector<unsigned char> > digests;
+    std::vector<ECDSA_SIG *>          signatures; // output of the sign phase
+    std::vector<double>               latencies[OP_COUNT];
+    long                              errors[OP_COUNT];
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedUs(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+static std::vector<std::string> splitList(const char *arg)
+{
+    std::vector<std::string> items;
+    std::string s(arg);
+    size_t pos = 0, next;
+    while ((next = s.find(',', pos)) != std::string::npos)
     {
-        printf("Failed to create new EC Key\n");
-        function_status = -1;
+        items.push_back(s.substr(pos, next - pos));
+        pos = next + 1;
     }
-    else
+    items.push_back(s.substr(pos));
+    return items;
+}
+
+// Digest matching the curve size, as a TLS stack would pick it
+static const EVP_MD *digestForCurve(int nid)
+{
+    switch (nid)
+    {
+    case NID_secp384r1: return EVP_sha384();
+    case NID_secp521r1: return EVP_sha512();
+    default:            return EVP_sha256();
+    }
+}
+
+static double percentile(std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+// Fresh random messages, so that nothing can be cached between iterations
+static void prepareDigests(ThreadWork *work, int iterations)
+{
+    const EVP_MD *md = digestForCurve(work->nid);
+    unsigned char message[64];
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen = 0;
+
+    for (int i = 0; i < iterations; i++)
     {
-        EC_GROUP *ecgroup= EC_GROUP_new_by_curve_name(NID_secp192k1);
-        if (NULL == ecgroup)
+        RAND_bytes(message, sizeof(message));
+        EVP_Digest(message, sizeof(message), digest, &digestLen, md, NULL);
+        work->digests.push_back(std::vector<unsigned char>(digest, digest + digestLen));
+    }
+    work->signatures.assign(iterations, (ECDSA_SIG *)NULL);
+}
+
+static void runPhase(ThreadWork *work, Op op)
+{
+    for (size_t i = 0; i < work->digests.size(); i++)
+    {
+        const std::vector<unsigned char> &digest = work->digests[i];
+        Clock::time_point start = Clock::now();
+        bool ok;
+
+        switch (op)
+        {
+        case OP_KEYGEN:
+            {
+                EC_KEY *key = EC_KEY_new_by_curve_name(work->nid);
+                ok = (key != NULL && EC_KEY_generate_key(key) == 1);
+                EC_KEY_free(key);
+            }
+            break;
+        case OP_SIGN:
+            work->signatures[i] = ECDSA_do_sign(&digest[0], (int)digest.size(), work->key);
+            ok = (work->signatures[i] != NULL);
+            break;
+        default:
+            ok = (work->signatures[i] != NULL &&
+                  ECDSA_do_verify(&digest[0], (int)digest.size(), work->signatures[i], work->key) == 1);
+            break;
+        }
+
+        if (ok)
+            work->latencies[op].push_back(elapsedUs(start));
+        else
+            work->errors[op]++;
+    }
+}
+
+static bool runBenchmark(const Config &config, const std::string &curve, int nrThreads,
+                         EC_KEY *engineKey, std::vector<Result> &results)
+{
+    bool engine = (config.backend == "engine");
+    int nid;
+
+    if (engine)
+        nid = EC_GROUP_get_curve_name(EC_KEY_get0_group(engineKey));
+    else if ((nid = OBJ_sn2nid(curve.c_str())) == NID_undef)
+    {
+        fprintf(stderr, "Unknown curve '%s'\n", curve.c_str());
+        return false;
+    }
+
+    std::vector<ThreadWork> work(nrThreads);
+    for (int t = 0; t < nrThreads; t++)
+    {
+        work[t].nid = nid;
+        memset(work[t].errors, 0, sizeof(work[t].errors));
+        if (engine)
         {
-            printf("Failed to create new EC Group\n");
-            function_status = -1;
+            EC_KEY_up_ref(engineKey);
+            work[t].key = engineKey;
         }
         else
         {
-            int set_group_status = EC_KEY_set_group(eckey,ecgroup);
-            const int set_group_success = 1;
-            if (set_group_success != set_group_status)
+            work[t].key = EC_KEY_new_by_curve_name(nid);
+            if (work[t].key == NULL || EC_KEY_generate_key(work[t].key) != 1)
             {
-                printf("Failed to set group for EC Key\n");
-                function_status = -1;
+                fprintf(stderr, "Failed to generate %s key\n", curve.c_str());
+                return false;
             }
-            else
-            {
-                const int gen_success = 1;
-                int gen_status = EC_KEY_generate_key(eckey);
-                if (gen_success != gen_status)
-                {
-                    printf("Failed to generate EC Key\n");
-                    function_status = -1;
-                }
-                else
-                {
-                    ECDSA_SIG *signature = ECDSA_do_sign(hash, strlen(hash), eckey);
-                    if (NULL == signature)
-                    {
-                        printf("Failed to generate EC Signature\n");
-                        function_status = -1;
-                    }
-                    else
-                    {
-
-                        int verify_status = ECDSA_do_verify(hash, strlen(hash), signature, eckey);
-                        const int verify_success = 1;
-                        if (verify_success != verify_status)
-                        {
-                            printf("Failed to verify EC Signature\n");
-                            function_status = -1;
-                        }
-                        else
-                        {
-                            printf("Verifed EC Signature\n");
-                            function_status = 1;
-                        }
-                    }
-                }
-            }
-            EC_GROUP_free(ecgroup);
         }
-        EC_KEY_free(eckey);
+        prepareDigests(&work[t], config.iterations);
+    }
+
+    // One timed phase per operation, all threads running the same one.
+    // Keys live in the TPM for the engine backend, so there is no keygen.
+    for (int op = engine ? OP_SIGN : OP_KEYGEN; op < OP_COUNT; op++)
+    {
+        Clock::time_point start = Clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nrThreads; t++)
+            threads.push_back(std::thread(runPhase, &work[t], (Op)op));
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+        double seconds = elapsedUs(start) / 1e6;
+
+        std::vector<double> all;
+        long errors = 0;
+        for (int t = 0; t < nrThreads; t++)
+        {
+            all.insert(all.end(), work[t].latencies[op].begin(), work[t].latencies[op].end());
+            errors += work[t].errors[op];
+        }
+        std::sort(all.begin(), all.end());
+
+        Result result;
+        result.backend = engine ? config.engineId : "sw";
+        result.curve   = OBJ_nid2sn(nid);
+        result.threads = nrThreads;
+        result.op      = (Op)op;
+        result.ops     = (long)all.size();
+        result.errors  = errors;
+        result.seconds = seconds;
+        result.p50us   = percentile(all, 0.50);
+        result.p99us   = percentile(all, 0.99);
+        results.push_back(result);
+    }
+
+    for (int t = 0; t < nrThreads; t++)
+        for (size_t i = 0; i < work[t].signatures.size(); i++)
+            ECDSA_SIG_free(work[t].signatures[i]);
+    for (int t = 0; t < nrThreads; t++)
+        EC_KEY_free(work[t].key);
+    return true;
+}
+
+static void writeResults(const Config &config, const std::vector<Result> &results)
+{
+    FILE *out = stdout;
+    if (!config.outFile.empty() && (out = fopen(config.outFile.c_str(), "w")) == NULL)
+    {
+        fprintf(stderr, "Cannot write '%s'\n", config.outFile.c_str());
+        out = stdout;
+    }
+
+    if (config.format == "json")
+        fprintf(out, "[\n");
+    else
+        fprintf(out, "backend,curve,threads,op,ops,errors,seconds,ops_per_sec,p50_us,p99_us\n");
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+        double opsPerSec = r.seconds > 0 ? r.ops / r.seconds : 0.0;
+        if (config.format == "json")
+            fprintf(out,
+                "  {\"backend\": \"%s\", \"curve\": \"%s\", \"threads\": %d, \"op\": \"%s\", "
+                "\"ops\": %ld, \"errors\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.2f, "
+                "\"p50_us\": %.1f, \"p99_us\": %.1f}%s\n",
+                r.backend.c_str(), r.curve.c_str(), r.threads, opNames[r.op],
+                r.ops, r.errors, r.seconds, opsPerSec, r.p50us, r.p99us,
+                i + 1 < results.size() ? "," : "");
+        else
+            fprintf(out, "%s,%s,%d,%s,%ld,%ld,%.6f,%.2f,%.1f,%.1f\n",
+                r.backend.c_str(), r.curve.c_str(), r.threads, opNames[r.op],
+                r.ops, r.errors, r.seconds, opsPerSec, r.p50us, r.p99us);
+    }
+
+    if (config.format == "json")
+        fprintf(out, "]\n");
+    if (out != stdout)
+        fclose(out);
+}
+
+static ENGINE *openEngine(const Config &config)
+{
+    ENGINE_load_dynamic();
+    ENGINE *e = ENGINE_by_id(config.engineId.c_str());
+    if (e == NULL)
+    {
+        fprintf(stderr, "Engine '%s' not available\n", config.engineId.c_str());
+        return NULL;
+    }
+
+    for (size_t i = 0; i < config.engineCtrls.size(); i++)
+    {
+        std::string name = config.engineCtrls[i], value;
+        size_t eq = name.find('=');
+        if (eq != std::string::npos)
+        {
+            value = name.substr(eq + 1);
+            name  = name.substr(0, eq);
+        }
+        if (!ENGINE_ctrl_cmd_string(e, name.c_str(), eq != std::string::npos ? value.c_str() : NULL, 0))
+        {
+            fprintf(stderr, "Engine control '%s' failed\n", config.engineCtrls[i].c_str());
+            ENGINE_free(e);
+            return NULL;
+        }
     }
 
-  return function_status;
+    if (!ENGINE_init(e))
+    {
+        fprintf(stderr, "Engine '%s' init failed\n", config.engineId.c_str());
+        ENGINE_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -b sw|engine       backend (default sw)\n"
+        "  -c curve[,curve]   curves for sw (default secp256k1,prime256v1,secp384r1,secp521r1)\n"
+        "  -t n[,n]           thread counts (default 1)\n"
+        "  -n iterations      per thread and operation (default 1000)\n"
+        "  -e engine          engine id (default tpm20e_v2)\n"
+        "  -k key_id          engine private key id, e.g. \"0x81020001;password\"\n"
+        "  -E NAME=VALUE      engine control command, may be repeated\n"
+        "  -f csv|json        output format (default csv)\n"
+        "  -o file            output file (default stdout)\n",
+        name);
 }
 
 int main( int argc , char * argv[] )
 {
-    unsigned char hash[] = "c7fbca202a95a570285e3d700eb04ca2";
-    int status = create_signature(hash);
-    return(0) ;
+    Config config;
+    config.backend    = "sw";
+    config.engineId   = "tpm20e_v2";
+    config.iterations = 1000;
+    config.format     = "csv";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:t:n:e:k:E:f:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b': config.backend = optarg; break;
+        case 'c': config.curves = splitList(optarg); break;
+        case 't':
+            {
+                std::vector<std::string> list = splitList(optarg);
+                for (size_t i = 0; i < list.size(); i++)
+                    config.threads.push_back(atoi(list[i].c_str()));
+            }
+            break;
+        case 'n': config.iterations = atoi(optarg); break;
+        case 'e': config.engineId = optarg; break;
+        case 'k': config.keyId = optarg; break;
+        case 'E': config.engineCtrls.push_back(optarg); break;
+        case 'f': config.format = optarg; break;
+        case 'o': config.outFile = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.curves.empty())
+        config.curves = splitList("secp256k1,prime256v1,secp384r1,secp521r1");
+    if (config.threads.empty())
+        config.threads.push_back(1);
+
+    bool engine = (config.backend == "engine");
+    if ((!engine && config.backend != "sw") ||
+        (engine && config.keyId.empty()) ||
+        (config.format != "csv" && config.format != "json") ||
+        config.iterations < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    for (size_t i = 0; i < config.threads.size(); i++)
+    {
+        if (config.threads[i] < 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    OpenSSL_add_all_algorithms();
+    ERR_load_crypto_strings();
+
+    ENGINE *e = NULL;
+    EC_KEY *engineKey = NULL;
+    if (engine)
+    {
+        if ((e = openEngine(config)) == NULL)
+            return 1;
+
+        EVP_PKEY *pkey = ENGINE_load_private_key(e, config.keyId.c_str(), NULL, NULL);
+        if (pkey == NULL || (engineKey = EVP_PKEY_get1_EC_KEY(pkey)) == NULL)
+        {
+            fprintf(stderr, "Cannot load EC key '%s' from engine\n", config.keyId.c_str());
+            ERR_print_errors_fp(stderr);
+            EVP_PKEY_free(pkey);
+            ENGINE_finish(e);
+            ENGINE_free(e);
+            return 1;
+        }
+        EVP_PKEY_free(pkey);
+
+        // The curve is the TPM key's
+        config.curves.assign(1, "");
+    }
+
+    std::vector<Result> results;
+    int status = 0;
+    for (size_t c = 0; c < config.curves.size(); c++)
+        for (size_t t = 0; t < config.threads.size(); t++)
+            if (!runBenchmark(config, config.curves[c], config.threads[t], engineKey, results))
+                status = 1;
+
+    writeResults(config, results);
+
+    EC_KEY_free(engineKey);
+    if (e != NULL)
+    {
+        ENGINE_finish(e);
+        ENGINE_free(e);
+    }
+    return status;
 }
@@ -28,6 +28,8 @@
 #include <sapi/tpm20.h>
 #include "sample.h"
 #include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
 
 TSS2_RC GetBlockSizeInBits( TPMI_ALG_SYM algorithm, UINT32 *blockSizeInBits )
 {
@@ -124,7 +126,7 @@ UINT32 LoadSessionEncryptDecryptKey( TPMT_SYM_DEF *symmetric, TPM2B_MAX_BUFFER *
     inPublic.t.publicArea.parameters.symDetail.sym.mode = symmetric->mode;
     inPublic.t.publicArea.unique.sym.t.size = 0;
 
-    sysContext = InitSysContext( 1000, resMgrTctiContext, &abiVersion );
+    sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
     if( sysContext == 0 )
     {
         return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
@@ -133,12 +135,12 @@ UINT32 LoadSessionEncryptDecryptKey( TPMT_SYM_DEF *symmetric, TPM2B_MAX_BUFFER *
     keyName->t.size = sizeof( *keyName ) - 2;
     rval = Tss2_Sys_LoadExternal( sysContext, 0, &inPrivate, &inPublic, TPM_RH_NULL, keyHandle, keyName, 0 );
 
-    TeardownSysContext( &sysContext );
+    ReturnSysContext( &sysContext, rval );
     
     return rval;
 }
 
-TSS2_RC EncryptCFB( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX_BUFFER *clearData, TPM2B_AUTH *authValue )
+TSS2_RC TpmEncryptCFB( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX_BUFFER *clearData, TPM2B_AUTH *authValue )
 {
     TSS2_RC rval = TSS2_RC_SUCCESS;
     TPM2B_MAX_BUFFER encryptKey;
@@ -157,12 +159,9 @@ TSS2_RC EncryptCFB( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX
     // Authorization array for command (only has one auth structure).
     TSS2_SYS_CMD_AUTHS sessionsData = { 1, &sessionDataArray[0] };
 
-    sysContext = InitSysContext( 1000, resMgrTctiContext, &abiVersion );
+    sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
     if( sysContext == 0 )
-    {
-        TeardownSysContext( &sysContext );
-        return TSS2_APP_RC_TEARDOWN_SYS_CONTEXT_FAILED;
-    }
+        return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
 
     rval = GenerateSessionEncryptDecryptKey( session, &encryptKey, &ivIn, authValue );
 
@@ -180,18 +179,23 @@ TSS2_RC EncryptCFB( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX
             ivOut.t.size = sizeof( ivOut ) - 2;
             rval = Tss2_Sys_EncryptDecrypt( sysContext, keyHandle, &sessionsData, NO, TPM_ALG_CFB, &ivIn,
                     clearData, encryptedData, &ivOut, 0 );
+            // Flush the key even if the command failed, it would leak a slot otherwise
             if( rval == TSS2_RC_SUCCESS )
             {
                 rval = Tss2_Sys_FlushContext( sysContext, keyHandle );
             }
+            else
+            {
+                Tss2_Sys_FlushContext( sysContext, keyHandle );
+            }
         }
     }
-    TeardownSysContext( &sysContext );
+    ReturnSysContext( &sysContext, rval );
     
     return rval;
 }
 
-TSS2_RC DecryptCFB( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUFFER *encryptedData, TPM2B_AUTH *authValue )
+TSS2_RC TpmDecryptCFB( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUFFER *encryptedData, TPM2B_AUTH *authValue )
 {
     TSS2_RC rval = TSS2_RC_SUCCESS;
     TPM2B_MAX_BUFFER encryptKey;
@@ -211,12 +215,9 @@ TSS2_RC DecryptCFB( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUF
     TSS2_SYS_CMD_AUTHS sessionsData = { 1, &sessionDataArray[0] };
 
 
-    sysContext = InitSysContext( 1000, resMgrTctiContext, &abiVersion );
+    sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
     if( sysContext == 0 )
-    {
-        TeardownSysContext( &sysContext );
-        return TSS2_APP_RC_TEARDOWN_SYS_CONTEXT_FAILED;
-    }
+        return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
 
     rval = GenerateSessionEncryptDecryptKey( session, &encryptKey, &ivIn, authValue );
 
@@ -232,18 +233,95 @@ TSS2_RC DecryptCFB( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUF
             sessionData.hmac.t.size = 0;
             rval = Tss2_Sys_EncryptDecrypt( sysContext, keyHandle, &sessionsData, YES, TPM_ALG_CFB, &ivIn,
                     encryptedData, clearData, &ivOut, 0 );
+            // Flush the key even if the command failed, it would leak a slot otherwise
             if( rval == TSS2_RC_SUCCESS )
             {
                 rval = Tss2_Sys_FlushContext( sysContext, keyHandle );
             }
+            else
+            {
+                Tss2_Sys_FlushContext( sysContext, keyHandle );
+            }
         }
     }
-    TeardownSysContext( &sysContext );
+    ReturnSysContext( &sysContext, rval );
     
     return rval;
 }
 
 
+//
+// Software versions of TpmEncryptCFB/TpmDecryptCFB.  The key and IV come
+// from GenerateSessionEncryptDecryptKey just like for the TPM path, but the
+// AES-CFB pass runs in-process (OpenSSL uses AES-NI where the CPU has it)
+// instead of LoadExternal + EncryptDecrypt + FlushContext on the TPM.
+//
+static const EVP_CIPHER *SwCfbCipher( TPMT_SYM_DEF *symmetric )
+{
+    if( symmetric->algorithm != TPM_ALG_AES )
+        return 0;
+
+    switch( symmetric->keyBits.sym )
+    {
+        case 128: return EVP_aes_128_cfb128();
+        case 192: return EVP_aes_192_cfb128();
+        case 256: return EVP_aes_256_cfb128();
+        default:  return 0;
+    }
+}
+
+static TSS2_RC SwCryptCFB( SESSION *session, TPM2B_MAX_BUFFER *outputData, TPM2B_MAX_BUFFER *inputData,
+    TPM2B_AUTH *authValue, int encrypt )
+{
+    TSS2_RC rval = TSS2_RC_SUCCESS;
+    TPM2B_MAX_BUFFER cfbKey;
+    TPM2B_IV ivIn;
+    const EVP_CIPHER *cipher;
+    EVP_CIPHER_CTX ctx;
+    int outLen = 0, finalLen = 0;
+    int ok;
+
+    cipher = SwCfbCipher( &session->symmetric );
+    if( cipher == 0 )
+        return TSS2_APP_RC_BAD_ALGORITHM;
+
+    if( inputData->t.size > sizeof( outputData->t.buffer ) )
+        return APPLICATION_ERROR( TSS2_BASE_RC_INSUFFICIENT_BUFFER );
+
+    rval = GenerateSessionEncryptDecryptKey( session, &cfbKey, &ivIn, authValue );
+    if( rval == TSS2_RC_SUCCESS )
+    {
+        EVP_CIPHER_CTX_init( &ctx );
+        ok = EVP_CipherInit_ex( &ctx, cipher, 0, cfbKey.t.buffer, ivIn.t.buffer, encrypt );
+        if( ok )
+            ok = EVP_CipherUpdate( &ctx, outputData->t.buffer, &outLen, inputData->t.buffer, inputData->t.size );
+        if( ok )
+            ok = EVP_CipherFinal_ex( &ctx, outputData->t.buffer + outLen, &finalLen );
+        EVP_CIPHER_CTX_cleanup( &ctx );
+
+        if( ok )
+            outputData->t.size = (UINT16)( outLen + finalLen );
+        else
+            rval = APPLICATION_ERROR( TPM_RC_FAILURE );
+    }
+
+    OPENSSL_cleanse( &cfbKey, sizeof( cfbKey ) );
+    OPENSSL_cleanse( &ivIn, sizeof( ivIn ) );
+
+    return rval;
+}
+
+TSS2_RC SwEncryptCFB( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX_BUFFER *clearData, TPM2B_AUTH *authValue )
+{
+    return SwCryptCFB( session, encryptedData, clearData, authValue, 1 );
+}
+
+TSS2_RC SwDecryptCFB( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUFFER *encryptedData, TPM2B_AUTH *authValue )
+{
+    return SwCryptCFB( session, clearData, encryptedData, authValue, 0 );
+}
+
+
 TSS2_RC EncryptDecryptXOR( SESSION *session, TPM2B_MAX_BUFFER *outputData, TPM2B_MAX_BUFFER *inputData, TPM2B_AUTH *authValue )
 {
     TSS2_RC rval = TSS2_RC_SUCCESS;
@@ -274,7 +352,7 @@ TSS2_RC EncryptCommandParam( SESSION *session, TPM2B_MAX_BUFFER *encryptedData,
     if( session->symmetric.algorithm == TPM_ALG_AES )
     {
         // CFB mode encryption.
-        rval = EncryptCFB( session, encryptedData, clearData, authValue );
+        rval = EncryptCFBFunctionPtr( session, encryptedData, clearData, authValue );
     }
     else
     {
@@ -292,7 +370,7 @@ TSS2_RC DecryptResponseParam( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM
     if( session->symmetric.algorithm == TPM_ALG_AES )
     {
         // CFB mode decryption.
-        rval = DecryptCFB( session, clearData, encryptedData, authValue );
+        rval = DecryptCFBFunctionPtr( session, clearData, encryptedData, authValue );
     }
     else
     {
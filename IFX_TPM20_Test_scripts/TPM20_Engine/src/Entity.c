@@ -25,9 +25,93 @@
 // THE POSSIBILITY OF SUCH DAMAGE.
 //**********************************************************************;
 
+#include <stdlib.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
 #include <sapi/tpm20.h>
 #include "sample.h"
 
+//
+// Entities are kept in a chained hash table keyed by handle.  Nodes are
+// heap allocated and never move, so pointers returned by GetEntity stay
+// valid until the entity is deleted.
+//
+#define ENTITY_BUCKETS_INITIAL 64
+#define ENTITY_MAX_LOAD 2
+
+typedef struct ENTITY_NODE {
+    ENTITY entity;
+    struct ENTITY_NODE *next;
+} ENTITY_NODE;
+
+static ENTITY_NODE **entityBuckets = 0;
+static UINT32 entityBucketCount = 0;
+static UINT32 entityCount = 0;
+static pthread_mutex_t entitiesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static UINT32 EntityBucket( TPM_HANDLE entityHandle, UINT32 bucketCount )
+{
+    // Handles within a type are sequential; spread them over the table.
+    return ( ( (UINT32)entityHandle * 2654435761u ) >> 16 ) & ( bucketCount - 1 );
+}
+
+static void FreeEntityNode( ENTITY_NODE *node )
+{
+    // Auth values must not linger on the heap
+    OPENSSL_cleanse( node, sizeof( ENTITY_NODE ) );
+    free( node );
+}
+
+// Called with entitiesMutex held.
+static ENTITY_NODE *FindEntityNode( TPM_HANDLE entityHandle )
+{
+    ENTITY_NODE *node;
+
+    if( entityBuckets == 0 )
+        return 0;
+
+    for( node = entityBuckets[EntityBucket( entityHandle, entityBucketCount )];
+            node != 0 && node->entity.entityHandle != entityHandle;
+            node = node->next )
+        ;
+    return node;
+}
+
+// Called with entitiesMutex held.  Doubles the bucket array once the
+// average chain gets longer than ENTITY_MAX_LOAD.
+static TPM_RC GrowEntityBuckets( void )
+{
+    ENTITY_NODE **newBuckets, *node, *next;
+    UINT32 newCount, i, bucket;
+
+    if( entityBuckets != 0 && entityCount < entityBucketCount * ENTITY_MAX_LOAD )
+        return TPM_RC_SUCCESS;
+
+    newCount = entityBuckets == 0 ? ENTITY_BUCKETS_INITIAL : entityBucketCount * 2;
+    newBuckets = calloc( newCount, sizeof( ENTITY_NODE * ) );
+    if( newBuckets == 0 )
+    {
+        // An existing table still works, just with longer chains
+        return entityBuckets != 0 ? TPM_RC_SUCCESS : TPM_RC_FAILURE;
+    }
+
+    for( i = 0; i < entityBucketCount; i++ )
+    {
+        for( node = entityBuckets[i]; node != 0; node = next )
+        {
+            next = node->next;
+            bucket = EntityBucket( node->entity.entityHandle, newCount );
+            node->next = newBuckets[bucket];
+            newBuckets[bucket] = node;
+        }
+    }
+
+    free( entityBuckets );
+    entityBuckets = newBuckets;
+    entityBucketCount = newCount;
+    return TPM_RC_SUCCESS;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,11 +119,23 @@ extern "C" {
 
 void InitEntities()
 {
-    int i;
-    for( i = 0; i < MAX_NUM_ENTITIES; i++ )
+    ENTITY_NODE *node, *next;
+    UINT32 i;
+
+    pthread_mutex_lock( &entitiesMutex );
+    for( i = 0; i < entityBucketCount; i++ )
     {
-        entities[i].entityHandle = TPM_HT_NO_HANDLE;
+        for( node = entityBuckets[i]; node != 0; node = next )
+        {
+            next = node->next;
+            FreeEntityNode( node );
+        }
     }
+    free( entityBuckets );
+    entityBuckets = 0;
+    entityBucketCount = 0;
+    entityCount = 0;
+    pthread_mutex_unlock( &entitiesMutex );
 }
 
 #ifdef __cplusplus
@@ -48,76 +144,100 @@ void InitEntities()
 
 TPM_RC AddEntity( TPM_HANDLE entityHandle, TPM2B_AUTH *auth )
 {
-    int i;
-    TPM_RC rval = TPM_RC_FAILURE;
+    ENTITY_NODE *node;
+    UINT32 bucket;
+    TPM_RC rval;
     
-    for( i = 0; i < MAX_NUM_ENTITIES; i++ )
+    pthread_mutex_lock( &entitiesMutex );
+
+    // Re-adding a handle just updates its authValue.
+    node = FindEntityNode( entityHandle );
+    if( node != 0 )
+    {
+        CopySizedByteBuffer( &( node->entity.entityAuth.b ), &( auth->b ) );
+        pthread_mutex_unlock( &entitiesMutex );
+        return TPM_RC_SUCCESS;
+    }
+
+    rval = GrowEntityBuckets();
+    if( rval == TPM_RC_SUCCESS )
     {
-        if( entities[i].entityHandle == TPM_HT_NO_HANDLE )
+        node = calloc( 1, sizeof( ENTITY_NODE ) );
+        if( node == 0 )
         {
-            entities[i].entityHandle = entityHandle; 
-            CopySizedByteBuffer( &( entities[i].entityAuth.b ), &( auth->b ) );
+            rval = TPM_RC_FAILURE;
+        }
+        else
+        {
+            node->entity.entityHandle = entityHandle; 
+            CopySizedByteBuffer( &( node->entity.entityAuth.b ), &( auth->b ) );
 
-            if( ( entityHandle >> HR_SHIFT ) == TPM_HT_NV_INDEX )
-            {
-                entities[i].nvNameChanged = 0;
-            }
-            
-            rval = TPM_RC_SUCCESS;
-            break;
+            bucket = EntityBucket( entityHandle, entityBucketCount );
+            node->next = entityBuckets[bucket];
+            entityBuckets[bucket] = node;
+            entityCount++;
         }
     }
+
+    pthread_mutex_unlock( &entitiesMutex );
     return rval;
 }
 
 TPM_RC DeleteEntity( TPM_HANDLE entityHandle )
 {
-    int i;
+    ENTITY_NODE **link, *node;
     TPM_RC rval = TPM_RC_FAILURE;
     
-    for( i = 0; i < MAX_NUM_ENTITIES; i++ )
+    pthread_mutex_lock( &entitiesMutex );
+    if( entityBuckets != 0 )
     {
-        if( entities[i].entityHandle == entityHandle )
+        for( link = &entityBuckets[EntityBucket( entityHandle, entityBucketCount )];
+                *link != 0; link = &( *link )->next )
         {
-            entities[i].entityHandle = TPM_HT_NO_HANDLE; 
-            rval = TPM_RC_SUCCESS;
-            break;
+            if( ( *link )->entity.entityHandle == entityHandle )
+            {
+                node = *link;
+                *link = node->next;
+                FreeEntityNode( node );
+                entityCount--;
+                rval = TPM_RC_SUCCESS;
+                break;
+            }
         }
     }
+    pthread_mutex_unlock( &entitiesMutex );
     return rval;
 }
 
 TPM_RC GetEntityAuth( TPM_HANDLE entityHandle, TPM2B_AUTH *auth )
 {
-    int i;
+    ENTITY_NODE *node;
     TPM_RC rval = TPM_RC_FAILURE;
     
-    for( i = 0; i < MAX_NUM_ENTITIES; i++ )
+    pthread_mutex_lock( &entitiesMutex );
+    node = FindEntityNode( entityHandle );
+    if( node != 0 )
     {
-        if( entities[i].entityHandle == entityHandle )
-        {
-            CopySizedByteBuffer( &( auth->b ), &( entities[i].entityAuth.b ) );
-            rval = TPM_RC_SUCCESS;
-            break;
-        }
+        CopySizedByteBuffer( &( auth->b ), &( node->entity.entityAuth.b ) );
+        rval = TPM_RC_SUCCESS;
     }
+    pthread_mutex_unlock( &entitiesMutex );
     return rval;
 }
 
 
 TPM_RC GetEntity( TPM_HANDLE entityHandle, ENTITY **entity )
 {
-    int i;
+    ENTITY_NODE *node;
     TPM_RC rval = TPM_RC_FAILURE;
     
-    for( i = 0; i < MAX_NUM_ENTITIES; i++ )
+    pthread_mutex_lock( &entitiesMutex );
+    node = FindEntityNode( entityHandle );
+    if( node != 0 )
     {
-        if( entities[i].entityHandle == entityHandle )
-        {
-            *entity = &( entities[i] );
-            rval = TPM_RC_SUCCESS;
-        }
+        *entity = &( node->entity );
+        rval = TPM_RC_SUCCESS;
     }
+    pthread_mutex_unlock( &entitiesMutex );
     return rval;
 }
-
@@ -29,13 +29,15 @@
 #include "sample.h"
 
 
-UINT32 LoadExternalHMACKey( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM_HANDLE *keyHandle, TPM2B_NAME *keyName )
+//
+// Loads the HMAC key through the given sys context.
+//
+UINT32 LoadExternalHMACKeyOnSysContext( TSS2_SYS_CONTEXT *sysContext, TPMI_ALG_HASH hashAlg, TPM2B *key,
+    TPM_HANDLE *keyHandle, TPM2B_NAME *keyName )
 {
     TPM2B keyAuth;
     TPM2B_SENSITIVE inPrivate;
     TPM2B_PUBLIC inPublic;
-    UINT32 rval;
-    TSS2_SYS_CONTEXT *sysContext;
     
     keyAuth.size = 0;
 
@@ -55,17 +57,22 @@ UINT32 LoadExternalHMACKey( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM_HANDLE *keyHa
     inPublic.t.publicArea.parameters.keyedHashDetail.scheme.details.hmac.hashAlg = hashAlg;
     inPublic.t.publicArea.unique.keyedHash.t.size = 0;
 
-    sysContext = InitSysContext( 1000, resMgrTctiContext, &abiVersion );
+    keyName->t.size = sizeof( TPM2B_NAME ) - 2;
+    return Tss2_Sys_LoadExternal( sysContext, 0, &inPrivate, &inPublic, TPM_RH_NULL, keyHandle, keyName, 0 );
+}
+
+UINT32 LoadExternalHMACKey( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM_HANDLE *keyHandle, TPM2B_NAME *keyName )
+{
+    UINT32 rval;
+    TSS2_SYS_CONTEXT *sysContext;
+
+    sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
     if( sysContext == 0 )
-    {
-        TeardownSysContext( &sysContext );
         return TSS2_APP_ERROR_LEVEL + TPM_RC_FAILURE;
-    }
 
-    keyName->t.size = sizeof( TPM2B_NAME ) - 2;
-    rval = Tss2_Sys_LoadExternal( sysContext, 0, &inPrivate, &inPublic, TPM_RH_NULL, keyHandle, keyName, 0 );
+    rval = LoadExternalHMACKeyOnSysContext( sysContext, hashAlg, key, keyHandle, keyName );
 
-    TeardownSysContext( &sysContext );
+    ReturnSysContext( &sysContext, rval );
     
     return rval;
 }
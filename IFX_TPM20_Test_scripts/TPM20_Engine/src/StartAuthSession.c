@@ -29,96 +29,212 @@
 #include "sample.h"
 #include <stdlib.h>
 
+#include <string.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+
 #define SESSIONS_ARRAY_COUNT MAX_NUM_SESSIONS+1
 
+//
+// Open-addressed (linear probing) table of session pointers keyed by
+// session handle.  Twice as many buckets as slots keeps probes short.
+//
+#define SESSIONS_TABLE_SIZE 256
+
+#if SESSIONS_TABLE_SIZE < 2 * ( SESSIONS_ARRAY_COUNT )
+#error SESSIONS_TABLE_SIZE must be at least twice the number of sessions
+#endif
+
 typedef struct {
-    SESSION session;
-    void *nextEntry;
-} SESSION_LIST_ENTRY;
+    SESSION session;                // Must stay first, see SessionToSlot()
+    INT16 nextFree;
+    UINT8 inUse;
+} SESSION_SLOT;
+
+static SESSION_SLOT sessionSlots[SESSIONS_ARRAY_COUNT];
+static SESSION *sessionsTable[SESSIONS_TABLE_SIZE];
+static INT16 firstFreeSlot = -1;
+static UINT8 sessionsTableInitialized = 0;
+static pthread_mutex_t sessionsMutex = PTHREAD_MUTEX_INITIALIZER;
 
-SESSION_LIST_ENTRY *sessionsList = 0;
 INT16 sessionEntriesUsed = 0;
 
+static UINT32 SessionBucket( TPMI_SH_AUTH_SESSION sessionHandle )
+{
+    // Handles are mostly sequential; spread them over the table anyway.
+    return ( (UINT32)sessionHandle * 2654435761u ) >> 24 & ( SESSIONS_TABLE_SIZE - 1 );
+}
 
-TPM_RC AddSession( SESSION_LIST_ENTRY **sessionEntry )
+static SESSION_SLOT *SessionToSlot( SESSION *session )
 {
-    SESSION_LIST_ENTRY **newEntry;
-    
-//    TpmClientPrintf( 0, "In AddSession\n" );
+    SESSION_SLOT *slot = (SESSION_SLOT *)session;
 
-    // find end of list.
-    for( newEntry = &sessionsList; *newEntry != 0; *newEntry = ( (SESSION_LIST_ENTRY *)*newEntry)->nextEntry )
-        ;
+    if( slot < &sessionSlots[0] || slot >= &sessionSlots[SESSIONS_ARRAY_COUNT] )
+        return 0;
+    return slot;
+}
+
+// Called with sessionsMutex held.
+static void InitSessionsTableLocked( void )
+{
+    INT16 i;
 
-    // allocate space for session structure.
-    *newEntry = malloc( sizeof( SESSION_LIST_ENTRY ) );
-    if( *newEntry != 0 )
+    memset( sessionsTable, 0, sizeof( sessionsTable ) );
+    for( i = 0; i < SESSIONS_ARRAY_COUNT; i++ )
     {
-        *sessionEntry = *newEntry;
-        (*sessionEntry)->nextEntry = 0;
-        sessionEntriesUsed++;
-        return TPM_RC_SUCCESS;
+        sessionSlots[i].nextFree = ( i + 1 < SESSIONS_ARRAY_COUNT ) ? i + 1 : -1;
+        sessionSlots[i].inUse = 0;
+    }
+    firstFreeSlot = 0;
+    sessionEntriesUsed = 0;
+    sessionsTableInitialized = 1;
+}
+
+// Called with sessionsMutex held.  Returns the bucket holding the session
+// or -1.
+static int FindSessionBucket( TPMI_SH_AUTH_SESSION sessionHandle )
+{
+    UINT32 bucket = SessionBucket( sessionHandle );
+    UINT32 probes;
+
+    for( probes = 0; probes < SESSIONS_TABLE_SIZE && sessionsTable[bucket] != 0; probes++ )
+    {
+        if( sessionsTable[bucket]->sessionHandle == sessionHandle )
+            return (int)bucket;
+        bucket = ( bucket + 1 ) & ( SESSIONS_TABLE_SIZE - 1 );
     }
-    else
+    return -1;
+}
+
+// Called with sessionsMutex held.  Removes a bucket and shifts the
+// following entries of its probe run back, so that no tombstones are
+// needed.
+static void RemoveSessionBucket( UINT32 hole )
+{
+    UINT32 bucket = hole;
+    UINT32 home;
+
+    sessionsTable[hole] = 0;
+    while( 1 )
     {
-        return TSS2_APP_RC_SESSION_SLOT_NOT_FOUND;
+        bucket = ( bucket + 1 ) & ( SESSIONS_TABLE_SIZE - 1 );
+        if( sessionsTable[bucket] == 0 )
+            break;
+
+        // Move the entry into the hole unless its home bucket lies
+        // cyclically in ( hole, bucket ].
+        home = SessionBucket( sessionsTable[bucket]->sessionHandle );
+        if( ( bucket > hole && ( home <= hole || home > bucket ) ) ||
+            ( bucket < hole && ( home <= hole && home > bucket ) ) )
+        {
+            sessionsTable[hole] = sessionsTable[bucket];
+            sessionsTable[bucket] = 0;
+            hole = bucket;
+        }
     }
-} 
+}
 
+void InitSessionsTable( void )
+{
+    pthread_mutex_lock( &sessionsMutex );
+    InitSessionsTableLocked();
+    pthread_mutex_unlock( &sessionsMutex );
+}
 
-void DeleteSession( SESSION *session )
+//
+// Takes a slot from the pool.  The session only becomes visible to
+// GetSessionStruct once its handle is known (see RegisterSession).
+//
+static TPM_RC AddSession( SESSION **session )
 {
-    SESSION_LIST_ENTRY *predSession;
-    void *newNextEntry;
+    SESSION_SLOT *slot;
+    TPM_RC rval = TSS2_APP_RC_SESSION_SLOT_NOT_FOUND;
 
-//    TpmClientPrintf( 0, "In DeleteSession\n" );
-    
-    if( session == &sessionsList->session )
-        sessionsList = 0;
-    else
+    pthread_mutex_lock( &sessionsMutex );
+    if( !sessionsTableInitialized )
+        InitSessionsTableLocked();
+
+    if( firstFreeSlot >= 0 )
     {
-        // Find predecessor.
-        for( predSession = sessionsList;
-                predSession != 0 && &( ( ( SESSION_LIST_ENTRY *)predSession->nextEntry )->session ) != session;
-                predSession = predSession->nextEntry )
-            ;
+        slot = &sessionSlots[firstFreeSlot];
+        firstFreeSlot = slot->nextFree;
+        slot->nextFree = -1;
+        slot->inUse = 1;
+        memset( &slot->session, 0, sizeof( SESSION ) );
+        *session = &slot->session;
+        sessionEntriesUsed++;
+        rval = TPM_RC_SUCCESS;
+    }
+    pthread_mutex_unlock( &sessionsMutex );
 
-        if( predSession != 0 )
+    return rval;
+}
+
+static TPM_RC RegisterSession( SESSION *session )
+{
+    UINT32 bucket = SessionBucket( session->sessionHandle );
+    TPM_RC rval = TSS2_APP_RC_SESSION_SLOT_NOT_FOUND;
+    UINT32 probes;
+
+    pthread_mutex_lock( &sessionsMutex );
+    for( probes = 0; probes < SESSIONS_TABLE_SIZE; probes++ )
+    {
+        if( sessionsTable[bucket] == 0 || sessionsTable[bucket] == session )
         {
-            sessionEntriesUsed--;
+            sessionsTable[bucket] = session;
+            rval = TPM_RC_SUCCESS;
+            break;
+        }
+        bucket = ( bucket + 1 ) & ( SESSIONS_TABLE_SIZE - 1 );
+    }
+    pthread_mutex_unlock( &sessionsMutex );
+
+    return rval;
+}
 
-            newNextEntry = &( (SESSION_LIST_ENTRY *)predSession->nextEntry)->nextEntry;
+void DeleteSession( SESSION *session )
+{
+    SESSION_SLOT *slot = SessionToSlot( session );
+    int bucket;
 
-            free( predSession->nextEntry );
+    if( slot == 0 )
+        return;
 
-            predSession->nextEntry = newNextEntry;
-        }
+    pthread_mutex_lock( &sessionsMutex );
+
+    bucket = FindSessionBucket( session->sessionHandle );
+    if( bucket >= 0 && sessionsTable[bucket] == session )
+        RemoveSessionBucket( (UINT32)bucket );
+
+    if( slot->inUse )
+    {
+        // Session keys and authValues must not linger in the pool
+        OPENSSL_cleanse( &slot->session, sizeof( SESSION ) );
+        slot->inUse = 0;
+        slot->nextFree = firstFreeSlot;
+        firstFreeSlot = (INT16)( slot - sessionSlots );
+        sessionEntriesUsed--;
     }
+
+    pthread_mutex_unlock( &sessionsMutex );
 }
 
 
 TPM_RC GetSessionStruct( TPMI_SH_AUTH_SESSION sessionHandle, SESSION **session )
 {
     TPM_RC rval = TSS2_APP_RC_GET_SESSION_STRUCT_FAILED;
-    SESSION_LIST_ENTRY *sessionEntry;
-
-    TpmClientPrintf( 0, "In GetSessionStruct\n" );
+    int bucket;
 
     if( session != 0 )
     {
-        //
-        // Get pointer to session structure using the sessionHandle
-        //
-        for( sessionEntry = sessionsList;
-                sessionEntry != 0 && sessionEntry->session.sessionHandle != sessionHandle;
-                sessionEntry = sessionEntry->nextEntry )
-            ;
-
-        if( sessionEntry != 0 )
+        pthread_mutex_lock( &sessionsMutex );
+        bucket = FindSessionBucket( sessionHandle );
+        if( bucket >= 0 )
         {
-            *session = &sessionEntry->session;
+            *session = sessionsTable[bucket];
             rval = TSS2_RC_SUCCESS;
         }
+        pthread_mutex_unlock( &sessionsMutex );
     }
     return rval;
 }
@@ -128,8 +244,7 @@ TPM_RC GetSessionAlgId( TPMI_SH_AUTH_SESSION sessionHandle, TPMI_ALG_HASH *sessi
     TPM_RC rval = TSS2_APP_RC_GET_SESSION_ALG_ID_FAILED;
     SESSION *session;
 
-    TpmClientPrintf( 0, "In GetSessionAlgId\n" );
-    
+
     rval = GetSessionStruct( sessionHandle, &session );
 
     if( rval == TSS2_RC_SUCCESS )
@@ -164,7 +279,7 @@ TPM_RC StartAuthSession( SESSION *session )
     
     key.t.size = 0;
 
-    tmpSysContext = InitSysContext( 1000, resMgrTctiContext, &abiVersion );
+    tmpSysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
     if( tmpSysContext == 0 )
         return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
 
@@ -181,6 +296,9 @@ TPM_RC StartAuthSession( SESSION *session )
             &( session->symmetric ), session->authHash, &( session->sessionHandle ),
             &( session->nonceNewer ), 0 );
 
+    // Give the context back before KDFa, which may need one itself
+    ReturnSysContext( &tmpSysContext, rval );
+
     if( rval == TPM_RC_SUCCESS )
     {
         if( session->tpmKey == TPM_RH_NULL )
@@ -197,17 +315,11 @@ TPM_RC StartAuthSession( SESSION *session )
             // Generate the key used as input to the KDF.
             rval = ConcatSizedByteBuffer( (TPM2B_MAX_BUFFER *)&key, &( session->authValueBind.b ) );
             if( rval != TPM_RC_SUCCESS )
-            {
-                TeardownSysContext( &tmpSysContext );
                 return(  rval );
-            }
 
             rval = ConcatSizedByteBuffer( (TPM2B_MAX_BUFFER *)&key, &( session->salt.b ) );
             if( rval != TPM_RC_SUCCESS )
-            {
-                TeardownSysContext( &tmpSysContext );
                 return( rval );
-            }
 
             bytes = GetDigestSize( session->authHash );
 
@@ -222,10 +334,7 @@ TPM_RC StartAuthSession( SESSION *session )
             }
 
             if( rval != TPM_RC_SUCCESS )
-            {
-                TeardownSysContext( &tmpSysContext );
                 return( TSS2_APP_RC_CREATE_SESSION_KEY_FAILED );
-            }
         }
 
         session->nonceTpmDecrypt.b.size = 0;
@@ -233,8 +342,6 @@ TPM_RC StartAuthSession( SESSION *session )
         session->nvNameChanged = 0;
     }
 
-    TeardownSysContext( &tmpSysContext );
-
     return rval;
 }
 
@@ -254,13 +361,11 @@ TPM_RC StartAuthSessionWithParams( SESSION **session,
     TPM_SE sessionType, TPMT_SYM_DEF *symmetric, TPMI_ALG_HASH algId )
 {
     TPM_RC rval;
-    SESSION_LIST_ENTRY *sessionEntry;
     
-    rval = AddSession( &sessionEntry );
+    rval = AddSession( session );
     if( rval == TSS2_RC_SUCCESS )
     {
-        *session = &sessionEntry->session;
-        
+
         // Copy handles to session struct.
         (*session)->bind = bind;
         (*session)->tpmKey = tpmKey;
@@ -307,10 +412,16 @@ TPM_RC StartAuthSessionWithParams( SESSION **session,
 
 
         rval = StartAuthSession( *session );
-    }
-    else
-    {
-        DeleteSession( *session );
+
+        // Only now the handle is known and the session can be looked up
+        if( rval == TPM_RC_SUCCESS )
+            rval = RegisterSession( *session );
+
+        if( rval != TPM_RC_SUCCESS )
+        {
+            DeleteSession( *session );
+            *session = 0;
+        }
     }
     return( rval );
 }
@@ -0,0 +1,101 @@
+#include <sapi/tpm20.h>
+#include <openssl/evp.h>
+#include "changeEndian.h"
+#include "sample.h"
+
+//
+// Software version of TpmCalcPHash:  hashes
+//     [responseCode ||] commandCode || name1 || name2 || parameters
+// with a streaming digest that reads the parameters directly from the
+// command/response buffer of the system context.  No copies, no TPM
+// commands and no limit on the parameter size.
+//
+// NOTE:  for calculating cpHash, set responseCode to TPM_RC_NO_RESPONSE; this
+// tells the function to leave it out of the calculation.
+//
+TPM_RC SwCalcPHash( TSS2_SYS_CONTEXT *sysContext, TPM_HANDLE handle1, TPM_HANDLE handle2,
+    TPMI_ALG_HASH authHash, TPM_RC responseCode, TPM2B_DIGEST *pHash )
+{
+    TPM_RC rval = TPM_RC_SUCCESS;
+    TPM2B_NAME name1;
+    TPM2B_NAME name2;
+    size_t parametersSize;
+    const uint8_t *startParams;
+    UINT8 cmdCode[4] = {0,0,0,0};
+    UINT32 marshalled;
+    const EVP_MD *md;
+    EVP_MD_CTX ctx;
+    unsigned int digestSize = 0;
+    int ok;
+
+    name1.b.size = name2.b.size = 0;
+    pHash->b.size = 0;
+
+    md = SwHashAlgToMd( authHash );
+    if( md == 0 )
+        return APPLICATION_ERROR( TPM_RC_HASH );
+    if( EVP_MD_size( md ) > (int)sizeof( pHash->t.buffer ) )
+        return APPLICATION_ERROR( TSS2_BASE_RC_INSUFFICIENT_BUFFER );
+
+    // Only get names and the cpBuffer for commands
+    if( responseCode == TPM_RC_NO_RESPONSE )
+    {
+        rval = TpmHandleToName( handle1, &name1 );
+        if( rval != TPM_RC_SUCCESS )
+            return rval;
+
+        rval = TpmHandleToName( handle2, &name2 );
+        if( rval != TPM_RC_SUCCESS )
+            return rval;
+
+        rval = Tss2_Sys_GetCpBuffer( sysContext, &parametersSize, &startParams );
+    }
+    else
+    {
+        rval = Tss2_Sys_GetRpBuffer( sysContext, &parametersSize, &startParams );
+    }
+    if( rval != TPM_RC_SUCCESS )
+        return rval;
+
+    rval = Tss2_Sys_GetCommandCode( sysContext, &cmdCode );
+    if( rval != TPM_RC_SUCCESS )
+        return rval;
+
+    EVP_MD_CTX_init( &ctx );
+    ok = EVP_DigestInit_ex( &ctx, md, 0 );
+
+    if( ok && responseCode != TPM_RC_NO_RESPONSE )
+    {
+        marshalled = CHANGE_ENDIAN_DWORD( responseCode );
+        ok = EVP_DigestUpdate( &ctx, &marshalled, 4 );
+    }
+    if( ok )
+    {
+        marshalled = CHANGE_ENDIAN_DWORD( *(UINT32 *)&cmdCode[0] );
+        ok = EVP_DigestUpdate( &ctx, &marshalled, 4 );
+    }
+    if( ok )
+        ok = EVP_DigestUpdate( &ctx, name1.t.name, name1.t.size );
+    if( ok )
+        ok = EVP_DigestUpdate( &ctx, name2.t.name, name2.t.size );
+    if( ok )
+        ok = EVP_DigestUpdate( &ctx, startParams, parametersSize );
+    if( ok )
+        ok = EVP_DigestFinal_ex( &ctx, pHash->t.buffer, &digestSize );
+
+    EVP_MD_CTX_cleanup( &ctx );
+
+    if( !ok )
+        return APPLICATION_ERROR( TPM_RC_FAILURE );
+
+    pHash->t.size = (UINT16)digestSize;
+
+#ifdef DEBUG
+    OpenOutFile( &outFp );
+    TpmClientPrintf( 0, "\n\nPHASH = " );
+    PrintSizedBuffer( &(pHash->b) );
+    CloseOutFile( &outFp );
+#endif
+
+    return TPM_RC_SUCCESS;
+}
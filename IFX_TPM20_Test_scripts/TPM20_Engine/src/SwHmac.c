@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <sapi/tpm20.h>
+#include "sample.h"
+
+//
+// Maps a TPM hash algorithm to the OpenSSL digest, or 0 if unsupported.
+//
+const EVP_MD *SwHashAlgToMd( TPMI_ALG_HASH hashAlg )
+{
+    switch( hashAlg )
+    {
+        case TPM_ALG_SHA1:   return EVP_sha1();
+        case TPM_ALG_SHA256: return EVP_sha256();
+        case TPM_ALG_SHA384: return EVP_sha384();
+        case TPM_ALG_SHA512: return EVP_sha512();
+        default:             return 0;
+    }
+}
+
+//
+// This function does an HMAC on a null-terminated list of input buffers,
+// like TpmHmac, but in software and without any TPM commands.
+//
+UINT32 SwHmac( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM2B **bufferList, TPM2B_DIGEST *result )
+{
+    const EVP_MD *md;
+    HMAC_CTX ctx;
+    unsigned int resultSize = 0;
+    int ok;
+    int i;
+
+    // Set result size to 0, in case any errors occur
+    result->b.size = 0;
+
+    md = SwHashAlgToMd( hashAlg );
+    if( md == 0 )
+        return TSS2_APP_ERROR_LEVEL + TPM_RC_HASH;
+
+    if( EVP_MD_size( md ) > (int)sizeof( result->t.buffer ) )
+        return TSS2_APP_ERROR_LEVEL + TPM_RC_SIZE;
+
+    HMAC_CTX_init( &ctx );
+    ok = HMAC_Init_ex( &ctx, key->buffer, key->size, md, 0 );
+    for( i = 0; ok && bufferList[i] != 0; i++ )
+    {
+        ok = HMAC_Update( &ctx, bufferList[i]->buffer, bufferList[i]->size );
+    }
+    if( ok )
+    {
+        ok = HMAC_Final( &ctx, result->t.buffer, &resultSize );
+    }
+    HMAC_CTX_cleanup( &ctx );
+
+    if( !ok )
+    {
+        OPENSSL_cleanse( result->t.buffer, sizeof( result->t.buffer ) );
+        return TSS2_APP_ERROR_LEVEL + TPM_RC_FAILURE;
+    }
+
+    result->t.size = (UINT16)resultSize;
+    return TPM_RC_SUCCESS;
+}
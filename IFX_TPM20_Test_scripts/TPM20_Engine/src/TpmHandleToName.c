@@ -54,24 +54,24 @@ UINT32 TpmHandleToName( TPM_HANDLE handle, TPM2B_NAME *name )
         switch( handle >> HR_SHIFT )
         {
             case TPM_HT_NV_INDEX:
-                sysContext = InitSysContext( 1000, resMgrTctiContext, &abiVersion );
+                sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
                 if( sysContext == 0 )
                     return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
 
                 nvPublic.t.size = 0;
                 rval = Tss2_Sys_NV_ReadPublic( sysContext, handle, 0, &nvPublic, name, 0 );
-                TeardownSysContext( &sysContext );
+                ReturnSysContext( &sysContext, rval );
                 break;  
 
             case TPM_HT_TRANSIENT:
             case TPM_HT_PERSISTENT:
-                sysContext = InitSysContext( 1000, resMgrTctiContext, &abiVersion );
+                sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
                 if( sysContext == 0 )
                     return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
 
                 public.t.size = 0;
 				rval = Tss2_Sys_ReadPublic( sysContext, handle, 0, &public, name, &qualifiedName, 0 );
-                TeardownSysContext( &sysContext );
+                ReturnSysContext( &sysContext, rval );
                 break;
                     
             default:
@@ -42,13 +42,13 @@ UINT32 TpmHash( TPMI_ALG_HASH hashAlg, UINT16 size, BYTE *data, TPM2B_DIGEST *re
     for( i = 0; i < size; i++ )
         dataSizedBuffer.t.buffer[i] = data[i];
     
-    sysContext = InitSysContext( 3000, resMgrTctiContext, &abiVersion );
+    sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
     if( sysContext == 0 )
         return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
     
     rval = Tss2_Sys_Hash ( sysContext, 0, &dataSizedBuffer, hashAlg, TPM_RH_NULL, result, 0, 0);
 
-    TeardownSysContext( &sysContext );
+    ReturnSysContext( &sysContext, rval );
     
     return rval;
 }
@@ -83,31 +83,28 @@ UINT32 TpmHashSequence( TPMI_ALG_HASH hashAlg, UINT8 numBuffers, TPM2B_DIGEST *b
     *( (UINT8 *)((void *)&cmdAuth.sessionAttributes ) ) = 0;
     cmdAuth.hmac.t.size = 0;
     
-    sysContext = InitSysContext( 3000, resMgrTctiContext, &abiVersion );
+    sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
     if( sysContext == 0 )
         return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
     
     rval = Tss2_Sys_HashSequenceStart( sysContext, 0, &nullAuth, hashAlg, &sequenceHandle, 0 );
 
-    if( rval != TPM_RC_SUCCESS )
-        return( rval );
-
-    for( i = 0; i < numBuffers; i++ )
+    for( i = 0; rval == TPM_RC_SUCCESS && i < numBuffers; i++ )
     {
         rval = Tss2_Sys_SequenceUpdate ( sysContext, sequenceHandle, &cmdAuthArray, (TPM2B_MAX_BUFFER *)&bufferList[i], 0 );
 
         if( rval != TPM_RC_SUCCESS )
-            return( rval );
+            Tss2_Sys_FlushContext( sysContext, sequenceHandle );
     }
 
-    result->t.size = sizeof( *result ) - 2;
-    rval = Tss2_Sys_SequenceComplete ( sysContext, sequenceHandle, &cmdAuthArray, ( TPM2B_MAX_BUFFER *)&emptyBuffer,
-            TPM_RH_PLATFORM, result, &validation, 0 );
-
-    if( rval != TPM_RC_SUCCESS )
-        return( rval );
+    if( rval == TPM_RC_SUCCESS )
+    {
+        result->t.size = sizeof( *result ) - 2;
+        rval = Tss2_Sys_SequenceComplete ( sysContext, sequenceHandle, &cmdAuthArray, ( TPM2B_MAX_BUFFER *)&emptyBuffer,
+                TPM_RH_PLATFORM, result, &validation, 0 );
+    }
 
-    TeardownSysContext( &sysContext );
+    ReturnSysContext( &sysContext, rval );
 
     return rval;
 
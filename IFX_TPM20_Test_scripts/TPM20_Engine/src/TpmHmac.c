@@ -29,9 +29,11 @@
 #include "sample.h"
 
 //
-// This function does an HMAC on a null-terminated list of input buffers.
+// This function does an HMAC on a null-terminated list of input buffers,
+// with the commands sent through the given sys context.
 //
-UINT32 TpmHmac( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM2B **bufferList, TPM2B_DIGEST *result )
+UINT32 TpmHmacOnSysContext( TSS2_SYS_CONTEXT *sysContext, TPMI_ALG_HASH hashAlg, TPM2B *key,
+    TPM2B **bufferList, TPM2B_DIGEST *result )
 {
     TPM2B_AUTH nullAuth;
     TPMI_DH_OBJECT sequenceHandle;
@@ -54,7 +56,6 @@ UINT32 TpmHmac( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM2B **bufferList, TPM2B_DIG
     TPM2B_NAME keyName;
     
     TPM2B keyAuth;
-    TSS2_SYS_CONTEXT *sysContext;
 
     sessionDataArray[0] = &sessionData;
     sessionDataOutArray[0] = &sessionDataOut;
@@ -65,7 +66,7 @@ UINT32 TpmHmac( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM2B **bufferList, TPM2B_DIG
     keyAuth.size = 0;
     nullAuth.t.size = 0;
 
-    rval = LoadExternalHMACKey( hashAlg, key, &keyHandle, &keyName );
+    rval = LoadExternalHMACKeyOnSysContext( sysContext, hashAlg, key, &keyHandle, &keyName );
     if( rval != TPM_RC_SUCCESS )
     {
         return( rval );
@@ -87,36 +88,52 @@ UINT32 TpmHmac( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM2B **bufferList, TPM2B_DIG
     
     emptyBuffer.size = 0;
 
-    sysContext = InitSysContext( 3000, resMgrTctiContext, &abiVersion );
-    if( sysContext == 0 )
-        return TSS2_APP_ERROR_LEVEL + TPM_RC_FAILURE;
-    
     rval = Tss2_Sys_HMAC_Start( sysContext, keyHandle, &sessionsData, &nullAuth, hashAlg, &sequenceHandle, 0 );
 
-    if( rval != TPM_RC_SUCCESS )
-        return( rval );
-
     hmac.t.size = 0;
     sessionData.hmac = hmac;
-    for( i = 0; bufferList[i] != 0; i++ )
+    for( i = 0; rval == TPM_RC_SUCCESS && bufferList[i] != 0; i++ )
     {
         rval = Tss2_Sys_SequenceUpdate ( sysContext, sequenceHandle, &sessionsData, (TPM2B_MAX_BUFFER *)( bufferList[i] ), &sessionsDataOut );
 
         if( rval != TPM_RC_SUCCESS )
-            return( rval );
+            Tss2_Sys_FlushContext( sysContext, sequenceHandle );
     }
 
-    result->t.size = sizeof( TPM2B_DIGEST ) - 2;
-    rval = Tss2_Sys_SequenceComplete ( sysContext, sequenceHandle, &sessionsData, ( TPM2B_MAX_BUFFER *)&emptyBuffer,
-            TPM_RH_PLATFORM, result, &validation, &sessionsDataOut );
+    if( rval == TPM_RC_SUCCESS )
+    {
+        result->t.size = sizeof( TPM2B_DIGEST ) - 2;
+        rval = Tss2_Sys_SequenceComplete ( sysContext, sequenceHandle, &sessionsData, ( TPM2B_MAX_BUFFER *)&emptyBuffer,
+                TPM_RH_PLATFORM, result, &validation, &sessionsDataOut );
+    }
 
-    if( rval != TPM_RC_SUCCESS )
-        return( rval );
+    // The HMAC key is flushed on all paths, it would use up a slot otherwise
+    if( rval == TPM_RC_SUCCESS )
+        rval = Tss2_Sys_FlushContext( sysContext, keyHandle );
+    else
+        Tss2_Sys_FlushContext( sysContext, keyHandle );
 
-    rval = Tss2_Sys_FlushContext( sysContext, keyHandle );
+    return rval;
+}
 
-    TeardownSysContext( &sysContext );
+//
+// This function does an HMAC on a null-terminated list of input buffers.
+//
+UINT32 TpmHmac( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM2B **bufferList, TPM2B_DIGEST *result )
+{
+    UINT32 rval;
+    TSS2_SYS_CONTEXT *sysContext;
 
-    return rval;
+    // Set result size to 0, in case any errors occur
+    result->b.size = 0;
+
+    sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
+    if( sysContext == 0 )
+        return TSS2_APP_ERROR_LEVEL + TPM_RC_FAILURE;
 
+    rval = TpmHmacOnSysContext( sysContext, hashAlg, key, bufferList, result );
+
+    ReturnSysContext( &sysContext, rval );
+
+    return rval;
 }
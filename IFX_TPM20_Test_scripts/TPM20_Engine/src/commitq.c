@@ -0,0 +1,361 @@
+#include <string.h>
+#include <time.h>
+
+#include <openssl/crypto.h>
+
+#include "commitq.h"
+#include "tpm20w.h"
+
+#define COMMITQ_RETRY_DELAY  (1) /* Seconds to wait after a failed commit */
+
+static void* commitq_refillThread(
+  void  *arg
+);
+
+
+
+void commitq_init(
+  COMMIT_QUEUE  *queue,
+  TSS_POOL      *tssPool)
+{
+  memset(queue, 0, sizeof(COMMIT_QUEUE));
+
+  queue->depth   = COMMITQ_DEFAULT_DEPTH;
+  queue->tssPool = tssPool;
+
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->refill, NULL);
+}
+
+
+
+void commitq_destroy(
+  COMMIT_QUEUE  *queue)
+{
+  commitq_stop(queue);
+
+  OPENSSL_cleanse(queue->keys, sizeof(queue->keys));
+  pthread_cond_destroy(&queue->refill);
+  pthread_mutex_destroy(&queue->mutex);
+}
+
+
+
+/**********************************************************************
+ * Sets the number of commits kept per key (0: commit at signing time).
+ * Queued commits beyond a smaller depth are dropped; the TPM forgets
+ * them on its own. Returns 0 on success.
+ **********************************************************************/
+int commitq_setDepth(
+  COMMIT_QUEUE  *queue,
+  long           depth)
+{
+  int i;
+
+  if (depth < 0 || depth > COMMITQ_MAX_DEPTH)
+  {
+    ERRFN("Invalid commit queue depth %ld (max %d).", depth, COMMITQ_MAX_DEPTH);
+    return -1;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+  queue->depth = (int) depth;
+  for (i = 0; i < queue->nrKeys; i++)
+  {
+    if (queue->keys[i].fill > queue->depth)
+    {
+      queue->keys[i].fill = queue->depth;
+    }
+  }
+  pthread_cond_signal(&queue->refill);
+  pthread_mutex_unlock(&queue->mutex);
+
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Starts the refill thread. Returns 0 on success.
+ **********************************************************************/
+int commitq_start(
+  COMMIT_QUEUE  *queue)
+{
+  if (queue->running)
+  {
+    return 0;
+  }
+
+  queue->running = 1;
+  if (pthread_create(&queue->thread, NULL, commitq_refillThread, queue) != 0)
+  {
+    ERRFN("Could not start commit queue refill thread.");
+    queue->running = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Stops the refill thread and drops all queued commits, which are of
+ * no use to a new session with the TPM.
+ **********************************************************************/
+void commitq_stop(
+  COMMIT_QUEUE  *queue)
+{
+  int wasRunning;
+  int i;
+
+  pthread_mutex_lock(&queue->mutex);
+  wasRunning     = queue->running;
+  queue->running = 0;
+  pthread_cond_signal(&queue->refill);
+  pthread_mutex_unlock(&queue->mutex);
+
+  if (wasRunning)
+  {
+    pthread_join(queue->thread, NULL);
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+  for (i = 0; i < queue->nrKeys; i++)
+  {
+    queue->keys[i].fill = 0;
+  }
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+
+
+/**********************************************************************
+ * Called with the mutex held.
+ **********************************************************************/
+static COMMITQ_KEY* commitq_findKey(
+  COMMIT_QUEUE    *queue,
+  TPMI_DH_OBJECT   keyHandle)
+{
+  int i;
+
+  for (i = 0; i < queue->nrKeys; i++)
+  {
+    if (queue->keys[i].keyHandle == keyHandle)
+    {
+      return &queue->keys[i];
+    }
+  }
+  return NULL;
+}
+
+
+
+/**********************************************************************
+ * Has commits precomputed for keyHandle from now on (again, if it was
+ * registered with another password). Returns 0 on success, -1 if all
+ * COMMITQ_MAX_KEYS slots are taken.
+ **********************************************************************/
+int commitq_register(
+  COMMIT_QUEUE    *queue,
+  TPMI_DH_OBJECT   keyHandle,
+  const char      *keyPassword)
+{
+  COMMITQ_KEY  *key;
+  int           status = 0;
+
+  if (strlen(keyPassword) >= COMMITQ_PASSWORD_LEN)
+  {
+    ERRFN("Key password too long.");
+    return -1;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+  if ((key = commitq_findKey(queue, keyHandle)) != NULL)
+  {
+    if (strcmp(key->keyPassword, keyPassword) != 0)
+    {
+      strcpy(key->keyPassword, keyPassword);
+      key->fill = 0;
+    }
+  }
+  else if (queue->nrKeys < COMMITQ_MAX_KEYS)
+  {
+    key = &queue->keys[queue->nrKeys++];
+    memset(key, 0, sizeof(COMMITQ_KEY));
+    key->keyHandle = keyHandle;
+    strcpy(key->keyPassword, keyPassword);
+    DBGFN("Precomputing commits for key 0x%x.", keyHandle);
+  }
+  else
+  {
+    ERRFN("No room to precompute commits for key 0x%x (max %d keys).", keyHandle, COMMITQ_MAX_KEYS);
+    status = -1;
+  }
+  pthread_cond_signal(&queue->refill);
+  pthread_mutex_unlock(&queue->mutex);
+
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Takes the oldest precomputed commit of keyHandle. Returns 1 and the
+ * counter if there was one, 0 if the caller has to commit itself.
+ **********************************************************************/
+int commitq_take(
+  COMMIT_QUEUE    *queue,
+  TPMI_DH_OBJECT   keyHandle,
+  UINT16          *counter)
+{
+  COMMITQ_KEY  *key;
+  int           status = 0;
+
+  pthread_mutex_lock(&queue->mutex);
+  if ((key = commitq_findKey(queue, keyHandle)) != NULL && key->fill > 0)
+  {
+    *counter  = key->counters[key->head];
+    key->head = (key->head + 1) % COMMITQ_MAX_DEPTH;
+    key->fill--;
+    status = 1;
+  }
+  if (key != NULL)
+  {
+    pthread_cond_signal(&queue->refill);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Drops the queued commits of keyHandle after the TPM rejected one
+ * (e.g. it was restarted or the commits fell out of its window).
+ **********************************************************************/
+void commitq_flush(
+  COMMIT_QUEUE    *queue,
+  TPMI_DH_OBJECT   keyHandle)
+{
+  COMMITQ_KEY  *key;
+
+  pthread_mutex_lock(&queue->mutex);
+  if ((key = commitq_findKey(queue, keyHandle)) != NULL && key->fill > 0)
+  {
+    DBGFN("Dropping %d commits of key 0x%x.", key->fill, keyHandle);
+    key->fill = 0;
+  }
+  pthread_cond_signal(&queue->refill);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+
+
+/**********************************************************************
+ * Runs TPM2_Commit for keyHandle over the given connection, reopening
+ * it once if it broke. Returns 1 on success, -1 on error.
+ **********************************************************************/
+int commitq_commit(
+  TSS_CONN        *conn,
+  TPMI_DH_OBJECT   keyHandle,
+  const char      *keyPassword,
+  UINT16          *counter)
+{
+  int retried = 0;
+
+  while (tpm20w_commit(conn->sysContext, keyHandle, keyPassword, counter) != 1)
+  {
+    if (retried || !tssconn_recover(conn))
+    {
+      return -1;
+    }
+    retried = 1;
+  }
+  return 1;
+}
+
+
+
+/**********************************************************************
+ * Called with the mutex held. Returns the key that is furthest below
+ * the depth, or NULL if all queues are full.
+ **********************************************************************/
+static COMMITQ_KEY* commitq_nextKey(
+  COMMIT_QUEUE  *queue)
+{
+  COMMITQ_KEY  *next = NULL;
+  int           i;
+
+  for (i = 0; i < queue->nrKeys; i++)
+  {
+    if (queue->keys[i].fill < queue->depth &&
+        (next == NULL || queue->keys[i].fill < next->fill))
+    {
+      next = &queue->keys[i];
+    }
+  }
+  return next;
+}
+
+
+
+static void* commitq_refillThread(
+  void  *arg)
+{
+  COMMIT_QUEUE    *queue = (COMMIT_QUEUE*) arg;
+  COMMITQ_KEY     *key;
+  TSS_CONN        *conn;
+  TPMI_DH_OBJECT   keyHandle;
+  char             keyPassword[COMMITQ_PASSWORD_LEN];
+  UINT16           counter;
+  int              status;
+  struct timespec  retryAt;
+
+  DBGFN("Commit queue refill thread started.");
+
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->running)
+  {
+    if ((key = commitq_nextKey(queue)) == NULL)
+    {
+      pthread_cond_wait(&queue->refill, &queue->mutex);
+      continue;
+    }
+    keyHandle = key->keyHandle;
+    strcpy(keyPassword, key->keyPassword);
+    pthread_mutex_unlock(&queue->mutex);
+
+    // One commit per connection checkout, signatures go first
+    status = -1;
+    if ((conn = tsspool_acquire(queue->tssPool, TSSPOOL_CLASS_BACKGROUND, NULL)) != NULL)
+    {
+      status = commitq_commit(conn, keyHandle, keyPassword, &counter);
+      tsspool_release(queue->tssPool, conn);
+    }
+    OPENSSL_cleanse(keyPassword, sizeof(keyPassword));
+
+    pthread_mutex_lock(&queue->mutex);
+    if (status == 1)
+    {
+      // The key may have been flushed or re-registered meanwhile
+      if ((key = commitq_findKey(queue, keyHandle)) != NULL && key->fill < queue->depth)
+      {
+        key->counters[(key->head + key->fill) % COMMITQ_MAX_DEPTH] = counter;
+        key->fill++;
+      }
+    }
+    else if (queue->running)
+    {
+      ERRFN("Commit for key 0x%x failed, retrying in %d s.", keyHandle, COMMITQ_RETRY_DELAY);
+      clock_gettime(CLOCK_REALTIME, &retryAt);
+      retryAt.tv_sec += COMMITQ_RETRY_DELAY;
+      pthread_cond_timedwait(&queue->refill, &queue->mutex, &retryAt);
+    }
+  }
+  pthread_mutex_unlock(&queue->mutex);
+
+  DBGFN("Commit queue refill thread stopped.");
+  return NULL;
+}
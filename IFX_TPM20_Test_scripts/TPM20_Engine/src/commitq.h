@@ -0,0 +1,88 @@
+#ifndef _COMMITQ_H_
+#define _COMMITQ_H_
+
+#include <pthread.h>
+
+#include <sapi/tpm20.h>
+
+#include "tsspool.h"
+
+#define COMMITQ_MAX_KEYS       (4)
+#define COMMITQ_MAX_DEPTH     (16) /* The TPM keeps at most 64 commits in flight */
+#define COMMITQ_DEFAULT_DEPTH  (4)
+#define COMMITQ_PASSWORD_LEN (128)
+
+typedef struct {
+  TPMI_DH_OBJECT   keyHandle;
+  char             keyPassword[COMMITQ_PASSWORD_LEN];
+  UINT16           counters[COMMITQ_MAX_DEPTH];
+  int              head;           /* Oldest counter                */
+  int              fill;
+} COMMITQ_KEY;
+
+/*
+ * Precomputed first halves of ECDAA signatures. A background thread
+ * runs TPM2_Commit for every registered key until depth commits are
+ * queued, so that a signature only needs the cheap TPM2_Sign with a
+ * counter that is already there. Counters are consumed oldest first;
+ * the TPM forgets a commit once it falls out of its window, in which
+ * case the signature fails and the caller flushes the key's queue.
+ */
+typedef struct {
+  COMMITQ_KEY       keys[COMMITQ_MAX_KEYS];
+  int               nrKeys;
+  int               depth;         /* 0: no precomputation          */
+  int               running;
+  pthread_t         thread;
+  pthread_mutex_t   mutex;
+  pthread_cond_t    refill;
+  TSS_POOL         *tssPool;
+} COMMIT_QUEUE;
+
+void commitq_init(
+  COMMIT_QUEUE  *queue,
+  TSS_POOL      *tssPool
+);
+
+void commitq_destroy(
+  COMMIT_QUEUE  *queue
+);
+
+int commitq_setDepth(
+  COMMIT_QUEUE  *queue,
+  long           depth
+);
+
+int commitq_start(
+  COMMIT_QUEUE  *queue
+);
+
+void commitq_stop(
+  COMMIT_QUEUE  *queue
+);
+
+int commitq_register(
+  COMMIT_QUEUE    *queue,
+  TPMI_DH_OBJECT   keyHandle,
+  const char      *keyPassword
+);
+
+int commitq_take(
+  COMMIT_QUEUE    *queue,
+  TPMI_DH_OBJECT   keyHandle,
+  UINT16          *counter
+);
+
+void commitq_flush(
+  COMMIT_QUEUE    *queue,
+  TPMI_DH_OBJECT   keyHandle
+);
+
+int commitq_commit(
+  TSS_CONN        *conn,
+  TPMI_DH_OBJECT   keyHandle,
+  const char      *keyPassword,
+  UINT16          *counter
+);
+
+#endif
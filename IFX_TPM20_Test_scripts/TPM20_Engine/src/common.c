@@ -58,6 +58,10 @@
 #include <limits.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 #include <sapi/tpm20.h>
@@ -91,14 +95,43 @@ UINT32 ( *ComputeSessionHmacPtr )(
 TPM_RC ( *GetSessionAlgIdPtr )( TPMI_SH_AUTH_SESSION authHandle, TPMI_ALG_HASH *sessionAlgId ) = GetSessionAlgId;
 
 TPM_RC ( *CalcPHash )( TSS2_SYS_CONTEXT *sysContext,TPM_HANDLE handle1, TPM_HANDLE handle2, TPMI_ALG_HASH authHash,
-        TPM_RC responseCode, TPM2B_DIGEST *pHash ) = TpmCalcPHash;
+        TPM_RC responseCode, TPM2B_DIGEST *pHash ) = SwCalcPHash;
 
-UINT32 (*HmacFunctionPtr)( TPM_ALG_ID hashAlg, TPM2B *key,TPM2B **bufferList, TPM2B_DIGEST *result ) = TpmHmac;
+UINT32 (*HmacFunctionPtr)( TPM_ALG_ID hashAlg, TPM2B *key,TPM2B **bufferList, TPM2B_DIGEST *result ) = SwHmac;
+
+TSS2_RC (*EncryptCFBFunctionPtr)( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX_BUFFER *clearData,
+        TPM2B_AUTH *authValue ) = SwEncryptCFB;
+
+TSS2_RC (*DecryptCFBFunctionPtr)( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUFFER *encryptedData,
+        TPM2B_AUTH *authValue ) = SwDecryptCFB;
 
 UINT32 (*HashFunctionPtr)( TPMI_ALG_HASH hashAlg, UINT16 size, BYTE *data, TPM2B_DIGEST *result ) = TpmHash;
 
 UINT32 (*HandleToNameFunctionPtr)( TPM_HANDLE handle, TPM2B_NAME *name ) = TpmHandleToName;
 
+int SetHelperCryptoBackend( const char *backend )
+{
+    if( backend != 0 && strcmp( backend, "sw" ) == 0 )
+    {
+        HmacFunctionPtr = SwHmac;
+        CalcPHash = SwCalcPHash;
+        EncryptCFBFunctionPtr = SwEncryptCFB;
+        DecryptCFBFunctionPtr = SwDecryptCFB;
+    }
+    else if( backend != 0 && strcmp( backend, "tpm" ) == 0 )
+    {
+        HmacFunctionPtr = TpmHmac;
+        CalcPHash = TpmCalcPHash;
+        EncryptCFBFunctionPtr = TpmEncryptCFB;
+        DecryptCFBFunctionPtr = TpmDecryptCFB;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
 FILE *outFp;
 UINT8 simulator = 1;
 
@@ -237,6 +270,7 @@ TSS2_RC InitTctiResMgrContext( TCTI_SOCKET_CONF *rmInterfaceConfig, TSS2_TCTI_CO
 
 void TeardownTctiResMgrContext( TSS2_TCTI_CONTEXT *tctiContext )
 {
+    FlushSysContexts( tctiContext );
     tss2_tcti_finalize (tctiContext);
     free (tctiContext);
 }
@@ -517,24 +551,78 @@ int loadTpmContextFromFile(TSS2_SYS_CONTEXT *sysContext, TPM_HANDLE *handle, con
 }
 
 //
-// This function does a hash on an array of data strings.
+// Source of a streamed hash: either a memory region (usually a mapped
+// file) or a file descriptor that cannot be mapped.
+//
+typedef struct {
+    const BYTE *base;
+    size_t length;
+    size_t offset;
+    int fd;
+} HASH_SOURCE;
+
+//
+// Fills slice with the next MAX_DIGEST_BUFFER bytes of the source.  A
+// slice shorter than that marks the end of the data.
+//
+static int ReadHashSlice( HASH_SOURCE *source, TPM2B_MAX_BUFFER *slice )
+{
+    size_t size = 0;
+    ssize_t n;
+
+    if( source->base != 0 )
+    {
+        size = source->length - source->offset;
+        if( size > MAX_DIGEST_BUFFER )
+            size = MAX_DIGEST_BUFFER;
+        memcpy( slice->t.buffer, source->base + source->offset, size );
+        source->offset += size;
+    }
+    else
+    {
+        while( size < MAX_DIGEST_BUFFER )
+        {
+            n = read( source->fd, slice->t.buffer + size, MAX_DIGEST_BUFFER - size );
+            if( n < 0 && errno == EINTR )
+                continue;
+            if( n < 0 )
+                return -1;
+            if( n == 0 )
+                break;
+            size += n;
+        }
+    }
+    slice->t.size = (UINT16)size;
+    return 0;
+}
+
+//
+// Runs a TPM hash sequence over the source, one MAX_DIGEST_BUFFER slice
+// per SequenceUpdate and the last (short) slice in SequenceComplete.  Only
+// two slices are kept in memory, whatever the input size.  With pipeline
+// set, each SequenceUpdate is sent asynchronously and the next slice is
+// staged (copied or read from the fd) while the TPM works on it.  The
+// HASHCHECK ticket for hierarchy is returned in validation, if not 0.
 //
-static TPM_RC TpmHashSequenceEx( TPMI_ALG_HASH hashAlg, UINT32 numBuffers, TPM2B_MAX_BUFFER *bufferList, TPM2B_DIGEST *result )
+static TPM_RC TpmHashStream( TSS2_SYS_CONTEXT *sysContext, TPMI_ALG_HASH hashAlg, HASH_SOURCE *source,
+    int pipeline, TPMI_RH_HIERARCHY hierarchy, TPM2B_DIGEST *result, TPMT_TK_HASHCHECK *validation )
 {
     TPM_RC rval;
-    TSS2_SYS_CONTEXT *sysContext;
     TPM2B_AUTH nullAuth;
     TPMI_DH_OBJECT sequenceHandle;
-    int i;
-    TPM2B emptyBuffer;
-    TPMT_TK_HASHCHECK validation;
+    TPM2B_MAX_BUFFER slices[2];
+    TPMT_TK_HASHCHECK localValidation;
+    int cur = 0;
+    int readError = 0;
 
     TPMS_AUTH_COMMAND cmdAuth;
     TPMS_AUTH_COMMAND *cmdSessionArray[1] = { &cmdAuth };
     TSS2_SYS_CMD_AUTHS cmdAuthArray = { 1, &cmdSessionArray[0] };
 
     nullAuth.t.size = 0;
-    emptyBuffer.size = 0;
+
+    if( validation == 0 )
+        validation = &localValidation;
 
     // Set result size to 0, in case any errors occur
     result->b.size = 0;
@@ -545,63 +633,141 @@ static TPM_RC TpmHashSequenceEx( TPMI_ALG_HASH hashAlg, UINT32 numBuffers, TPM2B
     *( (UINT8 *)((void *)&cmdAuth.sessionAttributes ) ) = 0;
     cmdAuth.hmac.t.size = 0;
 
-    sysContext = InitSysContext( 3000, resMgrTctiContext, &abiVersion );
-    if( sysContext == 0 )
-        return TSS2_APP_RC_INIT_SYS_CONTEXT_FAILED;
+    if( ReadHashSlice( source, &slices[cur] ) != 0 )
+        return TSS2_APP_RC_BAD_REFERENCE;
 
     rval = Tss2_Sys_HashSequenceStart( sysContext, 0, &nullAuth, hashAlg, &sequenceHandle, 0 );
-
     if( rval != TPM_RC_SUCCESS )
         return( rval );
 
-    for( i = 0; i < numBuffers; i++ )
+    while( slices[cur].t.size == MAX_DIGEST_BUFFER )
     {
-        rval = Tss2_Sys_SequenceUpdate ( sysContext, sequenceHandle, &cmdAuthArray, &bufferList[i], 0 );
+        if( pipeline )
+        {
+            rval = Tss2_Sys_SequenceUpdate_Prepare( sysContext, sequenceHandle, &slices[cur] );
+            if( rval == TPM_RC_SUCCESS )
+                rval = Tss2_Sys_SetCmdAuths( sysContext, &cmdAuthArray );
+            if( rval == TPM_RC_SUCCESS )
+                rval = Tss2_Sys_ExecuteAsync( sysContext );
+            if( rval != TPM_RC_SUCCESS )
+                break;
+
+            // Overlaps with the TPM processing the previous slice
+            readError = ReadHashSlice( source, &slices[cur ^ 1] );
+
+            rval = Tss2_Sys_ExecuteFinish( sysContext, TSS2_TCTI_TIMEOUT_BLOCK );
+        }
+        else
+        {
+            rval = Tss2_Sys_SequenceUpdate( sysContext, sequenceHandle, &cmdAuthArray, &slices[cur], 0 );
+            if( rval == TPM_RC_SUCCESS )
+                readError = ReadHashSlice( source, &slices[cur ^ 1] );
+        }
 
+        if( rval == TPM_RC_SUCCESS && readError != 0 )
+            rval = TSS2_APP_RC_BAD_REFERENCE;
         if( rval != TPM_RC_SUCCESS )
-            return( rval );
+            break;
+
+        cur ^= 1;
     }
 
-    rval = Tss2_Sys_SequenceComplete ( sysContext, sequenceHandle, &cmdAuthArray, ( TPM2B_MAX_BUFFER *)&emptyBuffer,
-            TPM_RH_PLATFORM, result, &validation, 0 );
+    if( rval == TPM_RC_SUCCESS )
+    {
+        rval = Tss2_Sys_SequenceComplete( sysContext, sequenceHandle, &cmdAuthArray, &slices[cur],
+                hierarchy, result, validation, 0 );
+    }
+    else
+    {
+        // Don't leave the sequence object behind in the TPM
+        Tss2_Sys_FlushContext( sysContext, sequenceHandle );
+    }
 
-    if( rval != TPM_RC_SUCCESS )
-        return( rval );
+    return rval;
+}
 
-    TeardownSysContext( &sysContext );
+int computeDataHashStream(TSS2_SYS_CONTEXT *sysContext, const BYTE *buffer, size_t length, TPMI_ALG_HASH halg,
+    int pipeline, TPM2B_DIGEST *result)
+{
+    HASH_SOURCE source;
 
-    return rval;
+    source.base = buffer;
+    source.length = length;
+    source.offset = 0;
+    source.fd = -1;
+
+    return TpmHashStream(sysContext, halg, &source, pipeline, TPM_RH_PLATFORM, result, 0) == TPM_RC_SUCCESS ? 0 : -3;
+}
+
+int computeDataHashTicket(TSS2_SYS_CONTEXT *sysContext, const BYTE *buffer, size_t length, TPMI_ALG_HASH halg,
+    TPMI_RH_HIERARCHY hierarchy, int pipeline, TPM2B_DIGEST *result, TPMT_TK_HASHCHECK *validation)
+{
+    HASH_SOURCE source;
+
+    source.base = buffer;
+    source.length = length;
+    source.offset = 0;
+    source.fd = -1;
+
+    return TpmHashStream(sysContext, halg, &source, pipeline, hierarchy, result, validation) == TPM_RC_SUCCESS ? 0 : -3;
+}
+
+int computeFileHash(TSS2_SYS_CONTEXT *sysContext, int fd, TPMI_ALG_HASH halg, int pipeline, TPM2B_DIGEST *result)
+{
+    HASH_SOURCE source;
+    struct stat st;
+    void *map = MAP_FAILED;
+    TPM_RC rval;
+
+    source.base = 0;
+    source.length = 0;
+    source.offset = 0;
+    source.fd = fd;
+
+    // Regular files are hashed straight from the page cache; anything
+    // else (pipes, or a failed mapping) is read slice by slice.
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (UINT64)st.st_size <= SIZE_MAX)
+    {
+        map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED)
+        {
+            posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            source.base = (const BYTE *)map;
+            source.length = (size_t)st.st_size;
+        }
+    }
+
+    rval = TpmHashStream(sysContext, halg, &source, pipeline, TPM_RH_PLATFORM, result, 0);
+
+    if(map != MAP_FAILED)
+        munmap(map, (size_t)st.st_size);
+
+    if(rval == TSS2_APP_RC_BAD_REFERENCE)
+        return -1;
+    return rval == TPM_RC_SUCCESS ? 0 : -3;
 }
 
-int computeDataHash(BYTE *buffer, UINT16 length, TPMI_ALG_HASH halg, TPM2B_DIGEST *result)
+int computeDataHash(BYTE *buffer, UINT32 length, TPMI_ALG_HASH halg, TPM2B_DIGEST *result)
 {
-    UINT8 numBuffers = 0;
-    UINT32 i;
+    TSS2_SYS_CONTEXT *sysContext;
+    int rc;
+
     if(length <= MAX_DIGEST_BUFFER)
     {
-        if( TpmHash(halg, length, buffer, result) == TPM_RC_SUCCESS)
+        if( TpmHash(halg, (UINT16)length, buffer, result) == TPM_RC_SUCCESS)
             return 0;
         else
             return -1;
     }
 
-    numBuffers = (length - 1) / MAX_DIGEST_BUFFER + 1;
-
-    TPM2B_MAX_BUFFER *bufferList = (TPM2B_MAX_BUFFER *)calloc(numBuffers, sizeof(TPM2B_MAX_BUFFER));
-    if(bufferList == NULL)
+    sysContext = BorrowSysContext( resMgrTctiContext, &abiVersion );
+    if(sysContext == 0)
         return -2;
 
-    for(i = 0; i < numBuffers - 1; i++)
-    {
-        bufferList[i].t.size = MAX_DIGEST_BUFFER;
-        memcpy(bufferList[i].t.buffer, buffer + i * MAX_DIGEST_BUFFER, MAX_DIGEST_BUFFER);
-    }
-    bufferList[i].t.size = length - i * MAX_DIGEST_BUFFER;
-    memcpy(bufferList[i].t.buffer, buffer + i * MAX_DIGEST_BUFFER, bufferList[i].t.size);
-
-    TPM_RC rval = TpmHashSequenceEx(halg, numBuffers, bufferList, result);
-    free(bufferList);
-    return rval == TPM_RC_SUCCESS ? 0 : -3;
+    rc = computeDataHashStream(sysContext, buffer, length, halg, 0, result);
+    // The stream's return code is not kept; don't reuse the context after a failure
+    ReturnSysContext( &sysContext, rc == 0 ? TSS2_RC_SUCCESS : TSS2_SYS_ERROR_LEVEL );
+    return rc;
 }
 
 int checkOutFile(const char *path)
@@ -35,8 +35,6 @@
 extern "C" {
 #endif
 
-extern TSS2_SYS_CONTEXT *sysContext;
-
 void copyData( UINT8 *to, UINT8 *from, UINT32 length );
 int TpmClientPrintf( UINT8 type, const char *format, ...);
 int CompareTPM2B( TPM2B *buffer1, TPM2B *buffer2 );
@@ -56,7 +54,16 @@ int saveDataToFile(const char *fileName, UINT8 *buf, UINT16 size);
 int loadDataFromFile(const char *fileName, UINT8 *buf, UINT16 *size);
 int saveTpmContextToFile(TSS2_SYS_CONTEXT *sysContext, TPM_HANDLE handle, const char *fileName);
 int loadTpmContextFromFile(TSS2_SYS_CONTEXT *sysContext, TPM_HANDLE *handle, const char *fileName);
-int computeDataHash(BYTE *buffer, UINT16 length, TPMI_ALG_HASH halg, TPM2B_DIGEST *result);
+int computeDataHash(BYTE *buffer, UINT32 length, TPMI_ALG_HASH halg, TPM2B_DIGEST *result);
+// Hash sequences over arbitrarily large inputs with constant memory use, fed in
+// MAX_DIGEST_BUFFER slices; pipeline != 0 stages the next slice while the TPM works.
+// Return 0 on success, -1 if the fd cannot be read, -3 on TPM errors.
+int computeDataHashStream(TSS2_SYS_CONTEXT *sysContext, const BYTE *buffer, size_t length, TPMI_ALG_HASH halg,
+    int pipeline, TPM2B_DIGEST *result);
+int computeFileHash(TSS2_SYS_CONTEXT *sysContext, int fd, TPMI_ALG_HASH halg, int pipeline, TPM2B_DIGEST *result);
+// Like computeDataHashStream, also returns the HASHCHECK ticket for hierarchy.
+int computeDataHashTicket(TSS2_SYS_CONTEXT *sysContext, const BYTE *buffer, size_t length, TPMI_ALG_HASH halg,
+    TPMI_RH_HIERARCHY hierarchy, int pipeline, TPM2B_DIGEST *result, TPMT_TK_HASHCHECK *validation);
 int checkOutFile(const char *path);
 int getFileSize(const char *path, long *fileSize);
 int getPort(const char *arg, int *port);
@@ -67,6 +74,12 @@ void showArgMismatch(const char *name);
 void showVersion(const char *name);
 char *safeStrNCpy(char *dest, const char *src, size_t n);
 
+// Selects the implementation behind the session helper function pointers
+// (HmacFunctionPtr, CalcPHash, En/DecryptCFBFunctionPtr): "sw" computes in software
+// (default), "tpm" on the TPM.
+// Returns 0 on success, -1 for an unknown backend.
+int SetHelperCryptoBackend( const char *backend );
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,16 +1,30 @@
 #include <string.h>
-#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include <openssl/engine.h>
 #include <openssl/ossl_typ.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
 
 #include <sapi/tpm20.h>
 #include <tcti/tcti_socket.h>
 
 #include "common.h" // from TPM 2.0 Tools
+#include "sample.h"
 
 #include "e_tpm20e.h"
 #include "tpm20w.h"
+#include "tsspool.h"
+#include "randpool.h"
+#include "hmacdrbg.h"
+#include "pubcache.h"
+#include "signq.h"
+#include "tssloop.h"
+#include "tssshard.h"
+#include "commitq.h"
+#include "swkey.h"
 
 /**********************************************************************
  * COMMON / GENERAL / DEBUG                                           *
@@ -52,64 +66,258 @@ void fprintBuffer(
  * ENGINE INSTANCE GLOBAL DATA STORAGE                                *
  **********************************************************************/
 
-void tpm20e_tssStart(void);
+int tpm20e_tssStart(void);
 void tpm20e_tssStop(void);
-void intHandler(int dummy);
+TSS_CONN* tpm20e_tssAcquire(void);
+void tpm20e_tssRelease(TSS_CONN *conn);
+int tpm20e_tssRecover(TSS_CONN *conn);
 
 #define KEY_CONTEXT_MAX_LEN (1024)
-static char keyContext[KEY_CONTEXT_MAX_LEN] = { 0 };
 
 #define OBJ_MAX_LEN (128) /* Maximum length for key object paths or passwords */
 
-#define TSS_STATUS_NULL (0) /* unknown state, before startup */
-#define TSS_STATUS_INIT (1) /* TSS initialized and in use    */
-#define TSS_STATUS_DEST (2) /* TSS destroyed                 */
-static int tssStatus = { TSS_STATUS_NULL };
+/*
+ * Per-key context of a TPM key, parsed once from the key_id at load time
+ * and attached to the EC_KEY as ECDSA ex_data. Signing only looks it up,
+ * so several TPM keys can be in use in one process at the same time.
+ */
+typedef struct {
+  TPMI_DH_OBJECT        handle;
+  char                  password[OBJ_MAX_LEN];
+} TPM20E_KEY;
 
+static int tpm20eKeyIndex = -1;
 
+/*
+ * The engine owns a pool of long-lived connections to the resource
+ * manager from tpm20e_engine_init() to tpm20e_engine_finish(). Every
+ * operation checks out its own connection, so that concurrent callers
+ * do not share a TCTI or system context. A connection is only reopened
+ * after a TCTI error (see tpm20e_tssRecover()).
+ */
+static TSS_POOL tssPool;
 
-void intHandler(
-  int  sig)
-{
-  DBGFN("Interrupt handler for CTRL-C entered.");
-  signal(sig, intHandler);
-  DBGFN("Calling to stop RM...");
-  tpm20e_tssStop();
-  DBGFN("Interrupt handler for CTRL-C done.");
-}
+/*
+ * LAZY_CONNECT: engine init neither connects nor starts the entropy
+ * pool, e.g. for processes that only load public keys from the cache.
+ */
+static int lazyConnect = 0;
 
+/*
+ * TPM entropy buffered in memory and refilled in the background, so
+ * that RAND_bytes() does not wait for a TPM round trip per call.
+ */
+static RAND_POOL randPool;
 
+/*
+ * RAND_MODE "drbg": the TPM only seeds an in-process HMAC_DRBG, which
+ * then serves RAND_bytes() at memory speed.
+ */
+#define TPM20E_RAND_MODE_TPM  (0)
+#define TPM20E_RAND_MODE_DRBG (1)
 
-void tpm20e_tssStart(void)
+static int       randMode = TPM20E_RAND_MODE_TPM;
+static HMAC_DRBG randDrbg;
+
+/*
+ * Public keys already read from the TPM, so that reloading a key
+ * handle does not cost a TPM2_ReadPublic.
+ */
+static PUB_CACHE pubCache;
+
+/*
+ * Signatures are computed by worker threads, so that several callers
+ * keep the TPM busy.
+ */
+static SIGN_QUEUE signQueue;
+
+/*
+ * SIGN_DEADLINE: a signature that did not get a TPM connection within
+ * this many milliseconds is dropped (the handshake has likely timed out
+ * anyway) instead of holding up the ones behind it. 0: no deadline.
+ */
+static long signDeadlineMs = 0;
+
+/*
+ * TCTI "async:...": one thread completes the TPM commands of the sign
+ * queue and the entropy pool as their responses arrive.
+ */
+static TSS_LOOP tssLoop;
+
+/*
+ * ENDPOINT: further TPMs holding the same keys. Signatures are spread
+ * over tssPool (the primary TPM) and their pools.
+ */
+static TSS_SHARDS tssShards;
+
+/*
+ * ECDAA keys sign in two phases (tpm20e_ecdaaSign()). PRECOMMIT_DEPTH
+ * TPM2_Commits per key are run ahead of time, so that a signature only
+ * pays for TPM2_Sign.
+ */
+static COMMIT_QUEUE commitQueue;
+
+/*
+ * SW_SIGN_KEY: sealed software copies of duplicable keys, which sign
+ * instead of the TPM when SW_SIGN_POLICY says so (e.g. "auto": while
+ * SW_SIGN_THRESHOLD or more signatures are queued for the TPM).
+ */
+static SW_KEYS swKeys;
+
+static int tpm20e_swkeyUnseal(
+  TPMI_DH_OBJECT  keyHandle
+);
+
+
+
+/**********************************************************************
+ * Opens the engine's connection pool. Returns 0 on success.
+ **********************************************************************/
+int tpm20e_tssStart(void)
 {
-  DBGFN("Initializing resource manager and system context.");
+  int i;
+
+  DBGFN("Initializing resource manager connection pool.");
   
-  if (tssStatus == TSS_STATUS_DEST || tssStatus == TSS_STATUS_NULL)
+  if (tsspool_open(&tssPool, !lazyConnect) != 0)
   {
-    prepareTest(
-      DEFAULT_HOSTNAME, // Resource manager host name
-      DEFAULT_RESMGR_TPM_PORT, // Resource manager port
-      0); // Debug level
-    tssStatus = TSS_STATUS_INIT;
+    ERRFN("Could not connect to the resource manager.");
+    return -1;
+  }
+
+  if (tssPool.conns[0].async && tssloop_start(&tssLoop) != 0)
+  {
+    ERRFN("Could not start TSS event loop.");
+    tsspool_close(&tssPool);
+    return -1;
   }
+  signq_setLoop(&signQueue, tssPool.conns[0].async ? &tssLoop : NULL);
+  randpool_setLoop(&randPool, tssPool.conns[0].async ? &tssLoop : NULL);
 
-  signal(SIGINT, intHandler);
+  if (tssshard_open(&tssShards) != 0)
+  {
+    tssloop_stop(&tssLoop);
+    tsspool_close(&tssPool);
+    return -1;
+  }
+  signq_setShards(&signQueue, tssshard_getNrEndpoints(&tssShards) > 1 ? &tssShards : NULL);
+
+  if (signq_start(&signQueue, tssPool.size * tssshard_getNrEndpoints(&tssShards)) != 0)
+  {
+    ERRFN("Could not start sign workers.");
+    tssloop_stop(&tssLoop);
+    tssshard_close(&tssShards);
+    tsspool_close(&tssPool);
+    return -1;
+  }
+
+  if (!lazyConnect && randpool_start(&randPool) != 0)
+  {
+    ERRFN("Could not start entropy pool, serving random bytes from the TPM directly.");
+  }
+
+  if (commitq_start(&commitQueue) != 0)
+  {
+    ERRFN("Could not start commit queue, ECDAA keys commit at signing time.");
+  }
+
+  // Without LAZY_CONNECT, software keys are unsealed now rather than
+  // at the first load of their TPM key
+  for (i = 0; !lazyConnect && i < swKeys.nrKeys; i++)
+  {
+    tpm20e_swkeyUnseal(swKeys.keys[i].handle);
+  }
+
+  return 0;
 }
 
 
 
 void tpm20e_tssStop(void)
 {
-  DBGFN("Tearing down resource manager and system context.");
-  if (tssStatus == TSS_STATUS_INIT)
+  DBGFN("Tearing down resource manager connection pool.");
+  signq_stop(&signQueue);
+  commitq_stop(&commitQueue);
+  swkey_close(&swKeys);
+  hmacdrbg_uninstantiate(&randDrbg);
+  randpool_stop(&randPool);
+  tssloop_stop(&tssLoop);
+  tssshard_close(&tssShards);
+  tsspool_close(&tssPool);
+}
+
+
+
+TSS_CONN* tpm20e_tssAcquire(void)
+{
+  return tsspool_acquire(&tssPool, TSSPOOL_CLASS_FOREGROUND, NULL);
+}
+
+
+
+void tpm20e_tssRelease(
+  TSS_CONN  *conn)
+{
+  tsspool_release(&tssPool, conn);
+}
+
+
+
+/**********************************************************************
+ * Called after a failed TPM operation. Reconnects if the connection is
+ * broken and returns 1 if the operation should be retried once.
+ **********************************************************************/
+int tpm20e_tssRecover(
+  TSS_CONN  *conn)
+{
+  return tssconn_recover(conn);
+}
+
+
+
+/**********************************************************************
+ * Unseals the software copy of keyHandle, if there is one. Only keys
+ * the TPM lets leave it (no fixedTPM) may have a copy, and only ECDSA
+ * keys. Returns 0 on success or if there is no copy.
+ **********************************************************************/
+static int tpm20e_swkeyUnseal(
+  TPMI_DH_OBJECT  keyHandle)
+{
+  TPM2B_PUBLIC   publicArea;
+  EC_KEY        *ecKey = NULL;
+  int            status = -1;
+
+  if (!swkey_has(&swKeys, keyHandle))
   {
-    finishTest();
-    tssStatus = TSS_STATUS_DEST;
+    return 0;
   }
-  else
+
+  do
+  {
+    if (pubcache_get(&pubCache, &tssPool, keyHandle, &ecKey) != 0 ||
+        pubcache_getPublicArea(&pubCache, keyHandle, &publicArea) != 0)
+    {
+      ERRFN("Could not read public key 0x%x from TPM.", keyHandle);
+      break;
+    }
+    if (publicArea.t.publicArea.objectAttributes.fixedTPM)
+    {
+      ERRFN("Key 0x%x must not leave the TPM (fixedTPM), ignoring its software copy.", keyHandle);
+      break;
+    }
+    if (publicArea.t.publicArea.parameters.eccDetail.scheme.scheme == TPM_ALG_ECDAA)
+    {
+      ERRFN("Key 0x%x is an ECDAA key, ignoring its software copy.", keyHandle);
+      break;
+    }
+    status = swkey_unseal(&swKeys, &tssPool, keyHandle, ecKey);
+  } while (0);
+
+  if (ecKey != NULL)
   {
-    DBGFN("Nothing to do, contexts were not initialized (any more).");
+    EC_KEY_free(ecKey);
   }
+  return status;
 }
 
 
@@ -124,6 +332,10 @@ int tpm20e_getRandomBytes(
 
 int tpm20e_getRandomStatus(void);
 
+int tpm20e_getTpmRandomBytes(
+  unsigned char *buffer,
+  int nrBytes);
+
 static RAND_METHOD tpm20e_random_method =
 {
   NULL,                        // seed
@@ -144,57 +356,39 @@ int tpm20e_getRandomStatus(void)
 
 
 
-int tpm20e_getRandomBytes(
+int tpm20e_getTpmRandomBytes(
   unsigned char *buffer,
   int           nrBytes)
 {
-  TPM_RC        rval;
-  TPM2B_DIGEST  randomBytes = { { sizeof(TPM2B_DIGEST), } };
-  int           nrBytesLeft;
-  int           maxBytesPerCall = 0x20;
-  int           nrBytesNextReq;
-  int           result = -1; // Error
-  char          *returnBytes = (char*) buffer;
-
-  DBGFN("Get %d random bytes...", nrBytes);
+  return randpool_get(&randPool, buffer, nrBytes);
+}
 
-  memset(returnBytes, 0xFF, nrBytes);
 
-  nrBytesLeft = nrBytes;
-  
-  tpm20e_tssStart(); 
- 
-  while (nrBytesLeft > 0)
-  {
-    nrBytesNextReq = (nrBytesLeft > maxBytesPerCall) ? maxBytesPerCall : nrBytesLeft;
 
-    DBGFN("Tss2_Sys_GetRandom with %d Bytes.", nrBytesNextReq);
-    rval = Tss2_Sys_GetRandom(
-      sysContext,
-      NULL,
-      nrBytesNextReq,
-      &randomBytes,
-      NULL);
+int tpm20e_getRandomBytes(
+  unsigned char *buffer,
+  int           nrBytes)
+{
+  int  result;
 
-    if (rval == TSS2_RC_SUCCESS)
-    {
-      result = EVP_SUCCESS;
-    }
-    else
-    {
-      ERRFN("TPM error 0x%x.", rval);
-      result = -1;
-      break;
-    }
+  DBGFN("Get %d random bytes...", nrBytes);
 
-    memcpy(returnBytes, randomBytes.t.buffer, randomBytes.t.size);
-    returnBytes += randomBytes.t.size;
+  if (randMode == TPM20E_RAND_MODE_DRBG)
+  {
+    result = hmacdrbg_generate(&randDrbg, buffer, nrBytes);
+  }
+  else
+  {
+    result = randpool_get(&randPool, buffer, nrBytes);
+  }
 
-    nrBytesLeft -= randomBytes.t.size;
+  if (result != 1)
+  {
+    memset(buffer, 0xFF, nrBytes);
+    return -1;
   }
 
-  tpm20e_tssStop();
-  return result;
+  return EVP_SUCCESS;
 }
 
 
@@ -231,6 +425,15 @@ static int parseKeyParams(
   char  *args[]
 );
 
+static void tpm20e_keyFree(
+  void            *parent,
+  void            *ptr,
+  CRYPTO_EX_DATA  *ad,
+  int              idx,
+  long             argl,
+  void            *argp
+);
+
 
 
 static ECDSA_METHOD tpm20e_ecdsa_method = {
@@ -248,21 +451,53 @@ static ECDSA_METHOD tpm20e_ecdsa_method = {
 
 
 
+/**********************************************************************
+ * Frees the TPM20E_KEY of an EC_KEY that is freed (ex_data free
+ * callback).
+ **********************************************************************/
+static void tpm20e_keyFree(
+  void            *parent,
+  void            *ptr,
+  CRYPTO_EX_DATA  *ad,
+  int              idx,
+  long             argl,
+  void            *argp)
+{
+  if (ptr != NULL)
+  {
+    OPENSSL_cleanse(ptr, sizeof(TPM20E_KEY));
+    OPENSSL_free(ptr);
+  }
+}
+
+
+
 int tpm20e_ecdsa_signSetup(
   EC_KEY   *eckey,
   BN_CTX   *ctx_in,
   BIGNUM  **kinvp,
   BIGNUM  **rp)
 {
+  TPM20E_KEY  *tpmKey;
+
   DBGFN("ECDSA signature setup");
-  // TODO (not implemented): Currently I don't need this hook, maybe in the future
+
+  if ((tpmKey = ECDSA_get_ex_data(eckey, tpm20eKeyIndex)) == NULL)
+  {
+    return ECDSA_OpenSSL()->ecdsa_sign_setup(eckey, ctx_in, kinvp, rp);
+  }
+
+  // TPM2_Sign with ECDSA draws its nonce internally, so TPM keys have
+  // nothing to precompute here. ECDAA keys, whose commits are
+  // precomputed, sign through tpm20e_ecdaaSign() only.
   return EVP_SUCCESS;
 }
 
 
 
 /**********************************************************************
- * Returns -1 (error) or the number of arguments parsed.
+ * Returns -1 (error) or the number of arguments parsed. Each args[i]
+ * holds OBJ_MAX_LEN characters, longer parameters are rejected.
  **********************************************************************/
 static int parseKeyParams(
   char       *in,      // Implicitly expecting NULL terminated string!
@@ -311,109 +546,215 @@ static int parseKeyParams(
       return EVP_FAIL;
     }
       
-    strncpy(args[i], token, OBJ_MAX_LEN);    
+    if (strlen(token) >= OBJ_MAX_LEN)
+    {
+      ERRFN("Key parameter %d is too long (max %d characters).", i, OBJ_MAX_LEN - 1);
+      OPENSSL_cleanse(in2, sizeof(in2));
+      return EVP_FAIL;
+    }
+    strcpy(args[i], token);
     token = strtok(NULL, ";");
   }
 
+  OPENSSL_cleanse(in2, sizeof(in2));
   return n;
 }
 
 
 
-static ECDSA_SIG* tpm20e_ecdsa_sign(
-  const unsigned char  *dgst,
-  int                   dgst_len,
-  const BIGNUM         *inv,
-  const BIGNUM         *rp,
-  EC_KEY               *eckey
-)
+/**********************************************************************
+ * Queues a TPM2_Sign of digest and waits for it. ECDAA signatures use a
+ * precomputed commit if there is one. Returns 1 on success, -1 on error.
+ **********************************************************************/
+static int tpm20e_signOnTpm(
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  TPMI_ALG_SIG_SCHEME   scheme,
+  const unsigned char  *digest,
+  int                   digestLen,
+  TPMT_SIGNATURE       *signature)
 {
-  // TODO (Enhancement): get the key password(s) from the dedicated 'pass' arguments for OpenSSL  
-  
-  DBGFN("ECDSA signature calculation with &EC_KEY=0x%x und key_id=%s.", 
-    (unsigned int) eckey,
-    keyContext);
-    
-  ECDSA_SIG       *sigFormatOssl;
-  TPMT_SIGNATURE   sigFormatTpm2;
-  TPMI_DH_OBJECT   keyHandle;
+  SIGNQ_JOB        job;
+  UINT16           counter;
   int              status;
-  
-  char keyHandleHexStr[128] = { 0 };
-  char keyPasswordStr [128] = { 0 };
-  
-  char* args[] = {
-    keyHandleHexStr,
-    keyPasswordStr,
-  };
-  
+
+  job.digest      = digest;
+  job.digestLen   = digestLen;
+  job.keyHandle   = keyHandle;
+  job.keyPassword = keyPassword;
+  job.scheme      = scheme;
+  job.commitCounter = -1;
+  job.notifyFd    = -1;
+  job.deadline.tv_sec  = 0;
+  job.deadline.tv_nsec = 0;
+  if (signDeadlineMs > 0)
+  {
+    clock_gettime(CLOCK_REALTIME, &job.deadline);
+    job.deadline.tv_sec  += signDeadlineMs / 1000;
+    job.deadline.tv_nsec += (signDeadlineMs % 1000) * 1000000L;
+    if (job.deadline.tv_nsec >= 1000000000L)
+    {
+      job.deadline.tv_sec++;
+      job.deadline.tv_nsec -= 1000000000L;
+    }
+  }
+  if (job.scheme == TPM_ALG_ECDAA && commitq_take(&commitQueue, keyHandle, &counter))
+  {
+    job.commitCounter = counter;
+  }
+
   while (1)
   {
-    if ((status = parseKeyParams(keyContext, 2, args)) != 2)
+    if (signq_submit(&signQueue, &job) != 0)
     {
-      ERRFN("Invalid key parameter (returned %d).", status);
+      ERRFN("Sign queue not running.");
       break;
     }
-    
-    if ((status = getSizeUint32Hex(keyHandleHexStr, &keyHandle)) != 0)
+
+    signq_wait(&signQueue, &job);
+
+    if ((status = job.status) == 0)
     {
-      ERRFN("Invalid key handle (returned %d).", status);
+      ERRFN("Signature dropped, no TPM connection within %ld ms.", signDeadlineMs);
       break;
     }
-    DBGFN("Key handle = '0x%8x'", keyHandle);
-
-    DBG(" Key param 'key handle' = '%s'",   keyHandleHexStr);
-    DBG(" Key param 'key password' = '%s'", keyPasswordStr);
-    
-    // Hack if digest is too long
-    if (dgst_len > 32)
+    if (status != 1 && job.commitCounter >= 0)
     {
-      // TODO: this is a hack - OpenSSL 1.0.1 does present all possible signature algs
-      // But the OPTIGA TPM SLB9670 only supports 32 Byte SHA-256 digests
-      // This trunction works, as only the left-most 32 Byte are used with EC keys
-      // on the PRIME256 curve
-      // The following clean solution (for the engine user) is not supported in OpenSSL 1.1
-      //  SSL_CTX_set1_sigalgs_list(ctx, "ECDSA+SHA256");
-      dgst_len = 32;
-      ERRFN("Applying hack for digest size > 32 Byte");
+      // The TPM no longer knows the commit (restarted, or the commit
+      // fell out of its window), try once more with a fresh one
+      DBGFN("Signature with commit %d failed, committing again.", job.commitCounter);
+      commitq_flush(&commitQueue, keyHandle);
+      job.commitCounter = -1;
+      continue;
     }
-   
-    tpm20e_tssStart();
- 
-    if ((status = tpm20w_signEcdsaWithSha256(
-       dgst,
-       dgst_len,
-       keyHandle,
-       keyPasswordStr,
-      &sigFormatTpm2
-    )) != 1)
+    if (status != 1)
     {
       ERRFN("Signature computation failed, returned 0x%x.", status);
+      // The handle may have been evicted or replaced
+      pubcache_invalidate(&pubCache, keyHandle);
       break;
     }
 
-    if ((sigFormatOssl = ECDSA_SIG_new()) == NULL)
-    {
-      ERRFN("signature = ECDSA_SIG_new() failed.");
-      break;
-    }
+    memcpy(signature, &job.signature, sizeof(TPMT_SIGNATURE));
+    return 1;
+  }
+
+  return -1;
+}
+
+
+
+static ECDSA_SIG* tpm20e_ecdsa_sign(
+  const unsigned char  *dgst,
+  int                   dgst_len,
+  const BIGNUM         *inv,
+  const BIGNUM         *rp,
+  EC_KEY               *eckey
+)
+{
+  // TODO (Enhancement): get the key password(s) from the dedicated 'pass' arguments for OpenSSL  
+  
+  ECDSA_SIG       *sigFormatOssl;
+  TPMT_SIGNATURE   signature;
+  TPM20E_KEY      *tpmKey;
+  
+  if ((tpmKey = ECDSA_get_ex_data(eckey, tpm20eKeyIndex)) == NULL)
+  {
+    // Not loaded by this engine, e.g. a software key while the engine
+    // is the default ECDSA implementation
+    DBGFN("No TPM key attached to &EC_KEY=0x%x, signing in software.",
+      (unsigned int) eckey);
+    return ECDSA_OpenSSL()->ecdsa_do_sign(dgst, dgst_len, inv, rp, eckey);
+  }
+
+  DBGFN("ECDSA signature calculation with &EC_KEY=0x%x und key handle=0x%8x.", 
+    (unsigned int) eckey,
+    tpmKey->handle);
     
-    BN_bin2bn(
-      sigFormatTpm2.signature.ecdsa.signatureR.t.buffer, 
-      sigFormatTpm2.signature.ecdsa.signatureR.t.size, 
-      sigFormatOssl->r);
-    BN_bin2bn(
-      sigFormatTpm2.signature.ecdsa.signatureS.t.buffer, 
-      sigFormatTpm2.signature.ecdsa.signatureS.t.size, 
-      sigFormatOssl->s);
-
-    DBGFN("Signing successfully done.");
-    tpm20e_tssStop();
+  // Hack if digest is too long
+  if (dgst_len > 32)
+  {
+    // TODO: this is a hack - OpenSSL 1.0.1 does present all possible signature algs
+    // But the OPTIGA TPM SLB9670 only supports 32 Byte SHA-256 digests
+    // This trunction works, as only the left-most 32 Byte are used with EC keys
+    // on the PRIME256 curve
+    // The following clean solution (for the engine user) is not supported in OpenSSL 1.1
+    //  SSL_CTX_set1_sigalgs_list(ctx, "ECDSA+SHA256");
+    dgst_len = 32;
+    ERRFN("Applying hack for digest size > 32 Byte");
+  }
+
+  if ((sigFormatOssl = swkey_sign(&swKeys, tpmKey->handle, signq_getDepth(&signQueue), dgst, dgst_len)) != NULL)
+  {
+    DBGFN("Signed in software.");
     return sigFormatOssl;
   }
 
-  tpm20e_tssStop();
-  return (ECDSA_SIG*) NULL; // ERROR
+  if (tpm20e_signOnTpm(tpmKey->handle, tpmKey->password, TPM_ALG_ECDSA,
+        dgst, dgst_len, &signature) != 1)
+  {
+    return (ECDSA_SIG*) NULL; // ERROR
+  }
+
+  if ((sigFormatOssl = ECDSA_SIG_new()) == NULL)
+  {
+    ERRFN("signature = ECDSA_SIG_new() failed.");
+    return (ECDSA_SIG*) NULL; // ERROR
+  }
+  
+  BN_bin2bn(
+    signature.signature.ecdsa.signatureR.t.buffer, 
+    signature.signature.ecdsa.signatureR.t.size, 
+    sigFormatOssl->r);
+  BN_bin2bn(
+    signature.signature.ecdsa.signatureS.t.buffer, 
+    signature.signature.ecdsa.signatureS.t.size, 
+    sigFormatOssl->s);
+
+  DBGFN("Signing successfully done.");
+  return sigFormatOssl;
+}
+
+
+
+/**********************************************************************
+ * Signs digest with the ECDAA key keyHandle on the TPM. ECDAA
+ * signatures do not verify as ECDSA, so ECDAA keys are not available
+ * through the ECDSA method and are only used through this function.
+ * The first call for a key starts precomputing commits for it
+ * (PRECOMMIT_DEPTH). Returns 1 on success, -1 on error.
+ **********************************************************************/
+int tpm20e_ecdaaSign(
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  const unsigned char  *digest,
+  int                   digestLen,
+  TPMT_SIGNATURE       *signature)
+{
+  EC_KEY  *ecKey = NULL;
+
+  if (keyPassword == NULL || digest == NULL || signature == NULL ||
+      strlen(keyPassword) >= OBJ_MAX_LEN)
+  {
+    ERRFN("Invalid ECDAA sign parameters.");
+    return -1;
+  }
+
+  if (pubcache_get(&pubCache, &tssPool, keyHandle, &ecKey) != 0)
+  {
+    ERRFN("Could not read public key 0x%x from TPM.", keyHandle);
+    return -1;
+  }
+  EC_KEY_free(ecKey);
+
+  if (pubcache_getScheme(&pubCache, keyHandle) != TPM_ALG_ECDAA)
+  {
+    ERRFN("Key 0x%x is not an ECDAA key.", keyHandle);
+    return -1;
+  }
+
+  commitq_register(&commitQueue, keyHandle, keyPassword);
+  return tpm20e_signOnTpm(keyHandle, keyPassword, TPM_ALG_ECDAA, digest, digestLen, signature);
 }
 
 
@@ -463,12 +804,12 @@ static EVP_PKEY *tpm20e_loadPrivateKey(
   void*        cb_data)
 {
   TPMI_DH_OBJECT   keyHandle;
-  EVP_PKEY*        key;
+  EVP_PKEY*        key = NULL;
   EC_KEY          *ecKey = NULL;
+  TPM20E_KEY      *tpmKey;
   int              status;
   
-  strncpy(keyContext, key_id, KEY_CONTEXT_MAX_LEN);
-  
+  char keyIdStr[KEY_CONTEXT_MAX_LEN] = { 0 };
   char keyHandleHexStr[128] = { 0 };
   char keyPasswordStr [128] = { 0 };
   
@@ -477,9 +818,11 @@ static EVP_PKEY *tpm20e_loadPrivateKey(
     keyPasswordStr,
   };
   
+  strncpy(keyIdStr, key_id, KEY_CONTEXT_MAX_LEN - 1);
+  
   while (1)
   {
-    if ((status = parseKeyParams(keyContext, 2, args)) != 2)
+    if ((status = parseKeyParams(keyIdStr, 2, args)) != 2)
     {
       ERRFN("Invalid key parameter (returned %d).", status);
       break;
@@ -492,12 +835,44 @@ static EVP_PKEY *tpm20e_loadPrivateKey(
     }
     DBGFN("Key handle = '0x%8x'", keyHandle);
    
-    tpm20e_tssStart(); 
-    if ((status = tpm20w_readPublic(keyHandle, &ecKey)) != 0)
+    if ((status = pubcache_get(&pubCache, &tssPool, keyHandle, &ecKey)) != 0)
     {
       ERRFN("Could not read public key from TPM (returned %d).", status);
       break;
     }
+
+    // An ECDAA signature in an ECDSA_SIG would not verify anywhere
+    if (pubcache_getScheme(&pubCache, keyHandle) == TPM_ALG_ECDAA)
+    {
+      ERRFN("Key 0x%x is an ECDAA key, which signs through tpm20e_ecdaaSign() only.", keyHandle);
+      break;
+    }
+    
+    // Attach the parsed key parameters to the key, so that signing
+    // does not need to parse them again
+    if ((tpmKey = OPENSSL_malloc(sizeof(TPM20E_KEY))) == NULL)
+    {
+      ERRFN("Out of memory for key context.");
+      break;
+    }
+    tpmKey->handle = keyHandle;
+    memcpy(tpmKey->password, keyPasswordStr, OBJ_MAX_LEN);
+    
+    if (!ECDSA_set_ex_data(ecKey, tpm20eKeyIndex, tpmKey))
+    {
+      ERRFN("Could not attach key context to EC_KEY.");
+      OPENSSL_cleanse(tpmKey, sizeof(TPM20E_KEY));
+      OPENSSL_free(tpmKey);
+      break;
+    }
+    
+    // Sign with this engine even if it is not the default ECDSA engine
+    ECDSA_set_method(ecKey, &tpm20e_ecdsa_method);
+
+    if (tpm20e_swkeyUnseal(keyHandle) != 0)
+    {
+      ERRFN("No software copy of key 0x%x, it always signs on the TPM.", keyHandle);
+    }
     
     key = EVP_PKEY_new();
     EVP_PKEY_set1_EC_KEY(key, ecKey);
@@ -505,26 +880,110 @@ static EVP_PKEY *tpm20e_loadPrivateKey(
     DBGFN("Return with &EVP_PKEY=0x%x and &EC_KEY=0x%x",
       (unsigned int) key,
       (unsigned int) ecKey);
-
-    tpm20e_tssStop();
-    return key; // RETURN SUCCESS
+    break;
   }
   
-  tpm20e_tssStop(); 
-  return (EVP_PKEY*) NULL; // RETURN FAIL
+  if (ecKey != NULL)
+  {
+    EC_KEY_free(ecKey); // EVP_PKEY holds its own reference
+  }
+  OPENSSL_cleanse(keyIdStr, sizeof(keyIdStr));
+  OPENSSL_cleanse(keyPasswordStr, sizeof(keyPasswordStr));
+  return key;
+}
+
+/**********************************************************************
+ * Reads an exported public key in PEM or DER (SubjectPublicKeyInfo).
+ **********************************************************************/
+static EVP_PKEY *tpm20e_readPublicKeyFile(
+  const char  *path)
+{
+  FILE      *file;
+  EVP_PKEY  *key;
+
+  if ((file = fopen(path, "rb")) == NULL)
+  {
+    ERRFN("Could not open public key file '%s'.", path);
+    return NULL;
+  }
+
+  if ((key = PEM_read_PUBKEY(file, NULL, NULL, NULL)) == NULL)
+  {
+    ERR_clear_error();
+    rewind(file);
+    if ((key = d2i_PUBKEY_fp(file, NULL)) == NULL)
+    {
+      ERRFN("'%s' is neither a PEM nor a DER public key.", path);
+    }
+  }
+
+  fclose(file);
+  return key;
 }
 
+
+
+/*
+ * Accepts the private key id ("0x81020001;password", the password is
+ * ignored), a bare handle ("0x81020001") or the path of an exported
+ * PEM/DER public key. Handles are served from the public key cache, so
+ * only a miss reads the key from the TPM.
+ */
 static EVP_PKEY *tpm20e_loadPublicKey(  
   ENGINE*      e,
   const char*  key_id,
   UI_METHOD*   ui,
   void*        cb_data)
 {
-  DBGFN("Load public key");
-  
-  // TODO (not implemented)
-  
-  return (EVP_PKEY*) NULL;
+  TPMI_DH_OBJECT   keyHandle;
+  EVP_PKEY        *key = NULL;
+  EC_KEY          *ecKey = NULL;
+  char             keyHandleHexStr[OBJ_MAX_LEN] = { 0 };
+  size_t           len;
+  int              status;
+
+  DBGFN("Load public key '%s'", key_id);
+
+  if (key_id == NULL)
+  {
+    ERRFN("No key id given.");
+    return NULL;
+  }
+
+  len = strcspn(key_id, ";");
+  if (len >= sizeof(keyHandleHexStr) ||
+      (strncmp(key_id, "0x", 2) != 0 && strncmp(key_id, "0X", 2) != 0))
+  {
+    return tpm20e_readPublicKeyFile(key_id);
+  }
+  memcpy(keyHandleHexStr, key_id, len);
+
+  while (1)
+  {
+    if ((status = getSizeUint32Hex(keyHandleHexStr, &keyHandle)) != 0)
+    {
+      ERRFN("Invalid key handle (returned %d).", status);
+      break;
+    }
+
+    if ((status = pubcache_get(&pubCache, &tssPool, keyHandle, &ecKey)) != 0)
+    {
+      ERRFN("Could not read public key from TPM (returned %d).", status);
+      break;
+    }
+
+    if ((key = EVP_PKEY_new()) != NULL)
+    {
+      EVP_PKEY_set1_EC_KEY(key, ecKey);
+    }
+    break;
+  }
+
+  if (ecKey != NULL)
+  {
+    EC_KEY_free(ecKey); // EVP_PKEY holds its own reference
+  }
+  return key;
 }
 
 /**********************************************************************
@@ -537,15 +996,149 @@ int tpm20e_engine_finish(
   ENGINE *e);
 int tpm20e_engine_destroy(
   ENGINE *e);
+int tpm20e_engine_ctrl(
+  ENGINE *e,
+  int cmd,
+  long i,
+  void *p,
+  void (*f) (void));
 int bind_helper(
   ENGINE * e,
   const char *id);
 
+static const ENGINE_CMD_DEFN tpm20e_cmd_defns[] = {
+  { TPM20E_CMD_POOL_SIZE,
+    "POOL_SIZE",
+    "Number of parallel connections to each TPM / resource manager (1..16)",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_RAND_LOW_WATERMARK,
+    "RAND_LOW_WATERMARK",
+    "Refill the entropy pool when it holds fewer bytes than this",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_RAND_HIGH_WATERMARK,
+    "RAND_HIGH_WATERMARK",
+    "Size of the entropy pool in bytes (1..65536)",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_RAND_POOL_EMPTY,
+    "RAND_POOL_EMPTY",
+    "Number of random requests the entropy pool could not serve (p = unsigned long*)",
+    ENGINE_CMD_FLAG_NO_INPUT },
+  { TPM20E_CMD_RAND_MODE,
+    "RAND_MODE",
+    "\"tpm\": random bytes from the TPM, \"drbg\": TPM-seeded HMAC_DRBG",
+    ENGINE_CMD_FLAG_STRING },
+  { TPM20E_CMD_RAND_RESEED_BYTES,
+    "RAND_RESEED_BYTES",
+    "Reseed the DRBG after this many output bytes (0: no limit)",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_RAND_RESEED_SECONDS,
+    "RAND_RESEED_SECONDS",
+    "Reseed the DRBG after this many seconds (0: no limit)",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_PUBKEY_CACHE_TTL,
+    "PUBKEY_CACHE_TTL",
+    "Seconds until a cached public key is checked against the TPM name (0: never)",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_PUBKEY_CACHE_FILE,
+    "PUBKEY_CACHE_FILE",
+    "File to persist the public key cache in (empty: memory only)",
+    ENGINE_CMD_FLAG_STRING },
+  { TPM20E_CMD_LAZY_CONNECT,
+    "LAZY_CONNECT",
+    "1: do not connect to the TPM before the first operation that needs it",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_HELPER_CRYPTO,
+    "HELPER_CRYPTO",
+    "Session HMACs, pHashes and CFB parameter encryption in software (\"sw\", default) or on the TPM (\"tpm\")",
+    ENGINE_CMD_FLAG_STRING },
+  { TPM20E_CMD_KDFA_SELF_CHECK,
+    "KDFA_SELF_CHECK",
+    "Compare the software KDFa with KDFa over TPM-computed HMACs",
+    ENGINE_CMD_FLAG_NO_INPUT },
+  { TPM20E_CMD_TCTI,
+    "TCTI",
+    "TPM access: \"socket:host:port\" (resource manager, default), \"async:host:port\" (same, event loop) or \"device:/dev/tpmrm0\"",
+    ENGINE_CMD_FLAG_STRING },
+  { TPM20E_CMD_SCHED_LIMITS,
+    "SCHED_LIMITS",
+    "Connections for signatures, other foreground and background commands, e.g. \"0,0,1\" (0: no limit)",
+    ENGINE_CMD_FLAG_STRING },
+  { TPM20E_CMD_SIGN_DEADLINE,
+    "SIGN_DEADLINE",
+    "Drop a signature that waited this many milliseconds for a TPM connection (0: never)",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_SCHED_DROPS,
+    "SCHED_DROPS",
+    "Number of TPM commands dropped at their deadline (p = unsigned long*)",
+    ENGINE_CMD_FLAG_NO_INPUT },
+  { TPM20E_CMD_ENDPOINT,
+    "ENDPOINT",
+    "Add a TPM with the same keys for signing: TCTI as for \"TCTI\", then optional \",keyHandle=localHandle\" mappings",
+    ENGINE_CMD_FLAG_STRING },
+  { TPM20E_CMD_PRECOMMIT_DEPTH,
+    "PRECOMMIT_DEPTH",
+    "TPM2_Commits kept ready per ECDAA key (0..16, 0: commit at signing time)",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_SW_SIGN_POLICY,
+    "SW_SIGN_POLICY",
+    "Sign with software key copies: \"off\" (default), \"auto\" (on overload) or \"always\"",
+    ENGINE_CMD_FLAG_STRING },
+  { TPM20E_CMD_SW_SIGN_THRESHOLD,
+    "SW_SIGN_THRESHOLD",
+    "Queued TPM signatures from which on the TPM counts as overloaded",
+    ENGINE_CMD_FLAG_NUMERIC },
+  { TPM20E_CMD_SW_SIGN_KEY,
+    "SW_SIGN_KEY",
+    "Sealed software copy of a key: \"keyHandle;parentPath;parentPassword;objectPath;objectPassword\"",
+    ENGINE_CMD_FLAG_STRING },
+  { TPM20E_CMD_SW_SIGN_COUNT,
+    "SW_SIGN_COUNT",
+    "Number of signatures made in software (p = unsigned long*)",
+    ENGINE_CMD_FLAG_NO_INPUT },
+  { TPM20E_CMD_OVERLOAD_COUNT,
+    "OVERLOAD_COUNT",
+    "Number of signatures that found the TPM overloaded (p = unsigned long*)",
+    ENGINE_CMD_FLAG_NO_INPUT },
+  { 0, NULL, NULL, 0 }
+};
+
+static int tssPoolInitialized = 0;
+
+/**********************************************************************
+ * Runs the KDFa self check on a checked out connection.
+ **********************************************************************/
+static int tpm20e_kdfaSelfCheck(void)
+{
+  TSS_CONN  *conn;
+  TPM_RC     rval;
+
+  if ((conn = tpm20e_tssAcquire()) == NULL)
+  {
+    return 0;
+  }
+
+  rval = KDFaSelfCheck(conn->sysContext);
+
+  tpm20e_tssRelease(conn);
+
+  if (rval != TPM_RC_SUCCESS)
+  {
+    ERRFN("KDFa self check failed (0x%x).", rval);
+    return 0;
+  }
+  DBGFN("KDFa self check passed.");
+  return EVP_SUCCESS;
+}
+
 int tpm20e_engine_init(ENGINE *e) {
   DBGFN("Engine init.");
   
-  tpm20e_tssStart();
-  
+  if (tpm20e_tssStart() != 0)
+  {
+    ERRFN("Engine init failed, TPM not available.");
+    return 0;
+  }
+
   return EVP_SUCCESS;
 }
 
@@ -560,11 +1153,215 @@ int tpm20e_engine_finish(ENGINE *e) {
 int tpm20e_engine_destroy(ENGINE *e) {
   DBGFN("Engine destroy.");
   
-  tpm20e_tssStop();
+  if (tssPoolInitialized)
+  {
+    signq_destroy(&signQueue);
+    commitq_destroy(&commitQueue);
+    swkey_destroy(&swKeys);
+    tssloop_destroy(&tssLoop);
+    pubcache_destroy(&pubCache);
+    hmacdrbg_destroy(&randDrbg);
+    randpool_destroy(&randPool);
+    tssshard_destroy(&tssShards);
+    tsspool_destroy(&tssPool);
+    tssPoolInitialized = 0;
+  }
   
   return EVP_SUCCESS;
 }
 
+/**********************************************************************
+ * SCHED_LIMITS "sign,foreground,background": connection limit of each
+ * priority class, 0 for no limit.
+ **********************************************************************/
+static int tpm20e_setSchedLimits(
+  const char  *limits)
+{
+  const char  *next = limits;
+  char        *end;
+  long         limit[TSSPOOL_NR_CLASSES];
+  int          cls;
+
+  for (cls = 0; next != NULL && cls < TSSPOOL_NR_CLASSES; cls++)
+  {
+    limit[cls] = strtol(next, &end, 10);
+    if (end == next || *end != (cls < TSSPOOL_NR_CLASSES - 1 ? ',' : '\0'))
+    {
+      break;
+    }
+    next = end + 1;
+  }
+
+  if (limits == NULL || cls < TSSPOOL_NR_CLASSES)
+  {
+    ERRFN("SCHED_LIMITS must be \"sign,foreground,background\", e.g. \"0,0,1\".");
+    return 0;
+  }
+
+  for (cls = 0; cls < TSSPOOL_NR_CLASSES; cls++)
+  {
+    if (tsspool_setLimit(&tssPool, cls, (int) limit[cls]) != 0)
+    {
+      return 0;
+    }
+  }
+  return EVP_SUCCESS;
+}
+
+int tpm20e_engine_ctrl(
+  ENGINE  *e,
+  int      cmd,
+  long     i,
+  void    *p,
+  void   (*f) (void))
+{
+  DBGFN("Engine ctrl %d.", cmd);
+
+  switch (cmd)
+  {
+    case TPM20E_CMD_POOL_SIZE:
+      return tssshard_setSize(&tssShards, (int) i) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_RAND_LOW_WATERMARK:
+      return randpool_setWatermarks(&randPool, i, -1) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_RAND_HIGH_WATERMARK:
+      return randpool_setWatermarks(&randPool, -1, i) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_RAND_POOL_EMPTY:
+      if (p == NULL)
+      {
+        ERRFN("RAND_POOL_EMPTY expects an unsigned long* argument.");
+        return 0;
+      }
+      *(unsigned long*) p = randpool_getDryCount(&randPool);
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_RAND_MODE:
+      if (p != NULL && strcmp((const char*) p, "tpm") == 0)
+      {
+        randMode = TPM20E_RAND_MODE_TPM;
+        hmacdrbg_uninstantiate(&randDrbg);
+      }
+      else if (p != NULL && strcmp((const char*) p, "drbg") == 0)
+      {
+        randMode = TPM20E_RAND_MODE_DRBG;
+      }
+      else
+      {
+        ERRFN("RAND_MODE must be \"tpm\" or \"drbg\".");
+        return 0;
+      }
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_RAND_RESEED_BYTES:
+      if (i < 0)
+      {
+        ERRFN("RAND_RESEED_BYTES must not be negative.");
+        return 0;
+      }
+      hmacdrbg_setReseedInterval(&randDrbg, (unsigned long) i, randDrbg.reseedSeconds);
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_RAND_RESEED_SECONDS:
+      if (i < 0)
+      {
+        ERRFN("RAND_RESEED_SECONDS must not be negative.");
+        return 0;
+      }
+      hmacdrbg_setReseedInterval(&randDrbg, randDrbg.reseedBytes, (unsigned long) i);
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_PUBKEY_CACHE_TTL:
+      if (i < 0)
+      {
+        ERRFN("PUBKEY_CACHE_TTL must not be negative.");
+        return 0;
+      }
+      pubcache_setTtl(&pubCache, (unsigned long) i);
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_HELPER_CRYPTO:
+      if (SetHelperCryptoBackend((const char*) p) != 0)
+      {
+        ERRFN("HELPER_CRYPTO must be \"sw\" or \"tpm\".");
+        return 0;
+      }
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_KDFA_SELF_CHECK:
+      return tpm20e_kdfaSelfCheck();
+
+    case TPM20E_CMD_LAZY_CONNECT:
+      lazyConnect = (i != 0);
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_PUBKEY_CACHE_FILE:
+      return pubcache_setFile(&pubCache, (const char*) p) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_TCTI:
+      return tsspool_setTcti(&tssPool, (const char*) p) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_SCHED_LIMITS:
+      return tpm20e_setSchedLimits((const char*) p);
+
+    case TPM20E_CMD_SIGN_DEADLINE:
+      if (i < 0)
+      {
+        ERRFN("SIGN_DEADLINE must not be negative.");
+        return 0;
+      }
+      signDeadlineMs = i;
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_SCHED_DROPS:
+      if (p == NULL)
+      {
+        ERRFN("SCHED_DROPS expects an unsigned long* argument.");
+        return 0;
+      }
+      *(unsigned long*) p = tsspool_getDrops(&tssPool);
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_ENDPOINT:
+      return tssshard_addEndpoint(&tssShards, (const char*) p) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_PRECOMMIT_DEPTH:
+      return commitq_setDepth(&commitQueue, i) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_SW_SIGN_POLICY:
+      return swkey_setPolicy(&swKeys, (const char*) p) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_SW_SIGN_THRESHOLD:
+      return swkey_setThreshold(&swKeys, i) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_SW_SIGN_KEY:
+      return swkey_add(&swKeys, (const char*) p) == 0 ? EVP_SUCCESS : 0;
+
+    case TPM20E_CMD_SW_SIGN_COUNT:
+      if (p == NULL)
+      {
+        ERRFN("SW_SIGN_COUNT expects an unsigned long* argument.");
+        return 0;
+      }
+      *(unsigned long*) p = swkey_getSwSigns(&swKeys);
+      return EVP_SUCCESS;
+
+    case TPM20E_CMD_OVERLOAD_COUNT:
+      if (p == NULL)
+      {
+        ERRFN("OVERLOAD_COUNT expects an unsigned long* argument.");
+        return 0;
+      }
+      *(unsigned long*) p = swkey_getOverloads(&swKeys);
+      return EVP_SUCCESS;
+
+    default:
+      ERRFN("Unknown engine control command %d.", cmd);
+      return 0;
+  }
+}
+
 int bind_helper(ENGINE * e, const char *id)
 {
   DBGFN("Engine bind helper");
@@ -579,13 +1376,36 @@ int bind_helper(ENGINE * e, const char *id)
   // Workaround to keept the verification in OpenSSL, not on TPM
   tpm20e_ecdsa_method.ecdsa_do_verify = ecdsaMethod->ecdsa_do_verify;
   
+  if (tpm20eKeyIndex < 0 &&
+      (tpm20eKeyIndex = ECDSA_get_ex_new_index(0, NULL, NULL, NULL, tpm20e_keyFree)) < 0)
+  {
+    ERRFN("Could not allocate ECDSA ex_data index.");
+    return 0;
+  }
+  
+  if (!tssPoolInitialized)
+  {
+    tsspool_init(&tssPool, DEFAULT_HOSTNAME, DEFAULT_RESMGR_TPM_PORT, TSSPOOL_DEFAULT_SIZE);
+    tssshard_init(&tssShards, &tssPool);
+    randpool_init(&randPool, &tssPool);
+    hmacdrbg_init(&randDrbg, tpm20e_getTpmRandomBytes);
+    pubcache_init(&pubCache);
+    signq_init(&signQueue, &tssPool);
+    commitq_init(&commitQueue, &tssPool);
+    swkey_init(&swKeys);
+    tssloop_init(&tssLoop);
+    tssPoolInitialized = 1;
+  }
+  
   if (!ENGINE_set_id                   (e,  engine_tpm20e_id)       ||
       !ENGINE_set_name                 (e,  engine_tpm20e_name)     ||
       !ENGINE_set_init_function        (e,  tpm20e_engine_init)     ||
       !ENGINE_set_destroy_function     (e,  tpm20e_engine_destroy)  ||
       !ENGINE_set_finish_function      (e,  tpm20e_engine_finish)   ||
+      !ENGINE_set_ctrl_function        (e,  tpm20e_engine_ctrl)     ||
+      !ENGINE_set_cmd_defns            (e,  tpm20e_cmd_defns)       ||
       !ENGINE_set_RAND                 (e, &tpm20e_random_method)   ||
-  //    !ENGINE_set_load_pubkey_function (e,  tpm20e_loadPublicKey)   || // TODO: currently not used
+      !ENGINE_set_load_pubkey_function (e,  tpm20e_loadPublicKey)   ||
       !ENGINE_set_load_privkey_function(e,  tpm20e_loadPrivateKey)  ||
       !ENGINE_set_ECDSA                (e, &tpm20e_ecdsa_method))
   {
@@ -12,6 +12,35 @@ extern "C" {
 #define EVP_SUCCESS ( 1)
 #define EVP_FAIL    (-1)
 
+/*
+ * Engine control commands (ENGINE_ctrl_cmd_string() names in quotes),
+ * e.g. in an openssl.cnf engine section: POOL_SIZE = 8
+ */
+#define TPM20E_CMD_POOL_SIZE           (ENGINE_CMD_BASE + 0) /* "POOL_SIZE", numeric */
+#define TPM20E_CMD_RAND_LOW_WATERMARK  (ENGINE_CMD_BASE + 1) /* "RAND_LOW_WATERMARK", numeric */
+#define TPM20E_CMD_RAND_HIGH_WATERMARK (ENGINE_CMD_BASE + 2) /* "RAND_HIGH_WATERMARK", numeric */
+#define TPM20E_CMD_RAND_POOL_EMPTY     (ENGINE_CMD_BASE + 3) /* "RAND_POOL_EMPTY", out: unsigned long* */
+#define TPM20E_CMD_RAND_MODE           (ENGINE_CMD_BASE + 4) /* "RAND_MODE", "tpm" | "drbg" */
+#define TPM20E_CMD_RAND_RESEED_BYTES   (ENGINE_CMD_BASE + 5) /* "RAND_RESEED_BYTES", numeric */
+#define TPM20E_CMD_RAND_RESEED_SECONDS (ENGINE_CMD_BASE + 6) /* "RAND_RESEED_SECONDS", numeric */
+#define TPM20E_CMD_PUBKEY_CACHE_TTL    (ENGINE_CMD_BASE + 7) /* "PUBKEY_CACHE_TTL", numeric */
+#define TPM20E_CMD_PUBKEY_CACHE_FILE   (ENGINE_CMD_BASE + 8) /* "PUBKEY_CACHE_FILE", path */
+#define TPM20E_CMD_LAZY_CONNECT        (ENGINE_CMD_BASE + 9) /* "LAZY_CONNECT", numeric */
+/* ENGINE_CMD_BASE + 10 is unused */
+#define TPM20E_CMD_HELPER_CRYPTO       (ENGINE_CMD_BASE + 11) /* "HELPER_CRYPTO", "sw" | "tpm" */
+#define TPM20E_CMD_KDFA_SELF_CHECK     (ENGINE_CMD_BASE + 12) /* "KDFA_SELF_CHECK", no input */
+#define TPM20E_CMD_TCTI                (ENGINE_CMD_BASE + 13) /* "TCTI", "socket:host:port" | "async:host:port" | "device:path" */
+#define TPM20E_CMD_SCHED_LIMITS        (ENGINE_CMD_BASE + 14) /* "SCHED_LIMITS", "sign,foreground,background" */
+#define TPM20E_CMD_SIGN_DEADLINE       (ENGINE_CMD_BASE + 15) /* "SIGN_DEADLINE", numeric (ms) */
+#define TPM20E_CMD_SCHED_DROPS         (ENGINE_CMD_BASE + 16) /* "SCHED_DROPS", out: unsigned long* */
+#define TPM20E_CMD_ENDPOINT            (ENGINE_CMD_BASE + 17) /* "ENDPOINT", "tcti[,keyHandle=localHandle]..." */
+#define TPM20E_CMD_PRECOMMIT_DEPTH     (ENGINE_CMD_BASE + 18) /* "PRECOMMIT_DEPTH", numeric */
+#define TPM20E_CMD_SW_SIGN_POLICY      (ENGINE_CMD_BASE + 19) /* "SW_SIGN_POLICY", "off" | "auto" | "always" */
+#define TPM20E_CMD_SW_SIGN_THRESHOLD   (ENGINE_CMD_BASE + 20) /* "SW_SIGN_THRESHOLD", numeric */
+#define TPM20E_CMD_SW_SIGN_KEY         (ENGINE_CMD_BASE + 21) /* "SW_SIGN_KEY", "keyHandle;parentPath;parentPassword;objectPath;objectPassword" */
+#define TPM20E_CMD_SW_SIGN_COUNT       (ENGINE_CMD_BASE + 22) /* "SW_SIGN_COUNT", out: unsigned long* */
+#define TPM20E_CMD_OVERLOAD_COUNT      (ENGINE_CMD_BASE + 23) /* "OVERLOAD_COUNT", out: unsigned long* */
+
 /*
  * OpenSSL internally only, copied from OpenSSL 1.0.1t and file
  * "./crypto/ecdsa/ecs_locl.h".
@@ -33,6 +62,17 @@ struct ecdsa_method {
     char *app_data;
 };
 
+/*
+ * ECDAA signatures (with precomputed TPM2_Commit, see PRECOMMIT_DEPTH).
+ * ECDAA keys cannot be loaded as ECDSA keys. Returns 1 on success.
+ */
+int tpm20e_ecdaaSign(
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  const unsigned char  *digest,
+  int                   digestLen,
+  TPMT_SIGNATURE       *signature
+);
 
 #ifdef  __cplusplus
 }
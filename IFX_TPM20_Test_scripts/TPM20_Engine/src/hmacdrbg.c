@@ -0,0 +1,284 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "hmacdrbg.h"
+#include "tpm20w.h"
+
+static int hmacdrbg_hmac(
+  const unsigned char  *key,
+  const unsigned char  *data1,
+  size_t                data1Len,
+  const unsigned char  *data2,
+  size_t                data2Len,
+  const unsigned char  *data3,
+  size_t                data3Len,
+  unsigned char        *out
+);
+
+static int hmacdrbg_update(
+  HMAC_DRBG            *drbg,
+  const unsigned char  *provided,
+  size_t                providedLen
+);
+
+static int hmacdrbg_reseed(
+  HMAC_DRBG  *drbg
+);
+
+static int hmacdrbg_output(
+  HMAC_DRBG      *drbg,
+  unsigned char  *buffer,
+  int             nrBytes
+);
+
+
+
+void hmacdrbg_init(
+  HMAC_DRBG            *drbg,
+  HMACDRBG_ENTROPY_FN   getEntropy)
+{
+  memset(drbg, 0, sizeof(HMAC_DRBG));
+
+  drbg->reseedBytes   = HMACDRBG_DEFAULT_RESEED_BYTES;
+  drbg->reseedSeconds = HMACDRBG_DEFAULT_RESEED_SECONDS;
+  drbg->getEntropy    = getEntropy;
+
+  pthread_mutex_init(&drbg->mutex, NULL);
+}
+
+
+
+void hmacdrbg_destroy(
+  HMAC_DRBG  *drbg)
+{
+  hmacdrbg_uninstantiate(drbg);
+  pthread_mutex_destroy(&drbg->mutex);
+}
+
+
+
+void hmacdrbg_setReseedInterval(
+  HMAC_DRBG      *drbg,
+  unsigned long   reseedBytes,
+  unsigned long   reseedSeconds)
+{
+  pthread_mutex_lock(&drbg->mutex);
+  drbg->reseedBytes   = reseedBytes;
+  drbg->reseedSeconds = reseedSeconds;
+  pthread_mutex_unlock(&drbg->mutex);
+}
+
+
+
+/**********************************************************************
+ * Discards the internal state; the next request seeds a fresh one.
+ **********************************************************************/
+void hmacdrbg_uninstantiate(
+  HMAC_DRBG  *drbg)
+{
+  pthread_mutex_lock(&drbg->mutex);
+  OPENSSL_cleanse(drbg->K, sizeof(drbg->K));
+  OPENSSL_cleanse(drbg->V, sizeof(drbg->V));
+  drbg->seeded = 0;
+  pthread_mutex_unlock(&drbg->mutex);
+}
+
+
+
+/**********************************************************************
+ * HMAC_DRBG_Generate. Seeds or reseeds the state first if necessary.
+ * Returns 1 on success, -1 on error.
+ **********************************************************************/
+int hmacdrbg_generate(
+  HMAC_DRBG      *drbg,
+  unsigned char  *buffer,
+  int             nrBytes)
+{
+  int  chunk;
+  int  result = 1;
+
+  pthread_mutex_lock(&drbg->mutex);
+
+  while (nrBytes > 0 && result == 1)
+  {
+    if (!drbg->seeded ||
+        drbg->seededPid != getpid() ||
+        (drbg->reseedBytes > 0 && drbg->bytesSinceReseed >= drbg->reseedBytes) ||
+        (drbg->reseedSeconds > 0 &&
+         (unsigned long) (time(NULL) - drbg->seededAt) >= drbg->reseedSeconds))
+    {
+      if ((result = hmacdrbg_reseed(drbg)) != 1)
+      {
+        break;
+      }
+    }
+
+    chunk = (nrBytes > HMACDRBG_MAX_REQUEST) ? HMACDRBG_MAX_REQUEST : nrBytes;
+    drbg->bytesSinceReseed += chunk;
+    nrBytes -= chunk;
+
+    result = hmacdrbg_output(drbg, buffer, chunk);
+    buffer += chunk;
+  }
+
+  if (result != 1)
+  {
+    // Never continue from a state that may be half updated
+    OPENSSL_cleanse(drbg->K, sizeof(drbg->K));
+    OPENSSL_cleanse(drbg->V, sizeof(drbg->V));
+    drbg->seeded = 0;
+  }
+  pthread_mutex_unlock(&drbg->mutex);
+  return result;
+}
+
+
+
+/**********************************************************************
+ * Produces one request's worth of output (at most HMACDRBG_MAX_REQUEST
+ * bytes) and updates the state. Caller holds the mutex.
+ **********************************************************************/
+static int hmacdrbg_output(
+  HMAC_DRBG      *drbg,
+  unsigned char  *buffer,
+  int             nrBytes)
+{
+  int  n;
+
+  while (nrBytes > 0)
+  {
+    if (hmacdrbg_hmac(drbg->K, drbg->V, HMACDRBG_OUTLEN, NULL, 0, NULL, 0, drbg->V) != 1)
+    {
+      return -1;
+    }
+
+    n = (nrBytes < HMACDRBG_OUTLEN) ? nrBytes : HMACDRBG_OUTLEN;
+    memcpy(buffer, drbg->V, n);
+    buffer  += n;
+    nrBytes -= n;
+  }
+
+  return hmacdrbg_update(drbg, NULL, 0);
+}
+
+
+
+/**********************************************************************
+ * Instantiates (first call) or reseeds the state with fresh seed
+ * material. Caller holds the mutex.
+ **********************************************************************/
+static int hmacdrbg_reseed(
+  HMAC_DRBG  *drbg)
+{
+  unsigned char  seed[HMACDRBG_SEEDLEN];
+  int            result = -1;
+
+  DBGFN("%s DRBG from the TPM.", drbg->seeded ? "Reseeding" : "Seeding");
+
+  while (1)
+  {
+    if (drbg->getEntropy == NULL ||
+        drbg->getEntropy(seed, sizeof(seed)) != 1)
+    {
+      ERRFN("No seed material available.");
+      break;
+    }
+
+    if (!drbg->seeded || drbg->seededPid != getpid())
+    {
+      // Forked children start over rather than share the parent's state
+      memset(drbg->K, 0x00, sizeof(drbg->K));
+      memset(drbg->V, 0x01, sizeof(drbg->V));
+    }
+
+    if (hmacdrbg_update(drbg, seed, sizeof(seed)) != 1)
+    {
+      break;
+    }
+
+    drbg->seeded           = 1;
+    drbg->seededAt         = time(NULL);
+    drbg->seededPid        = getpid();
+    drbg->bytesSinceReseed = 0;
+    result = 1;
+    break;
+  }
+
+  OPENSSL_cleanse(seed, sizeof(seed));
+  return result;
+}
+
+
+
+/**********************************************************************
+ * HMAC_DRBG_Update:
+ *   K = HMAC(K, V || 0x00 || provided), V = HMAC(K, V)
+ *   and if provided data is given once more with 0x01.
+ **********************************************************************/
+static int hmacdrbg_update(
+  HMAC_DRBG            *drbg,
+  const unsigned char  *provided,
+  size_t                providedLen)
+{
+  static const unsigned char separator[2] = { 0x00, 0x01 };
+  int                        round;
+
+  for (round = 0; round < 2; round++)
+  {
+    if (hmacdrbg_hmac(drbg->K, drbg->V, HMACDRBG_OUTLEN,
+          &separator[round], 1, provided, providedLen, drbg->K) != 1 ||
+        hmacdrbg_hmac(drbg->K, drbg->V, HMACDRBG_OUTLEN,
+          NULL, 0, NULL, 0, drbg->V) != 1)
+    {
+      return -1;
+    }
+
+    if (providedLen == 0)
+    {
+      break;
+    }
+  }
+
+  return 1;
+}
+
+
+
+static int hmacdrbg_hmac(
+  const unsigned char  *key,
+  const unsigned char  *data1,
+  size_t                data1Len,
+  const unsigned char  *data2,
+  size_t                data2Len,
+  const unsigned char  *data3,
+  size_t                data3Len,
+  unsigned char        *out)
+{
+  HMAC_CTX       ctx;
+  unsigned char  md[EVP_MAX_MD_SIZE];
+  unsigned int   mdLen = 0;
+  int            ok;
+
+  HMAC_CTX_init(&ctx);
+  ok = HMAC_Init_ex(&ctx, key, HMACDRBG_OUTLEN, EVP_sha256(), NULL) &&
+       (data1Len == 0 || HMAC_Update(&ctx, data1, data1Len)) &&
+       (data2Len == 0 || HMAC_Update(&ctx, data2, data2Len)) &&
+       (data3Len == 0 || HMAC_Update(&ctx, data3, data3Len)) &&
+       HMAC_Final(&ctx, md, &mdLen);
+  HMAC_CTX_cleanup(&ctx);
+
+  if (!ok || mdLen != HMACDRBG_OUTLEN)
+  {
+    ERRFN("HMAC-SHA256 failed.");
+    OPENSSL_cleanse(md, sizeof(md));
+    return -1;
+  }
+
+  memcpy(out, md, HMACDRBG_OUTLEN);
+  OPENSSL_cleanse(md, sizeof(md));
+  return 1;
+}
@@ -0,0 +1,62 @@
+#ifndef _HMACDRBG_H_
+#define _HMACDRBG_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define HMACDRBG_OUTLEN                   (32) /* SHA-256                          */
+#define HMACDRBG_SEEDLEN                  (48) /* Entropy input plus nonce         */
+#define HMACDRBG_MAX_REQUEST           (65536) /* SP 800-90A: 2^19 bits per request */
+#define HMACDRBG_DEFAULT_RESEED_BYTES  (1UL << 20)
+#define HMACDRBG_DEFAULT_RESEED_SECONDS  (60)
+
+/*
+ * Supplies seed material, returns 1 on success.
+ */
+typedef int (*HMACDRBG_ENTROPY_FN)(unsigned char *buffer, int nrBytes);
+
+/*
+ * HMAC_DRBG with SHA-256 as specified in NIST SP 800-90A. The DRBG is
+ * reseeded from getEntropy after reseedBytes output bytes, after
+ * reseedSeconds (0 disables either limit) and in a forked child.
+ */
+typedef struct {
+  unsigned char        K[HMACDRBG_OUTLEN];
+  unsigned char        V[HMACDRBG_OUTLEN];
+  int                  seeded;
+  unsigned long        bytesSinceReseed;
+  time_t               seededAt;
+  pid_t                seededPid;
+  unsigned long        reseedBytes;
+  unsigned long        reseedSeconds;
+  HMACDRBG_ENTROPY_FN  getEntropy;
+  pthread_mutex_t      mutex;
+} HMAC_DRBG;
+
+void hmacdrbg_init(
+  HMAC_DRBG            *drbg,
+  HMACDRBG_ENTROPY_FN   getEntropy
+);
+
+void hmacdrbg_destroy(
+  HMAC_DRBG  *drbg
+);
+
+void hmacdrbg_setReseedInterval(
+  HMAC_DRBG      *drbg,
+  unsigned long   reseedBytes,
+  unsigned long   reseedSeconds
+);
+
+int hmacdrbg_generate(
+  HMAC_DRBG      *drbg,
+  unsigned char  *buffer,
+  int             nrBytes
+);
+
+void hmacdrbg_uninstantiate(
+  HMAC_DRBG  *drbg
+);
+
+#endif
@@ -30,11 +30,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "changeEndian.h"
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
 
 //
+// KDFa with an arbitrary HMAC function, one HMAC call per output block.
+// sysContext is passed through to the HMAC function.
 //
-TPM_RC KDFa( TPMI_ALG_HASH hashAlg, TPM2B *key, char *label,
-    TPM2B *contextU, TPM2B *contextV, UINT16 bits, TPM2B_MAX_BUFFER  *resultKey )
+static TPM_RC KDFaGeneric( TPMI_ALG_HASH hashAlg, TPM2B *key, char *label,
+    TPM2B *contextU, TPM2B *contextV, UINT16 bits, TPM2B_MAX_BUFFER  *resultKey,
+    UINT32 (*hmacFunction)( TSS2_SYS_CONTEXT *sysContext, TPMI_ALG_HASH hashAlg, TPM2B *key,
+        TPM2B **bufferList, TPM2B_DIGEST *result ),
+    TSS2_SYS_CONTEXT *sysContext )
 {
     TPM2B_DIGEST tmpResult;
     TPM2B_DIGEST tpm2bLabel, tpm2bBits, tpm2b_i_2;
@@ -110,13 +118,18 @@ TPM_RC KDFa( TPMI_ALG_HASH hashAlg, TPM2B *key, char *label,
         }
         CloseOutFile( &outFp );
 #endif
-        rval = (*HmacFunctionPtr )( hashAlg, key, (TPM2B **)&( bufferList[0] ), &tmpResult );
+        rval = (*hmacFunction )( sysContext, hashAlg, key, (TPM2B **)&( bufferList[0] ), &tmpResult );
         if( rval != TPM_RC_SUCCESS )
         {
             return( rval );
         }
 
-        ConcatSizedByteBuffer( resultKey, &(tmpResult.b) );
+        rval = ConcatSizedByteBuffer( resultKey, &(tmpResult.b) );
+        if( rval != TPM_RC_SUCCESS )
+        {
+            return( rval );
+        }
+        i++;
     }
 
     // Truncate the result to the desired size.
@@ -131,3 +144,144 @@ TPM_RC KDFa( TPMI_ALG_HASH hashAlg, TPM2B *key, char *label,
     
     return TPM_RC_SUCCESS;
 }
+
+//
+// Native KDFa:  the HMAC key schedule (inner and outer pad state) is set
+// up once, every output block only hashes counter || label || contextU ||
+// contextV || bits.
+//
+static TPM_RC KDFaSw( TPMI_ALG_HASH hashAlg, TPM2B *key, char *label,
+    TPM2B *contextU, TPM2B *contextV, UINT16 bits, TPM2B_MAX_BUFFER  *resultKey )
+{
+    const EVP_MD *md;
+    HMAC_CTX ctx;
+    BYTE block[EVP_MAX_MD_SIZE];
+    unsigned int blockSize = 0;
+    UINT32 bitsSwizzled, i_Swizzled;
+    UINT32 i;
+    UINT16 bytes = bits / 8;
+    UINT16 n;
+    int ok;
+
+    resultKey->t.size = 0;
+
+    md = SwHashAlgToMd( hashAlg );
+    if( md == 0 )
+        return APPLICATION_ERROR( TPM_RC_HASH );
+
+    if( bytes > sizeof( resultKey->t.buffer ) )
+        return APPLICATION_ERROR( TSS2_BASE_RC_INSUFFICIENT_BUFFER );
+
+    bitsSwizzled = CHANGE_ENDIAN_DWORD( (UINT32)bits );
+
+    HMAC_CTX_init( &ctx );
+    ok = HMAC_Init_ex( &ctx, key->buffer, key->size, md, 0 );
+
+    for( i = 1; ok && resultKey->t.size < bytes; i++ )
+    {
+        i_Swizzled = CHANGE_ENDIAN_DWORD( i );
+
+        // A NULL key restarts from the precomputed inner pad state
+        ok = ( i == 1 || HMAC_Init_ex( &ctx, 0, 0, 0, 0 ) ) &&
+             HMAC_Update( &ctx, (BYTE *)&i_Swizzled, 4 ) &&
+             HMAC_Update( &ctx, (BYTE *)label, strlen( label ) + 1 ) &&
+             HMAC_Update( &ctx, contextU->buffer, contextU->size ) &&
+             HMAC_Update( &ctx, contextV->buffer, contextV->size ) &&
+             HMAC_Update( &ctx, (BYTE *)&bitsSwizzled, 4 ) &&
+             HMAC_Final( &ctx, block, &blockSize );
+
+        if( ok )
+        {
+            n = ( bytes - resultKey->t.size < blockSize ) ? bytes - resultKey->t.size : blockSize;
+            memcpy( &resultKey->t.buffer[resultKey->t.size], block, n );
+            resultKey->t.size += n;
+        }
+    }
+
+    HMAC_CTX_cleanup( &ctx );
+    OPENSSL_cleanse( block, sizeof( block ) );
+
+    if( !ok )
+    {
+        OPENSSL_cleanse( resultKey->t.buffer, sizeof( resultKey->t.buffer ) );
+        resultKey->t.size = 0;
+        return APPLICATION_ERROR( TPM_RC_FAILURE );
+    }
+
+#ifdef DEBUG
+    OpenOutFile( &outFp );
+    TpmClientPrintf( 0, "\n\nKDFA (sw), resultKey = \n" );
+    PrintSizedBuffer( &( resultKey->b ) );
+    CloseOutFile( &outFp );
+#endif
+
+    return TPM_RC_SUCCESS;
+}
+
+//
+// HmacFunctionPtr for KDFaGeneric, which picks its own sys context.
+//
+static UINT32 KDFaHmacFunction( TSS2_SYS_CONTEXT *sysContext, TPMI_ALG_HASH hashAlg, TPM2B *key,
+    TPM2B **bufferList, TPM2B_DIGEST *result )
+{
+    return (*HmacFunctionPtr)( hashAlg, key, bufferList, result );
+}
+
+//
+// Uses the native implementation while HMACs are computed in software.
+//
+TPM_RC KDFa( TPMI_ALG_HASH hashAlg, TPM2B *key, char *label,
+    TPM2B *contextU, TPM2B *contextV, UINT16 bits, TPM2B_MAX_BUFFER  *resultKey )
+{
+    if( HmacFunctionPtr == SwHmac )
+        return KDFaSw( hashAlg, key, label, contextU, contextV, bits, resultKey );
+
+    return KDFaGeneric( hashAlg, key, label, contextU, contextV, bits, resultKey, KDFaHmacFunction, 0 );
+}
+
+//
+// Compares the native KDFa with KDFa over HMACs computed by the TPM
+// (TpmHmac), for SHA-1 and SHA-256 and several output blocks.  The TPM
+// commands are sent through sysContext, so the check does not touch
+// resMgrTctiContext.
+//
+TPM_RC KDFaSelfCheck( TSS2_SYS_CONTEXT *sysContext )
+{
+    static const TPMI_ALG_HASH hashAlgs[] = { TPM_ALG_SHA1, TPM_ALG_SHA256 };
+    TPM2B_DIGEST key, contextU, contextV;
+    TPM2B_MAX_BUFFER native, reference;
+    TPM_RC rval;
+    int i;
+
+    key.t.size = 32;
+    contextU.t.size = 20;
+    contextV.t.size = 20;
+    for( i = 0; i < 32; i++ )
+        key.t.buffer[i] = (BYTE)i;
+    for( i = 0; i < 20; i++ )
+    {
+        contextU.t.buffer[i] = (BYTE)( 0x40 + i );
+        contextV.t.buffer[i] = (BYTE)( 0x80 + i );
+    }
+
+    for( i = 0; i < (int)( sizeof( hashAlgs ) / sizeof( hashAlgs[0] ) ); i++ )
+    {
+        rval = KDFaSw( hashAlgs[i], &key.b, "CFB", &contextU.b, &contextV.b, 584, &native );
+        if( rval != TPM_RC_SUCCESS )
+            return rval;
+
+        rval = KDFaGeneric( hashAlgs[i], &key.b, "CFB", &contextU.b, &contextV.b, 584, &reference,
+                TpmHmacOnSysContext, sysContext );
+        if( rval != TPM_RC_SUCCESS )
+            return rval;
+
+        if( native.t.size != reference.t.size ||
+            memcmp( native.t.buffer, reference.t.buffer, native.t.size ) != 0 )
+        {
+            TpmClientPrintf( 0, "KDFa self check failed for hash algorithm 0x%4.4x\n", hashAlgs[i] );
+            return APPLICATION_ERROR( TPM_RC_FAILURE );
+        }
+    }
+
+    return TPM_RC_SUCCESS;
+}
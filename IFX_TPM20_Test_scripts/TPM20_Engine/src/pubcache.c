@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+
+#include "pubcache.h"
+#include "tpm20w.h"
+
+#define PUBCACHE_FILE_MAGIC   "TPM20EPC"
+#define PUBCACHE_FILE_VERSION (1)
+
+typedef struct {
+  char    magic[8];
+  UINT32  version;
+  UINT32  recordSize;
+} PUBCACHE_FILE_HEADER;
+
+typedef struct {
+  TPMI_DH_OBJECT  handle;
+  UINT64          validatedAt;
+  TPM2B_PUBLIC    publicArea;
+  TPM2B_NAME      name;
+} PUBCACHE_FILE_RECORD;
+
+static PUBCACHE_ENTRY* pubcache_find(
+  PUB_CACHE       *cache,
+  TPMI_DH_OBJECT   handle
+);
+
+static int pubcache_put(
+  PUB_CACHE            *cache,
+  TPMI_DH_OBJECT        handle,
+  const TPM2B_PUBLIC   *publicArea,
+  const TPM2B_NAME     *name,
+  EC_KEY               *ecKey,
+  time_t                validatedAt
+);
+
+static void pubcache_clear(
+  PUB_CACHE  *cache
+);
+
+static int pubcache_load(
+  PUB_CACHE  *cache
+);
+
+static int pubcache_save(
+  PUB_CACHE  *cache
+);
+
+
+
+void pubcache_init(
+  PUB_CACHE  *cache)
+{
+  memset(cache, 0, sizeof(PUB_CACHE));
+  cache->ttl = PUBCACHE_DEFAULT_TTL;
+  pthread_mutex_init(&cache->mutex, NULL);
+}
+
+
+
+void pubcache_destroy(
+  PUB_CACHE  *cache)
+{
+  pthread_mutex_lock(&cache->mutex);
+  pubcache_clear(cache);
+  pthread_mutex_unlock(&cache->mutex);
+  pthread_mutex_destroy(&cache->mutex);
+}
+
+
+
+void pubcache_setTtl(
+  PUB_CACHE      *cache,
+  unsigned long   ttl)
+{
+  pthread_mutex_lock(&cache->mutex);
+  cache->ttl = ttl;
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+
+
+/**********************************************************************
+ * Persists the cache to fileName from now on, after merging the
+ * entries already stored there. An empty name turns persistence off.
+ **********************************************************************/
+int pubcache_setFile(
+  PUB_CACHE   *cache,
+  const char  *fileName)
+{
+  int status = 0;
+
+  if (fileName == NULL || strlen(fileName) >= PUBCACHE_PATH_MAX_LEN)
+  {
+    ERRFN("Invalid public key cache file name.");
+    return -1;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  strcpy(cache->fileName, fileName);
+  if (cache->fileName[0] != '\0')
+  {
+    status = pubcache_load(cache);
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Returns a copy of the public key of handle in *ecKey (to be freed
+ * by the caller). Talks to the TPM only on a miss or when the entry is
+ * due for revalidation. Returns 0 on success.
+ **********************************************************************/
+int pubcache_get(
+  PUB_CACHE        *cache,
+  TSS_POOL         *tssPool,
+  TPMI_DH_OBJECT    handle,
+  EC_KEY          **ecKey)
+{
+  PUBCACHE_ENTRY  *entry;
+  TSS_CONN        *conn;
+  TPM2B_PUBLIC     publicArea;
+  TPM2B_NAME       name;
+  EC_KEY          *readKey = NULL;
+  time_t           now = time(NULL);
+  int              retried = 0;
+  int              status;
+
+  *ecKey = NULL;
+
+  pthread_mutex_lock(&cache->mutex);
+  entry = pubcache_find(cache, handle);
+  if (entry != NULL &&
+      (cache->ttl == 0 || (unsigned long) (now - entry->validatedAt) < cache->ttl))
+  {
+    *ecKey = EC_KEY_dup(entry->ecKey);
+    pthread_mutex_unlock(&cache->mutex);
+    return (*ecKey != NULL) ? 0 : -1;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  DBGFN("Public key cache miss for handle 0x%8x.", handle);
+
+  if ((conn = tsspool_acquire(tssPool, TSSPOOL_CLASS_FOREGROUND, NULL)) == NULL)
+  {
+    return -1;
+  }
+  while ((status = tpm20w_readPublicArea(conn->sysContext, handle, &publicArea, &name)) != 0)
+  {
+    if (retried || !tssconn_recover(conn))
+    {
+      break;
+    }
+    retried = 1;
+  }
+  tsspool_release(tssPool, conn);
+
+  if (status != 0)
+  {
+    // Object is gone or the TPM unreachable, do not serve a stale key
+    pubcache_invalidate(cache, handle);
+    return -1;
+  }
+
+  if (tpm20w_publicToEcKey(&publicArea, &readKey) != 0)
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  if ((status = pubcache_put(cache, handle, &publicArea, &name, readKey, now)) == 0)
+  {
+    *ecKey = EC_KEY_dup(readKey);
+    if (cache->fileName[0] != '\0')
+    {
+      pubcache_save(cache);
+    }
+  }
+  else
+  {
+    EC_KEY_free(readKey);
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return (*ecKey != NULL) ? 0 : -1;
+}
+
+
+
+/**********************************************************************
+ * Copies the cached public area of handle (see pubcache_get()). Returns
+ * 0 on success, -1 if handle is not cached.
+ **********************************************************************/
+int pubcache_getPublicArea(
+  PUB_CACHE       *cache,
+  TPMI_DH_OBJECT   handle,
+  TPM2B_PUBLIC    *publicArea)
+{
+  PUBCACHE_ENTRY  *entry;
+  int              status = -1;
+
+  pthread_mutex_lock(&cache->mutex);
+  if ((entry = pubcache_find(cache, handle)) != NULL)
+  {
+    memcpy(publicArea, &entry->publicArea, sizeof(TPM2B_PUBLIC));
+    status = 0;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Returns the signing scheme the key of handle is restricted to, as
+ * cached by a previous pubcache_get(), or TPM_ALG_NULL.
+ **********************************************************************/
+TPMI_ALG_SIG_SCHEME pubcache_getScheme(
+  PUB_CACHE       *cache,
+  TPMI_DH_OBJECT   handle)
+{
+  PUBCACHE_ENTRY       *entry;
+  TPMI_ALG_SIG_SCHEME   scheme = TPM_ALG_NULL;
+
+  pthread_mutex_lock(&cache->mutex);
+  if ((entry = pubcache_find(cache, handle)) != NULL &&
+      entry->publicArea.t.publicArea.type == TPM_ALG_ECC)
+  {
+    scheme = entry->publicArea.t.publicArea.parameters.eccDetail.scheme.scheme;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return scheme;
+}
+
+
+
+void pubcache_invalidate(
+  PUB_CACHE       *cache,
+  TPMI_DH_OBJECT   handle)
+{
+  PUBCACHE_ENTRY  **link;
+  PUBCACHE_ENTRY   *entry;
+
+  pthread_mutex_lock(&cache->mutex);
+  for (link = &cache->buckets[handle % PUBCACHE_BUCKETS]; *link != NULL; link = &(*link)->next)
+  {
+    if ((*link)->handle == handle)
+    {
+      DBGFN("Dropping cached public key of handle 0x%8x.", handle);
+      entry = *link;
+      *link = entry->next;
+      EC_KEY_free(entry->ecKey);
+      OPENSSL_free(entry);
+      if (cache->fileName[0] != '\0')
+      {
+        pubcache_save(cache);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+
+
+static PUBCACHE_ENTRY* pubcache_find(
+  PUB_CACHE       *cache,
+  TPMI_DH_OBJECT   handle)
+{
+  PUBCACHE_ENTRY *entry;
+
+  for (entry = cache->buckets[handle % PUBCACHE_BUCKETS]; entry != NULL; entry = entry->next)
+  {
+    if (entry->handle == handle)
+    {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+
+
+/**********************************************************************
+ * Inserts or refreshes an entry; takes ownership of ecKey on success.
+ * An entry whose TPM name is unchanged keeps its key and only gets a
+ * new validation time. Caller holds the mutex.
+ **********************************************************************/
+static int pubcache_put(
+  PUB_CACHE            *cache,
+  TPMI_DH_OBJECT        handle,
+  const TPM2B_PUBLIC   *publicArea,
+  const TPM2B_NAME     *name,
+  EC_KEY               *ecKey,
+  time_t                validatedAt)
+{
+  PUBCACHE_ENTRY *entry;
+
+  if ((entry = pubcache_find(cache, handle)) == NULL)
+  {
+    if ((entry = OPENSSL_malloc(sizeof(PUBCACHE_ENTRY))) == NULL)
+    {
+      ERRFN("Out of memory for public key cache entry.");
+      return -1;
+    }
+    memset(entry, 0, sizeof(PUBCACHE_ENTRY));
+    entry->handle = handle;
+    entry->next   = cache->buckets[handle % PUBCACHE_BUCKETS];
+    cache->buckets[handle % PUBCACHE_BUCKETS] = entry;
+  }
+  else if (entry->name.t.size != name->t.size ||
+           memcmp(entry->name.t.name, name->t.name, name->t.size) != 0)
+  {
+    DBGFN("TPM name of handle 0x%8x changed, replacing cached key.", handle);
+  }
+
+  EC_KEY_free(entry->ecKey);
+  entry->ecKey       = ecKey;
+  entry->publicArea  = *publicArea;
+  entry->name        = *name;
+  entry->validatedAt = validatedAt;
+
+  return 0;
+}
+
+
+
+static void pubcache_clear(
+  PUB_CACHE  *cache)
+{
+  PUBCACHE_ENTRY  *entry;
+  int              i;
+
+  for (i = 0; i < PUBCACHE_BUCKETS; i++)
+  {
+    while ((entry = cache->buckets[i]) != NULL)
+    {
+      cache->buckets[i] = entry->next;
+      EC_KEY_free(entry->ecKey);
+      OPENSSL_free(entry);
+    }
+  }
+}
+
+
+
+/**********************************************************************
+ * Merges the cache file into memory. A missing file is not an error.
+ * Caller holds the mutex.
+ **********************************************************************/
+static int pubcache_load(
+  PUB_CACHE  *cache)
+{
+  FILE                  *file;
+  PUBCACHE_FILE_HEADER   header;
+  PUBCACHE_FILE_RECORD   record;
+  TPMS_ECC_POINT        *point;
+  EC_KEY                *ecKey;
+  int                    status = 0;
+
+  if ((file = fopen(cache->fileName, "rb")) == NULL)
+  {
+    DBGFN("No public key cache file '%s' yet.", cache->fileName);
+    return 0;
+  }
+
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, PUBCACHE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != PUBCACHE_FILE_VERSION ||
+      header.recordSize != sizeof(PUBCACHE_FILE_RECORD))
+  {
+    ERRFN("Ignoring incompatible public key cache file '%s'.", cache->fileName);
+    fclose(file);
+    return 0;
+  }
+
+  while (fread(&record, sizeof(record), 1, file) == 1)
+  {
+    point = &record.publicArea.t.publicArea.unique.ecc;
+    if (record.name.t.size > sizeof(record.name.t.name) ||
+        point->x.t.size > sizeof(point->x.t.buffer) ||
+        point->y.t.size > sizeof(point->y.t.buffer))
+    {
+      ERRFN("Corrupt record in public key cache file '%s'.", cache->fileName);
+      status = -1;
+      break;
+    }
+
+    if (pubcache_find(cache, record.handle) != NULL ||
+        tpm20w_publicToEcKey(&record.publicArea, &ecKey) != 0)
+    {
+      continue;
+    }
+    if (pubcache_put(cache, record.handle, &record.publicArea, &record.name,
+          ecKey, (time_t) record.validatedAt) != 0)
+    {
+      EC_KEY_free(ecKey);
+    }
+  }
+
+  fclose(file);
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Rewrites the cache file (via a temporary file and rename(), so that
+ * readers never see a partial file). Caller holds the mutex.
+ **********************************************************************/
+static int pubcache_save(
+  PUB_CACHE  *cache)
+{
+  char                   tmpName[PUBCACHE_PATH_MAX_LEN + 8];
+  FILE                  *file;
+  PUBCACHE_FILE_HEADER   header;
+  PUBCACHE_FILE_RECORD   record;
+  PUBCACHE_ENTRY        *entry;
+  int                    fd;
+  int                    i;
+  int                    ok;
+
+  snprintf(tmpName, sizeof(tmpName), "%s.tmp", cache->fileName);
+
+  if ((fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ||
+      (file = fdopen(fd, "wb")) == NULL)
+  {
+    ERRFN("Could not write public key cache file '%s'.", tmpName);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PUBCACHE_FILE_MAGIC, sizeof(header.magic));
+  header.version    = PUBCACHE_FILE_VERSION;
+  header.recordSize = sizeof(PUBCACHE_FILE_RECORD);
+  ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+
+  for (i = 0; ok && i < PUBCACHE_BUCKETS; i++)
+  {
+    for (entry = cache->buckets[i]; ok && entry != NULL; entry = entry->next)
+    {
+      memset(&record, 0, sizeof(record));
+      record.handle      = entry->handle;
+      record.validatedAt = (UINT64) entry->validatedAt;
+      record.publicArea  = entry->publicArea;
+      record.name        = entry->name;
+      ok = (fwrite(&record, sizeof(record), 1, file) == 1);
+    }
+  }
+
+  if (fclose(file) != 0 || !ok || rename(tmpName, cache->fileName) != 0)
+  {
+    ERRFN("Could not write public key cache file '%s'.", cache->fileName);
+    unlink(tmpName);
+    return -1;
+  }
+
+  return 0;
+}
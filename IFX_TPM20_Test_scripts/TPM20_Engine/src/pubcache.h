@@ -0,0 +1,79 @@
+#ifndef _PUBCACHE_H_
+#define _PUBCACHE_H_
+
+#include <pthread.h>
+#include <time.h>
+
+#include <sapi/tpm20.h>
+#include <openssl/ec.h>
+
+#include "tsspool.h"
+
+#define PUBCACHE_BUCKETS        (64)
+#define PUBCACHE_DEFAULT_TTL   (300) /* Seconds until a TPM name check */
+#define PUBCACHE_PATH_MAX_LEN  (256)
+
+typedef struct PUBCACHE_ENTRY {
+  TPMI_DH_OBJECT          handle;
+  TPM2B_PUBLIC            publicArea;
+  TPM2B_NAME              name;
+  EC_KEY                 *ecKey;       /* Template, callers get a copy */
+  time_t                  validatedAt;
+  struct PUBCACHE_ENTRY  *next;
+} PUBCACHE_ENTRY;
+
+/*
+ * Public keys of TPM objects, keyed by handle. An entry older than ttl
+ * seconds (0: never) is revalidated by comparing the TPM name; a
+ * changed name replaces the entry. With a file set, the cache survives
+ * process restarts.
+ */
+typedef struct {
+  PUBCACHE_ENTRY   *buckets[PUBCACHE_BUCKETS];
+  unsigned long     ttl;
+  char              fileName[PUBCACHE_PATH_MAX_LEN];
+  pthread_mutex_t   mutex;
+} PUB_CACHE;
+
+void pubcache_init(
+  PUB_CACHE  *cache
+);
+
+void pubcache_destroy(
+  PUB_CACHE  *cache
+);
+
+void pubcache_setTtl(
+  PUB_CACHE      *cache,
+  unsigned long   ttl
+);
+
+int pubcache_setFile(
+  PUB_CACHE   *cache,
+  const char  *fileName
+);
+
+int pubcache_get(
+  PUB_CACHE        *cache,
+  TSS_POOL         *tssPool,
+  TPMI_DH_OBJECT    handle,
+  EC_KEY          **ecKey
+);
+
+int pubcache_getPublicArea(
+  PUB_CACHE       *cache,
+  TPMI_DH_OBJECT   handle,
+  TPM2B_PUBLIC    *publicArea
+);
+
+TPMI_ALG_SIG_SCHEME pubcache_getScheme(
+  PUB_CACHE       *cache,
+  TPMI_DH_OBJECT   handle
+);
+
+void pubcache_invalidate(
+  PUB_CACHE       *cache,
+  TPMI_DH_OBJECT   handle
+);
+
+#endif
@@ -0,0 +1,606 @@
+#include <string.h>
+#include <time.h>
+
+#include <openssl/crypto.h>
+
+#include "randpool.h"
+#include "tpm20w.h"
+
+#define RANDPOOL_REFILL_CHUNK  (1024) /* Bytes fetched per connection checkout */
+#define RANDPOOL_RETRY_DELAY      (1) /* Seconds to wait after a failed refill */
+
+static void* randpool_refillThread(
+  void  *arg
+);
+
+static void* randpool_asyncRefillThread(
+  void  *arg
+);
+
+static void randpool_refillCompleted(
+  TSS_CONN  *conn,
+  TSS2_RC    rval,
+  void      *arg
+);
+
+static UINT16 randpool_queryMaxRequest(
+  TSS_CONN  *conn
+);
+
+
+
+void randpool_init(
+  RAND_POOL  *pool,
+  TSS_POOL   *tssPool)
+{
+  memset(pool, 0, sizeof(RAND_POOL));
+
+  pool->lowWatermark  = RANDPOOL_DEFAULT_LOW_WATERMARK;
+  pool->highWatermark = RANDPOOL_DEFAULT_HIGH_WATERMARK;
+  pool->maxRequest    = 0x20;
+  pool->tssPool       = tssPool;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->refill, NULL);
+}
+
+
+
+void randpool_destroy(
+  RAND_POOL  *pool)
+{
+  randpool_stop(pool);
+
+  pthread_cond_destroy(&pool->refill);
+  pthread_mutex_destroy(&pool->mutex);
+}
+
+
+
+/**********************************************************************
+ * Sets the watermarks; a negative value keeps the current setting.
+ * Shrinking the pool discards surplus bytes. Returns 0 on success.
+ **********************************************************************/
+int randpool_setWatermarks(
+  RAND_POOL  *pool,
+  long        lowWatermark,
+  long        highWatermark)
+{
+  unsigned char  *buffer;
+  int             status = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  if (lowWatermark < 0)
+  {
+    lowWatermark = pool->lowWatermark;
+  }
+  if (highWatermark < 0)
+  {
+    highWatermark = pool->highWatermark;
+  }
+
+  if (highWatermark < 1 ||
+      highWatermark > RANDPOOL_MAX_HIGH_WATERMARK ||
+      lowWatermark > highWatermark)
+  {
+    ERRFN("Invalid watermarks low=%ld high=%ld (max %d).",
+      lowWatermark, highWatermark, RANDPOOL_MAX_HIGH_WATERMARK);
+    status = -1;
+  }
+  else if (pool->buffer != NULL && (size_t) highWatermark != pool->highWatermark)
+  {
+    if ((buffer = OPENSSL_malloc(highWatermark)) == NULL)
+    {
+      ERRFN("Out of memory for entropy pool.");
+      status = -1;
+    }
+    else
+    {
+      if (pool->fill > (size_t) highWatermark)
+      {
+        OPENSSL_cleanse(pool->buffer + highWatermark, pool->fill - highWatermark);
+        pool->fill = highWatermark;
+      }
+      memcpy(buffer, pool->buffer, pool->fill);
+      OPENSSL_cleanse(pool->buffer, pool->highWatermark);
+      OPENSSL_free(pool->buffer);
+      pool->buffer = buffer;
+    }
+  }
+
+  if (status == 0)
+  {
+    pool->lowWatermark  = lowWatermark;
+    pool->highWatermark = highWatermark;
+    pthread_cond_signal(&pool->refill);
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Selects the TSS event loop for refills, or NULL. Only allowed while
+ * the pool is stopped. Returns 0 on success.
+ **********************************************************************/
+int randpool_setLoop(
+  RAND_POOL  *pool,
+  TSS_LOOP   *tssLoop)
+{
+  if (pool->running)
+  {
+    ERRFN("Entropy pool is running.");
+    return -1;
+  }
+
+  pool->tssLoop = tssLoop;
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Allocates the pool and starts the refill thread. Returns 0 on success.
+ **********************************************************************/
+int randpool_start(
+  RAND_POOL  *pool)
+{
+  TSS_CONN  *conn;
+
+  if (pool->running)
+  {
+    return 0;
+  }
+
+  if ((conn = tsspool_acquire(pool->tssPool, TSSPOOL_CLASS_BACKGROUND, NULL)) != NULL)
+  {
+    pool->maxRequest = randpool_queryMaxRequest(conn);
+    tsspool_release(pool->tssPool, conn);
+  }
+  DBGFN("Fetching up to %d random bytes per TPM command.", pool->maxRequest);
+
+  pthread_mutex_lock(&pool->mutex);
+  if ((pool->buffer = OPENSSL_malloc(pool->highWatermark)) == NULL)
+  {
+    pthread_mutex_unlock(&pool->mutex);
+    ERRFN("Out of memory for entropy pool.");
+    return -1;
+  }
+  pool->fill         = 0;
+  pool->refillFailed = 0;
+  pool->running      = 1;
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (pthread_create(&pool->thread, NULL,
+        pool->tssLoop != NULL ? randpool_asyncRefillThread : randpool_refillThread, pool) != 0)
+  {
+    ERRFN("Could not start entropy pool refill thread.");
+    // No thread to join, so not randpool_stop()
+    pthread_mutex_lock(&pool->mutex);
+    pool->running = 0;
+    OPENSSL_free(pool->buffer);
+    pool->buffer = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+void randpool_stop(
+  RAND_POOL  *pool)
+{
+  int wasRunning;
+
+  pthread_mutex_lock(&pool->mutex);
+  wasRunning    = pool->running;
+  pool->running = 0;
+  pthread_cond_signal(&pool->refill);
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (wasRunning)
+  {
+    pthread_join(pool->thread, NULL);
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->buffer != NULL)
+  {
+    OPENSSL_cleanse(pool->buffer, pool->highWatermark);
+    OPENSSL_free(pool->buffer);
+    pool->buffer = NULL;
+  }
+  pool->fill = 0;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+
+
+/**********************************************************************
+ * Serves nrBytes random bytes from the pool. If the pool holds less,
+ * the remainder is fetched from the TPM directly. Returns 1 on success,
+ * -1 on error.
+ **********************************************************************/
+int randpool_get(
+  RAND_POOL      *pool,
+  unsigned char  *buffer,
+  int             nrBytes)
+{
+  TSS_CONN  *conn;
+  size_t     served = 0;
+  int        status = 1;
+
+  if (nrBytes <= 0)
+  {
+    return 1;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->running)
+  {
+    served = (pool->fill < (size_t) nrBytes) ? pool->fill : (size_t) nrBytes;
+    pool->fill -= served;
+    memcpy(buffer, pool->buffer + pool->fill, served);
+    OPENSSL_cleanse(pool->buffer + pool->fill, served);
+
+    if (served < (size_t) nrBytes)
+    {
+      pool->dryCount++;
+    }
+    if (pool->fill < pool->lowWatermark)
+    {
+      pthread_cond_signal(&pool->refill);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (served < (size_t) nrBytes)
+  {
+    DBGFN("Entropy pool short by %d bytes, asking the TPM.", nrBytes - (int) served);
+    if ((conn = tsspool_acquire(pool->tssPool, TSSPOOL_CLASS_FOREGROUND, NULL)) == NULL)
+    {
+      return -1;
+    }
+    status = randpool_fetch(pool, conn, buffer + served, nrBytes - served);
+    tsspool_release(pool->tssPool, conn);
+  }
+
+  return status;
+}
+
+
+
+unsigned long randpool_getDryCount(
+  RAND_POOL  *pool)
+{
+  unsigned long dryCount;
+
+  pthread_mutex_lock(&pool->mutex);
+  dryCount = pool->dryCount;
+  pthread_mutex_unlock(&pool->mutex);
+
+  return dryCount;
+}
+
+
+
+/**********************************************************************
+ * Reads nrBytes from the TPM's RNG over the given connection, using the
+ * largest request size the TPM supports. Returns 1 on success, -1 on
+ * error.
+ **********************************************************************/
+int randpool_fetch(
+  RAND_POOL      *pool,
+  TSS_CONN       *conn,
+  unsigned char  *buffer,
+  size_t          nrBytes)
+{
+  TPM_RC        rval;
+  TPM2B_DIGEST  randomBytes = { { sizeof(TPM2B_DIGEST), } };
+  UINT16        nrBytesNextReq;
+  int           retried = 0;
+
+  while (nrBytes > 0)
+  {
+    nrBytesNextReq = (nrBytes > pool->maxRequest) ? pool->maxRequest : nrBytes;
+
+    DBGFN("Tss2_Sys_GetRandom with %d Bytes.", nrBytesNextReq);
+    rval = Tss2_Sys_GetRandom(
+      conn->sysContext,
+      NULL,
+      nrBytesNextReq,
+      &randomBytes,
+      NULL);
+
+    if (rval != TSS2_RC_SUCCESS)
+    {
+      if (!retried && tssconn_isTctiError(rval) && tssconn_recover(conn))
+      {
+        retried = 1;
+        continue;
+      }
+      ERRFN("TPM error 0x%x.", rval);
+      return -1;
+    }
+
+    if (randomBytes.t.size > nrBytesNextReq)
+    {
+      randomBytes.t.size = nrBytesNextReq;
+    }
+    memcpy(buffer, randomBytes.t.buffer, randomBytes.t.size);
+    buffer  += randomBytes.t.size;
+    nrBytes -= randomBytes.t.size;
+  }
+
+  OPENSSL_cleanse(&randomBytes, sizeof(randomBytes));
+  return 1;
+}
+
+
+
+/**********************************************************************
+ * TPM2_GetRandom returns at most as many bytes as the largest digest
+ * the TPM supports (TPM_PT_MAX_DIGEST).
+ **********************************************************************/
+static UINT16 randpool_queryMaxRequest(
+  TSS_CONN  *conn)
+{
+  TPMI_YES_NO           moreData;
+  TPMS_CAPABILITY_DATA  capabilityData;
+  TPM2B_DIGEST          randomBytes;
+  UINT32                maxDigest = 0x20;
+  TPM_RC                rval;
+
+  rval = Tss2_Sys_GetCapability(
+    conn->sysContext,
+    0,
+    TPM_CAP_TPM_PROPERTIES,
+    TPM_PT_MAX_DIGEST,
+    1,
+    &moreData,
+    &capabilityData,
+    0);
+
+  if (rval == TSS2_RC_SUCCESS &&
+      capabilityData.data.tpmProperties.count > 0 &&
+      capabilityData.data.tpmProperties.tpmProperty[0].property == TPM_PT_MAX_DIGEST)
+  {
+    maxDigest = capabilityData.data.tpmProperties.tpmProperty[0].value;
+  }
+  else
+  {
+    ERRFN("Could not read TPM_PT_MAX_DIGEST (0x%x), using %d bytes.", rval, maxDigest);
+  }
+
+  if (maxDigest > sizeof(randomBytes.t.buffer))
+  {
+    maxDigest = sizeof(randomBytes.t.buffer);
+  }
+  return (UINT16) maxDigest;
+}
+
+
+
+static void* randpool_refillThread(
+  void  *arg)
+{
+  RAND_POOL       *pool = (RAND_POOL*) arg;
+  TSS_CONN        *conn;
+  unsigned char    chunk[RANDPOOL_REFILL_CHUNK];
+  size_t           nrBytes;
+  int              status;
+  struct timespec  retryAt;
+
+  DBGFN("Entropy pool refill thread started.");
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->running)
+  {
+    if (pool->fill >= pool->lowWatermark && pool->fill > 0)
+    {
+      pthread_cond_wait(&pool->refill, &pool->mutex);
+      continue;
+    }
+
+    // Top up to the high watermark, one chunk per connection checkout
+    // so that signing requests are not starved of connections
+    status = 1;
+    while (pool->running && pool->fill < pool->highWatermark)
+    {
+      nrBytes = pool->highWatermark - pool->fill;
+      if (nrBytes > sizeof(chunk))
+      {
+        nrBytes = sizeof(chunk);
+      }
+      pthread_mutex_unlock(&pool->mutex);
+
+      status = -1;
+      if ((conn = tsspool_acquire(pool->tssPool, TSSPOOL_CLASS_BACKGROUND, NULL)) != NULL)
+      {
+        status = randpool_fetch(pool, conn, chunk, nrBytes);
+        tsspool_release(pool->tssPool, conn);
+      }
+
+      pthread_mutex_lock(&pool->mutex);
+      if (status != 1)
+      {
+        break;
+      }
+
+      // Watermarks may have changed meanwhile
+      if (nrBytes > pool->highWatermark - pool->fill)
+      {
+        nrBytes = pool->highWatermark - pool->fill;
+      }
+      memcpy(pool->buffer + pool->fill, chunk, nrBytes);
+      pool->fill += nrBytes;
+    }
+    OPENSSL_cleanse(chunk, sizeof(chunk));
+
+    if (status != 1 && pool->running)
+    {
+      ERRFN("Entropy pool refill failed, retrying in %d s.", RANDPOOL_RETRY_DELAY);
+      clock_gettime(CLOCK_REALTIME, &retryAt);
+      retryAt.tv_sec += RANDPOOL_RETRY_DELAY;
+      pthread_cond_timedwait(&pool->refill, &pool->mutex, &retryAt);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  DBGFN("Entropy pool refill thread stopped.");
+  return NULL;
+}
+
+
+
+/**********************************************************************
+ * Event loop callback of a refill TPM2_GetRandom. A broken connection
+ * is closed; it is reopened on its next checkout.
+ **********************************************************************/
+static void randpool_refillCompleted(
+  TSS_CONN  *conn,
+  TSS2_RC    rval,
+  void      *arg)
+{
+  RAND_POOL     *pool = (RAND_POOL*) arg;
+  TPM2B_DIGEST   randomBytes = { { sizeof(TPM2B_DIGEST), } };
+  size_t         nrBytes;
+
+  if (rval == TSS2_RC_SUCCESS)
+  {
+    rval = Tss2_Sys_GetRandom_Complete(conn->sysContext, &randomBytes);
+  }
+  if (tssconn_isTctiError(rval))
+  {
+    tssconn_close(conn);
+  }
+  tsspool_release(pool->tssPool, conn);
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->pendingOps--;
+  if (rval != TSS2_RC_SUCCESS)
+  {
+    ERRFN("TPM error 0x%x.", rval);
+    pool->refillFailed = 1;
+  }
+  else if (pool->buffer != NULL)
+  {
+    // Watermarks may have changed meanwhile
+    nrBytes = pool->highWatermark - pool->fill;
+    if (nrBytes > randomBytes.t.size)
+    {
+      nrBytes = randomBytes.t.size;
+    }
+    memcpy(pool->buffer + pool->fill, randomBytes.t.buffer, nrBytes);
+    pool->fill += nrBytes;
+  }
+  pthread_cond_signal(&pool->refill);
+  pthread_mutex_unlock(&pool->mutex);
+
+  OPENSSL_cleanse(&randomBytes, sizeof(randomBytes));
+}
+
+
+
+/**********************************************************************
+ * Sends refill commands until the pool will be full when they complete
+ * or RANDPOOL_MAX_PENDING are in flight. Called with the mutex held.
+ * Returns 1 on success, -1 on error.
+ **********************************************************************/
+static int randpool_submitRefill(
+  RAND_POOL  *pool)
+{
+  TSS_CONN  *conn;
+  TSS2_RC    rval;
+
+  while (pool->running &&
+         pool->pendingOps < RANDPOOL_MAX_PENDING &&
+         pool->fill + (size_t) pool->pendingOps * pool->maxRequest < pool->highWatermark)
+  {
+    pool->pendingOps++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    rval = TSS2_TCTI_RC_NO_CONNECTION;
+    if ((conn = tsspool_acquire(pool->tssPool, TSSPOOL_CLASS_BACKGROUND, NULL)) != NULL)
+    {
+      if ((rval = Tss2_Sys_GetRandom_Prepare(conn->sysContext, pool->maxRequest)) == TSS2_RC_SUCCESS &&
+          (rval = tssloop_submit(pool->tssLoop, conn, randpool_refillCompleted, pool)) == TSS2_RC_SUCCESS)
+      {
+        pthread_mutex_lock(&pool->mutex);
+        continue;
+      }
+      if (tssconn_isTctiError(rval))
+      {
+        tssconn_close(conn);
+      }
+      tsspool_release(pool->tssPool, conn);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->pendingOps--;
+    ERRFN("Sending TPM2_GetRandom failed with 0x%x.", rval);
+    return -1;
+  }
+
+  return 1;
+}
+
+
+
+static void* randpool_asyncRefillThread(
+  void  *arg)
+{
+  RAND_POOL       *pool = (RAND_POOL*) arg;
+  int              refilling = 0;
+  struct timespec  retryAt;
+
+  DBGFN("Entropy pool refill thread started (event loop).");
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->running)
+  {
+    if (pool->refillFailed)
+    {
+      pool->refillFailed = 0;
+      ERRFN("Entropy pool refill failed, retrying in %d s.", RANDPOOL_RETRY_DELAY);
+      clock_gettime(CLOCK_REALTIME, &retryAt);
+      retryAt.tv_sec += RANDPOOL_RETRY_DELAY;
+      pthread_cond_timedwait(&pool->refill, &pool->mutex, &retryAt);
+      continue;
+    }
+
+    // Same hysteresis as the synchronous refill
+    if (pool->fill < pool->lowWatermark || pool->fill == 0)
+    {
+      refilling = 1;
+    }
+    else if (pool->fill >= pool->highWatermark)
+    {
+      refilling = 0;
+    }
+
+    if (refilling && randpool_submitRefill(pool) != 1)
+    {
+      pool->refillFailed = 1;
+      continue;
+    }
+
+    // Woken up by completions and by randpool_get()
+    pthread_cond_wait(&pool->refill, &pool->mutex);
+  }
+
+  // The buffer must outlive the commands in flight
+  while (pool->pendingOps > 0)
+  {
+    pthread_cond_wait(&pool->refill, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  DBGFN("Entropy pool refill thread stopped.");
+  return NULL;
+}
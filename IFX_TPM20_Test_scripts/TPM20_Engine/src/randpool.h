@@ -0,0 +1,84 @@
+#ifndef _RANDPOOL_H_
+#define _RANDPOOL_H_
+
+#include <pthread.h>
+
+#include "tsspool.h"
+#include "tssloop.h"
+
+#define RANDPOOL_DEFAULT_LOW_WATERMARK   (256)
+#define RANDPOOL_DEFAULT_HIGH_WATERMARK (4096)
+#define RANDPOOL_MAX_HIGH_WATERMARK    (65536)
+#define RANDPOOL_MAX_PENDING               (2) /* GetRandoms in flight (event loop) */
+
+/*
+ * Buffered TPM entropy. A background thread tops the pool up to the high
+ * watermark as soon as it drops below the low watermark, so that RAND
+ * requests are served from memory. Requests the pool cannot serve
+ * completely fall back to the TPM directly and are counted in dryCount.
+ * With a TSS event loop, the refill thread only sends TPM2_GetRandom
+ * commands and the loop thread stores the responses.
+ */
+typedef struct {
+  unsigned char    *buffer;
+  size_t            fill;           /* Valid bytes at the start of buffer   */
+  size_t            lowWatermark;
+  size_t            highWatermark;
+  unsigned long     dryCount;
+  UINT16            maxRequest;     /* Largest TPM2_GetRandom the TPM allows */
+  int               running;
+  int               pendingOps;     /* Refill commands in flight           */
+  int               refillFailed;
+  TSS_LOOP         *tssLoop;        /* NULL: synchronous refill            */
+  pthread_t         thread;
+  pthread_mutex_t   mutex;
+  pthread_cond_t    refill;
+  TSS_POOL         *tssPool;
+} RAND_POOL;
+
+void randpool_init(
+  RAND_POOL  *pool,
+  TSS_POOL   *tssPool
+);
+
+void randpool_destroy(
+  RAND_POOL  *pool
+);
+
+int randpool_setWatermarks(
+  RAND_POOL  *pool,
+  long        lowWatermark,
+  long        highWatermark
+);
+
+int randpool_setLoop(
+  RAND_POOL  *pool,
+  TSS_LOOP   *tssLoop
+);
+
+int randpool_start(
+  RAND_POOL  *pool
+);
+
+void randpool_stop(
+  RAND_POOL  *pool
+);
+
+int randpool_get(
+  RAND_POOL      *pool,
+  unsigned char  *buffer,
+  int             nrBytes
+);
+
+unsigned long randpool_getDryCount(
+  RAND_POOL  *pool
+);
+
+int randpool_fetch(
+  RAND_POOL      *pool,
+  TSS_CONN       *conn,
+  unsigned char  *buffer,
+  size_t          nrBytes
+);
+
+#endif
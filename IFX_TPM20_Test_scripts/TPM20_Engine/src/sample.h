@@ -36,6 +36,7 @@ extern "C" {
 #include <sapi/tss2_tpm2_types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <openssl/evp.h>
 #include "syscontext.h"
 
 extern FILE *outFp;
@@ -84,7 +85,6 @@ enum TSS2_APP_RC_CODE
 #define TPM_RC_NO_RESPONSE 0xffffffff
 
 #define MAX_NUM_SESSIONS MAX_ACTIVE_SESSIONS
-#define MAX_NUM_ENTITIES 100
 
 #define APPLICATION_ERROR( errCode ) \
     ( TSS2_APP_ERROR_LEVEL + errCode )
@@ -158,6 +158,7 @@ TPM_RC ComputeCommandHmacs( TSS2_SYS_CONTEXT *sysContext, TPM_HANDLE handle1,
 extern INT16 sessionEntriesUsed;
 
 extern void InitSessionsTable();
+void DeleteSession( SESSION *session );
 
 extern UINT32 ( *ComputeSessionHmacPtr )(
     TSS2_SYS_CONTEXT *sysContext,
@@ -184,16 +185,6 @@ TPM_RC StartAuthSessionWithParams( SESSION **session, TPMI_DH_OBJECT tpmKey, TPM
     TPMI_DH_ENTITY bind, TPM2B_AUTH *bindAuth, TPM2B_NONCE *nonceCaller, TPM2B_ENCRYPTED_SECRET *encryptedSalt,
     TPM_SE sessionType, TPMT_SYM_DEF *symmetric, TPMI_ALG_HASH algId );
 
-//
-// Used by upper layer code to save and update entity data
-// (authValue, specifically) at creation and use time.
-//
-// NOTE: this really needs to be turned into a linked list
-// with add, find, and remove entries, instead of a fixed
-// length array.
-//
-ENTITY entities[MAX_NUM_ENTITIES+1];
-
 //
 // This function calculates the session HMAC
 //
@@ -293,15 +284,34 @@ void InitNullSession( TPMS_AUTH_COMMAND *nullSessionData );
 
 TPM_RC LoadExternalHMACKey( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM_HANDLE *keyHandle, TPM2B_NAME *keyName );
 
+UINT32 LoadExternalHMACKeyOnSysContext( TSS2_SYS_CONTEXT *sysContext, TPMI_ALG_HASH hashAlg, TPM2B *key,
+    TPM_HANDLE *keyHandle, TPM2B_NAME *keyName );
+
 UINT16 CopySizedByteBuffer( TPM2B *dest, TPM2B *src );
 
 TSS2_RC EncryptCommandParam( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX_BUFFER *clearData, TPM2B_AUTH *authValue );
 
 TSS2_RC DecryptResponseParam( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUFFER *encryptedData, TPM2B_AUTH *authValue );
 
+TSS2_RC TpmEncryptCFB( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX_BUFFER *clearData, TPM2B_AUTH *authValue );
+
+TSS2_RC TpmDecryptCFB( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUFFER *encryptedData, TPM2B_AUTH *authValue );
+
+TSS2_RC SwEncryptCFB( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX_BUFFER *clearData, TPM2B_AUTH *authValue );
+
+TSS2_RC SwDecryptCFB( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUFFER *encryptedData, TPM2B_AUTH *authValue );
+
+extern TSS2_RC (*EncryptCFBFunctionPtr)( SESSION *session, TPM2B_MAX_BUFFER *encryptedData, TPM2B_MAX_BUFFER *clearData,
+        TPM2B_AUTH *authValue );
+
+extern TSS2_RC (*DecryptCFBFunctionPtr)( SESSION *session, TPM2B_MAX_BUFFER *clearData, TPM2B_MAX_BUFFER *encryptedData,
+        TPM2B_AUTH *authValue );
+
 TPM_RC KDFa( TPMI_ALG_HASH hashAlg, TPM2B *key, char *label, TPM2B *contextU, TPM2B *contextV,
     UINT16 bits, TPM2B_MAX_BUFFER *resultKey );
 
+TPM_RC KDFaSelfCheck( TSS2_SYS_CONTEXT *sysContext );
+
 UINT32 TpmHashSequence( TPMI_ALG_HASH hashAlg, UINT8 numBuffers, TPM2B_DIGEST *bufferList, TPM2B_DIGEST *result );
 
 void CatSizedByteBuffer( TPM2B *dest, TPM2B *src );
@@ -312,6 +322,16 @@ TSS2_RC SetLocality( TSS2_SYS_CONTEXT *sysContext, UINT8 locality );
 
 TPM_RC TpmHmac( TPMI_ALG_HASH hashAlg, TPM2B *key,TPM2B **bufferList, TPM2B_DIGEST *result );
 
+UINT32 TpmHmacOnSysContext( TSS2_SYS_CONTEXT *sysContext, TPMI_ALG_HASH hashAlg, TPM2B *key,
+    TPM2B **bufferList, TPM2B_DIGEST *result );
+
+UINT32 SwHmac( TPMI_ALG_HASH hashAlg, TPM2B *key, TPM2B **bufferList, TPM2B_DIGEST *result );
+
+const EVP_MD *SwHashAlgToMd( TPMI_ALG_HASH hashAlg );
+
+TPM_RC SwCalcPHash( TSS2_SYS_CONTEXT *sysContext, TPM_HANDLE handle1, TPM_HANDLE handle2,
+    TPMI_ALG_HASH authHash, TPM_RC responseCode, TPM2B_DIGEST *pHash );
+
 UINT32 TpmHash( TPMI_ALG_HASH hashAlg, UINT16 size, BYTE *data, TPM2B_DIGEST *result );
 
 UINT32 TpmHandleToName( TPM_HANDLE handle, TPM2B_NAME *name );
@@ -0,0 +1,705 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "signq.h"
+#include "tpm20w.h"
+
+static void* signq_worker(
+  void  *arg
+);
+
+static void* signq_dispatcher(
+  void  *arg
+);
+
+static void signq_completed(
+  TSS_CONN  *conn,
+  TSS2_RC    rval,
+  void      *arg
+);
+
+static void signq_notify(
+  int  fd
+);
+
+static void signq_finish(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job,
+  int          status
+);
+
+
+
+/**********************************************************************
+ * Returns 0 on success.
+ **********************************************************************/
+int signq_init(
+  SIGN_QUEUE  *queue,
+  TSS_POOL    *tssPool)
+{
+  memset(queue, 0, sizeof(SIGN_QUEUE));
+  queue->tssPool = tssPool;
+
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->submitted, NULL);
+  pthread_cond_init(&queue->completed, NULL);
+  return 0;
+}
+
+
+
+void signq_destroy(
+  SIGN_QUEUE  *queue)
+{
+  signq_stop(queue);
+
+  pthread_cond_destroy(&queue->completed);
+  pthread_cond_destroy(&queue->submitted);
+  pthread_mutex_destroy(&queue->mutex);
+}
+
+
+
+/**********************************************************************
+ * Selects the TSS event loop for the queue, or NULL for worker threads.
+ * Only allowed while the queue is stopped. Returns 0 on success.
+ **********************************************************************/
+int signq_setLoop(
+  SIGN_QUEUE  *queue,
+  TSS_LOOP    *tssLoop)
+{
+  if (queue->running)
+  {
+    ERRFN("Sign queue is running.");
+    return -1;
+  }
+
+  queue->tssLoop = tssLoop;
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Spreads the signatures over the TPMs of tssShards, or NULL for the
+ * pool only. Only allowed while the queue is stopped. Returns 0 on
+ * success.
+ **********************************************************************/
+int signq_setShards(
+  SIGN_QUEUE  *queue,
+  TSS_SHARDS  *tssShards)
+{
+  if (queue->running)
+  {
+    ERRFN("Sign queue is running.");
+    return -1;
+  }
+
+  queue->tssShards = tssShards;
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Starts nrThreads workers, or the dispatcher if an event loop is set.
+ **********************************************************************/
+int signq_start(
+  SIGN_QUEUE  *queue,
+  int          nrThreads)
+{
+  if (queue->running)
+  {
+    return 0;
+  }
+
+  if (nrThreads < 1 || nrThreads > SIGNQ_MAX_THREADS)
+  {
+    nrThreads = TSSPOOL_DEFAULT_SIZE;
+  }
+  if (queue->tssLoop != NULL)
+  {
+    nrThreads = 1;
+  }
+
+  queue->running = 1;
+  for (queue->nrThreads = 0; queue->nrThreads < nrThreads; queue->nrThreads++)
+  {
+    if (pthread_create(&queue->threads[queue->nrThreads], NULL,
+          queue->tssLoop != NULL ? signq_dispatcher : signq_worker, queue) != 0)
+    {
+      ERRFN("Could not start sign worker %d.", queue->nrThreads);
+      break;
+    }
+  }
+
+  if (queue->nrThreads == 0)
+  {
+    queue->running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Lets the workers finish the queued jobs, then joins them.
+ **********************************************************************/
+void signq_stop(
+  SIGN_QUEUE  *queue)
+{
+  int i;
+
+  pthread_mutex_lock(&queue->mutex);
+  queue->running = 0;
+  pthread_cond_broadcast(&queue->submitted);
+  pthread_mutex_unlock(&queue->mutex);
+
+  for (i = 0; i < queue->nrThreads; i++)
+  {
+    pthread_join(queue->threads[i], NULL);
+  }
+  queue->nrThreads = 0;
+}
+
+
+
+/**********************************************************************
+ * Queues a job. Returns 0 on success, -1 if the queue is not running.
+ **********************************************************************/
+int signq_submit(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job)
+{
+  job->done    = 0;
+  job->status  = -1;
+  job->retried = 0;
+  job->conn     = NULL;
+  job->pool     = NULL;
+  job->endpoint = -1;
+  job->queue    = queue;
+  job->next    = NULL;
+
+  pthread_mutex_lock(&queue->mutex);
+  if (!queue->running)
+  {
+    pthread_mutex_unlock(&queue->mutex);
+    return -1;
+  }
+
+  if (queue->tail != NULL)
+  {
+    queue->tail->next = job;
+  }
+  else
+  {
+    queue->head = job;
+  }
+  queue->tail = job;
+  queue->depth++;
+
+  pthread_cond_signal(&queue->submitted);
+  pthread_mutex_unlock(&queue->mutex);
+  return 0;
+}
+
+
+
+int signq_isDone(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job)
+{
+  int done;
+
+  pthread_mutex_lock(&queue->mutex);
+  done = job->done;
+  pthread_mutex_unlock(&queue->mutex);
+
+  return done;
+}
+
+
+
+void signq_wait(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job)
+{
+  pthread_mutex_lock(&queue->mutex);
+  while (!job->done)
+  {
+    pthread_cond_wait(&queue->completed, &queue->mutex);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+
+
+int signq_getDepth(
+  SIGN_QUEUE  *queue)
+{
+  int depth;
+
+  pthread_mutex_lock(&queue->mutex);
+  depth = queue->depth;
+  pthread_mutex_unlock(&queue->mutex);
+
+  return depth;
+}
+
+
+
+/**********************************************************************
+ * Deadline of the pool checkout for job, NULL if it has none.
+ **********************************************************************/
+static const struct timespec* signq_deadline(
+  SIGNQ_JOB  *job)
+{
+  return job->deadline.tv_sec != 0 ? &job->deadline : NULL;
+}
+
+
+
+static void signq_notify(
+  int  fd)
+{
+  const char  event = 1;
+
+  // A full pipe already wakes up the reader, so EAGAIN is fine
+  if (fd >= 0 && write(fd, &event, 1) < 0 && errno != EAGAIN)
+  {
+    ERRFN("Could not signal sign completion (errno %d).", errno);
+  }
+}
+
+
+
+/**********************************************************************
+ * Completes a job and wakes up its waiters.
+ **********************************************************************/
+static void signq_finish(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job,
+  int          status)
+{
+  pthread_mutex_lock(&queue->mutex);
+  job->status = status;
+  job->done   = 1;
+  queue->depth--;
+  signq_notify(job->notifyFd);
+  pthread_cond_broadcast(&queue->completed);
+  if (!queue->running)
+  {
+    // A stopping dispatcher waits for the jobs in flight
+    pthread_cond_broadcast(&queue->submitted);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+
+
+/**********************************************************************
+ * Whether the deadline of job has passed.
+ **********************************************************************/
+static int signq_isLate(
+  SIGNQ_JOB  *job)
+{
+  struct timespec now;
+
+  if (job->deadline.tv_sec == 0)
+  {
+    return 0;
+  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec > job->deadline.tv_sec ||
+    (now.tv_sec == job->deadline.tv_sec && now.tv_nsec >= job->deadline.tv_nsec);
+}
+
+
+
+/**********************************************************************
+ * Selects the TPM for job: sets the pool to check out from and the
+ * handle of the key on that TPM.
+ **********************************************************************/
+static void signq_route(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job)
+{
+  job->endpoint    = -1;
+  job->pool        = queue->tssPool;
+  job->localHandle = job->keyHandle;
+
+  // A commit counter is only known to the TPM that issued it
+  if (queue->tssShards != NULL && job->scheme != TPM_ALG_ECDAA)
+  {
+    job->endpoint = tssshard_pick(queue->tssShards, job->keyHandle, &job->localHandle);
+    job->pool     = tssshard_getPool(queue->tssShards, job->endpoint);
+  }
+}
+
+
+
+static void signq_unroute(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job,
+  int          healthy)
+{
+  if (job->endpoint >= 0)
+  {
+    tssshard_done(queue->tssShards, job->endpoint, healthy);
+  }
+  job->endpoint = -1;
+}
+
+
+
+/**********************************************************************
+ * Returns 1 if the key of job may be used on conn (see
+ * tssshard_checkKey()), 0 if not and -1 if that is unknown.
+ **********************************************************************/
+static int signq_checkKey(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job,
+  TSS_CONN    *conn)
+{
+  if (job->endpoint < 0)
+  {
+    return 1;
+  }
+  return tssshard_checkKey(queue->tssShards, job->endpoint, conn, job->keyHandle, job->localHandle);
+}
+
+
+
+/**********************************************************************
+ * Runs TPM2_Sign for job on conn, for ECDAA with the precomputed commit
+ * or a TPM2_Commit right before. Returns 1 on success, -1 on error.
+ **********************************************************************/
+static int signq_tpmSign(
+  SIGNQ_JOB  *job,
+  TSS_CONN   *conn)
+{
+  UINT16  counter = (UINT16) job->commitCounter;
+
+  if (job->scheme != TPM_ALG_ECDAA)
+  {
+    return tpm20w_signEcdsaWithSha256(
+       conn->sysContext,
+       job->digest,
+       job->digestLen,
+       job->localHandle,
+       job->keyPassword,
+      &job->signature);
+  }
+
+  if (job->commitCounter < 0 &&
+      tpm20w_commit(conn->sysContext, job->localHandle, job->keyPassword, &counter) != 1)
+  {
+    return -1;
+  }
+  return tpm20w_signEcdaaWithSha256(
+     conn->sysContext,
+     job->digest,
+     job->digestLen,
+     job->localHandle,
+     job->keyPassword,
+     counter,
+    &job->signature);
+}
+
+
+
+/**********************************************************************
+ * Signs job on a blocking connection. Returns the job status.
+ **********************************************************************/
+static int signq_sign(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job)
+{
+  TSS_CONN  *conn;
+  int        attempts;
+  int        retried;
+  int        broken;
+  int        keyOk;
+  int        status = -1;
+
+  // With several TPMs, a job whose TPM is unreachable moves on once
+  for (attempts = (queue->tssShards != NULL) ? 2 : 1; attempts > 0; attempts--)
+  {
+    signq_route(queue, job);
+
+    if ((conn = tsspool_acquire(job->pool, TSSPOOL_CLASS_SIGN, signq_deadline(job))) == NULL)
+    {
+      if (signq_isLate(job))
+      {
+        signq_unroute(queue, job, 1);
+        return 0;
+      }
+      signq_unroute(queue, job, 0);
+      continue;
+    }
+
+    if ((keyOk = signq_checkKey(queue, job, conn)) != 1)
+    {
+      tsspool_release(job->pool, conn);
+      signq_unroute(queue, job, keyOk == 0);
+      continue;
+    }
+
+    retried = 0;
+    while ((status = signq_tpmSign(job, conn)) != 1)
+    {
+      if (retried || !tssconn_recover(conn))
+      {
+        break;
+      }
+      retried = 1;
+    }
+
+    // tssconn_recover() leaves the connection closed if the TPM is gone
+    broken = (status != 1 && !conn->connected);
+    tsspool_release(job->pool, conn);
+    signq_unroute(queue, job, !broken);
+    if (!broken)
+    {
+      break;
+    }
+  }
+
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Puts job back at the head of the queue for one more try.
+ **********************************************************************/
+static void signq_requeue(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job)
+{
+  job->retried = 1;
+
+  pthread_mutex_lock(&queue->mutex);
+  if ((job->next = queue->head) == NULL)
+  {
+    queue->tail = job;
+  }
+  queue->head = job;
+  pthread_cond_signal(&queue->submitted);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+
+
+static void* signq_worker(
+  void  *arg)
+{
+  SIGN_QUEUE  *queue = (SIGN_QUEUE*) arg;
+  SIGNQ_JOB   *job;
+  int          status;
+
+  pthread_mutex_lock(&queue->mutex);
+  while (1)
+  {
+    if ((job = queue->head) == NULL)
+    {
+      if (!queue->running)
+      {
+        break;
+      }
+      pthread_cond_wait(&queue->submitted, &queue->mutex);
+      continue;
+    }
+
+    if ((queue->head = job->next) == NULL)
+    {
+      queue->tail = NULL;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    status = signq_sign(queue, job);
+
+    signq_finish(queue, job, status);
+    pthread_mutex_lock(&queue->mutex);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+
+  return NULL;
+}
+
+
+
+/**********************************************************************
+ * Event loop callback of a TPM2_Sign sent by the dispatcher. On a broken
+ * connection, the connection is closed (it is reopened on its next
+ * checkout) and the job goes back to the head of the queue once, to be
+ * routed to another TPM if there are several.
+ **********************************************************************/
+static void signq_completed(
+  TSS_CONN  *conn,
+  TSS2_RC    rval,
+  void      *arg)
+{
+  SIGNQ_JOB   *job = (SIGNQ_JOB*) arg;
+  SIGN_QUEUE  *queue = job->queue;
+  int          status = -1;
+
+  if (rval == TSS2_RC_SUCCESS &&
+      (rval = Tss2_Sys_Sign_Complete(conn->sysContext, &job->signature)) == TSS2_RC_SUCCESS)
+  {
+    status = 1;
+  }
+  else if (tssconn_isTctiError(rval))
+  {
+    tssconn_close(conn);
+  }
+  job->conn = NULL;
+  tsspool_release(job->pool, conn);
+  signq_unroute(queue, job, !tssconn_isTctiError(rval));
+
+  if (status != 1 && tssconn_isTctiError(rval) && !job->retried)
+  {
+    DBGFN("TPM2_Sign failed on TCTI level (0x%x), retrying.", rval);
+    signq_requeue(queue, job);
+    return;
+  }
+
+  if (status != 1)
+  {
+    ERRFN("Tss2_Sys_Sign failed with error code 0x%x.", rval);
+  }
+  signq_finish(queue, job, status);
+}
+
+
+
+/**********************************************************************
+ * Puts the TPM2_Sign for job into the system context of conn. A missing
+ * ECDAA commit is made right before, as a blocking command. Returns 1
+ * on success, -1 on error.
+ **********************************************************************/
+static int signq_tpmSignPrepare(
+  SIGNQ_JOB  *job,
+  TSS_CONN   *conn)
+{
+  UINT16  counter = (UINT16) job->commitCounter;
+
+  if (job->scheme != TPM_ALG_ECDAA)
+  {
+    return tpm20w_signEcdsaWithSha256Prepare(
+      conn->sysContext,
+      job->digest,
+      job->digestLen,
+      job->localHandle,
+      job->keyPassword);
+  }
+
+  if (job->commitCounter < 0 &&
+      tpm20w_commit(conn->sysContext, job->localHandle, job->keyPassword, &counter) != 1)
+  {
+    return -1;
+  }
+  return tpm20w_signEcdaaWithSha256Prepare(
+    conn->sysContext,
+    job->digest,
+    job->digestLen,
+    job->localHandle,
+    job->keyPassword,
+    counter);
+}
+
+
+
+/**********************************************************************
+ * Sends the next queued job on a free pool connection. Blocking in
+ * tsspool_acquire() limits the commands in flight to the pool size.
+ **********************************************************************/
+static void signq_dispatch(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job)
+{
+  TSS_CONN  *conn;
+  TSS2_RC    rval;
+  int        keyOk;
+
+  signq_route(queue, job);
+
+  if ((conn = tsspool_acquire(job->pool, TSSPOOL_CLASS_SIGN, signq_deadline(job))) == NULL)
+  {
+    signq_unroute(queue, job, signq_isLate(job));
+    if (!signq_isLate(job) && queue->tssShards != NULL && !job->retried)
+    {
+      signq_requeue(queue, job);
+      return;
+    }
+    signq_finish(queue, job, signq_isLate(job) ? 0 : -1);
+    return;
+  }
+
+  // The key check is a blocking command, once per key and TPM
+  if ((keyOk = signq_checkKey(queue, job, conn)) != 1)
+  {
+    tsspool_release(job->pool, conn);
+    signq_unroute(queue, job, keyOk == 0);
+    if (!job->retried)
+    {
+      signq_requeue(queue, job);
+      return;
+    }
+    signq_finish(queue, job, -1);
+    return;
+  }
+
+  if (signq_tpmSignPrepare(job, conn) != 1)
+  {
+    tsspool_release(job->pool, conn);
+    signq_unroute(queue, job, 1);
+    signq_finish(queue, job, -1);
+    return;
+  }
+
+  job->conn = conn;
+  if ((rval = tssloop_submit(queue->tssLoop, conn, signq_completed, job)) != TSS2_RC_SUCCESS)
+  {
+    signq_completed(conn, rval, job);
+  }
+}
+
+
+
+static void* signq_dispatcher(
+  void  *arg)
+{
+  SIGN_QUEUE  *queue = (SIGN_QUEUE*) arg;
+  SIGNQ_JOB   *job;
+
+  pthread_mutex_lock(&queue->mutex);
+  while (1)
+  {
+    if ((job = queue->head) == NULL)
+    {
+      // Jobs in flight may still come back for a retry
+      if (!queue->running && queue->depth == 0)
+      {
+        break;
+      }
+      pthread_cond_wait(&queue->submitted, &queue->mutex);
+      continue;
+    }
+
+    if ((queue->head = job->next) == NULL)
+    {
+      queue->tail = NULL;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    signq_dispatch(queue, job);
+
+    pthread_mutex_lock(&queue->mutex);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+
+  return NULL;
+}
@@ -0,0 +1,113 @@
+#ifndef _SIGNQ_H_
+#define _SIGNQ_H_
+
+#include <pthread.h>
+
+#include <sapi/tpm20.h>
+
+#include "tsspool.h"
+#include "tssloop.h"
+#include "tssshard.h"
+
+#define SIGNQ_MAX_THREADS (TSSPOOL_MAX_SIZE * TSSSHARD_MAX_ENDPOINTS)
+
+struct SIGN_QUEUE;
+
+/*
+ * One signature request. The submitter owns the job and must keep it
+ * alive until signq_isDone() reports completion.
+ */
+typedef struct SIGNQ_JOB {
+  const unsigned char  *digest;
+  int                   digestLen;
+  TPMI_DH_OBJECT        keyHandle;
+  const char           *keyPassword;
+  TPMI_ALG_SIG_SCHEME   scheme;     /* TPM_ALG_ECDSA or TPM_ALG_ECDAA  */
+  int                   commitCounter; /* ECDAA: -1 to commit first    */
+  int                   notifyFd;   /* Written to on completion, or -1 */
+  struct timespec       deadline;   /* Drop after, tv_sec 0: never     */
+  TPMT_SIGNATURE        signature;
+  int                   status;     /* 1 on success, 0 if dropped      */
+  int                   done;
+  int                   retried;    /* Internal from here on           */
+  TSS_CONN             *conn;
+  TSS_POOL             *pool;
+  int                   endpoint;   /* Of tssShards, or -1             */
+  TPMI_DH_OBJECT        localHandle;
+  struct SIGN_QUEUE    *queue;
+  struct SIGNQ_JOB     *next;
+} SIGNQ_JOB;
+
+/*
+ * Worker threads that run TPM2_Sign on pool connections, so that the
+ * caller can wait for the result without blocking in the TSS. A job's
+ * completion is also announced on its notifyFd, if it has one. With a TSS event loop (signq_setLoop()), a single
+ * dispatcher thread sends the commands and the loop completes them, so
+ * one TPM2_Sign per pool connection is in flight without a thread each.
+ * With several TPMs (signq_setShards()), every job is routed to one of
+ * them and moves on to another if its TPM turns out to be unreachable.
+ * ECDAA jobs always go to the primary TPM, which holds their commits.
+ */
+typedef struct SIGN_QUEUE {
+  SIGNQ_JOB        *head;
+  SIGNQ_JOB        *tail;
+  int               depth;          /* Jobs queued or in progress */
+  pthread_t         threads[SIGNQ_MAX_THREADS];
+  int               nrThreads;
+  int               running;
+  pthread_mutex_t   mutex;
+  pthread_cond_t    submitted;
+  pthread_cond_t    completed;
+  TSS_POOL         *tssPool;
+  TSS_LOOP         *tssLoop;        /* NULL: blocking worker threads */
+  TSS_SHARDS       *tssShards;      /* NULL: tssPool only            */
+} SIGN_QUEUE;
+
+int signq_init(
+  SIGN_QUEUE  *queue,
+  TSS_POOL    *tssPool
+);
+
+void signq_destroy(
+  SIGN_QUEUE  *queue
+);
+
+int signq_setLoop(
+  SIGN_QUEUE  *queue,
+  TSS_LOOP    *tssLoop
+);
+
+int signq_setShards(
+  SIGN_QUEUE  *queue,
+  TSS_SHARDS  *tssShards
+);
+
+int signq_start(
+  SIGN_QUEUE  *queue,
+  int          nrThreads
+);
+
+void signq_stop(
+  SIGN_QUEUE  *queue
+);
+
+int signq_submit(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job
+);
+
+int signq_isDone(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job
+);
+
+void signq_wait(
+  SIGN_QUEUE  *queue,
+  SIGNQ_JOB   *job
+);
+
+int signq_getDepth(
+  SIGN_QUEUE  *queue
+);
+
+#endif
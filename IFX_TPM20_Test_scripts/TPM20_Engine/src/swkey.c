@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+
+#include "swkey.h"
+#include "tpm20w.h"
+
+
+
+void swkey_init(
+  SW_KEYS  *keys)
+{
+  memset(keys, 0, sizeof(SW_KEYS));
+  keys->policy    = SWKEY_POLICY_OFF;
+  keys->threshold = SWKEY_DEFAULT_THRESHOLD;
+
+  pthread_mutex_init(&keys->mutex, NULL);
+}
+
+
+
+void swkey_destroy(
+  SW_KEYS  *keys)
+{
+  swkey_close(keys);
+
+  OPENSSL_cleanse(keys->keys, sizeof(keys->keys));
+  keys->nrKeys = 0;
+  pthread_mutex_destroy(&keys->mutex);
+}
+
+
+
+/**********************************************************************
+ * Called with the mutex held.
+ **********************************************************************/
+static int swkey_find(
+  SW_KEYS         *keys,
+  TPMI_DH_OBJECT   handle)
+{
+  int i;
+
+  for (i = 0; i < keys->nrKeys; i++)
+  {
+    if (keys->keys[i].handle == handle)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+
+/**********************************************************************
+ * Copies the next ';' separated field of *spec to field (fields may be
+ * empty, e.g. an empty password). Returns 0 on success.
+ **********************************************************************/
+static int swkey_nextField(
+  const char  **spec,
+  char         *field,
+  size_t        fieldSize)
+{
+  const char  *end;
+  size_t       len;
+
+  if (*spec == NULL)
+  {
+    return -1;
+  }
+  if ((end = strchr(*spec, ';')) == NULL)
+  {
+    end = *spec + strlen(*spec);
+  }
+  if ((len = end - *spec) >= fieldSize)
+  {
+    return -1;
+  }
+
+  memcpy(field, *spec, len);
+  field[len] = '\0';
+  *spec = (*end == ';') ? end + 1 : NULL;
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Adds the software copy of a key:
+ * "keyHandle;parentPath;parentPassword;objectPath;objectPassword",
+ * where parentPath holds the saved context of the storage key and
+ * objectPath the sealed private scalar. Returns 0 on success.
+ **********************************************************************/
+int swkey_add(
+  SW_KEYS     *keys,
+  const char  *spec)
+{
+  SWKEY          key;
+  char           handleStr[16];
+  char          *end;
+  unsigned long  handle;
+  int            status = 0;
+
+  memset(&key, 0, sizeof(SWKEY));
+  if (swkey_nextField(&spec, handleStr, sizeof(handleStr)) != 0 ||
+      swkey_nextField(&spec, key.parentPath, sizeof(key.parentPath)) != 0 ||
+      swkey_nextField(&spec, key.parentPassword, sizeof(key.parentPassword)) != 0 ||
+      swkey_nextField(&spec, key.objectPath, sizeof(key.objectPath)) != 0 ||
+      swkey_nextField(&spec, key.objectPassword, sizeof(key.objectPassword)) != 0 ||
+      spec != NULL)
+  {
+    ERRFN("Invalid software key (keyHandle;parentPath;parentPassword;objectPath;objectPassword).");
+    OPENSSL_cleanse(&key, sizeof(SWKEY));
+    return -1;
+  }
+
+  handle = strtoul(handleStr, &end, 16);
+  if (*end != '\0' || handleStr[0] == '\0')
+  {
+    ERRFN("Invalid key handle \"%s\".", handleStr);
+    OPENSSL_cleanse(&key, sizeof(SWKEY));
+    return -1;
+  }
+  key.handle = (TPMI_DH_OBJECT) handle;
+
+  pthread_mutex_lock(&keys->mutex);
+  if (swkey_find(keys, key.handle) >= 0 || keys->nrKeys >= SWKEY_MAX_KEYS)
+  {
+    ERRFN("Software key 0x%x already added or too many keys (max %d).", key.handle, SWKEY_MAX_KEYS);
+    status = -1;
+  }
+  else
+  {
+    memcpy(&keys->keys[keys->nrKeys++], &key, sizeof(SWKEY));
+  }
+  pthread_mutex_unlock(&keys->mutex);
+
+  OPENSSL_cleanse(&key, sizeof(SWKEY));
+  return status;
+}
+
+
+
+/**********************************************************************
+ * "off", "auto" or "always". Returns 0 on success.
+ **********************************************************************/
+int swkey_setPolicy(
+  SW_KEYS     *keys,
+  const char  *policy)
+{
+  int newPolicy;
+
+  if (policy != NULL && strcmp(policy, "off") == 0)
+  {
+    newPolicy = SWKEY_POLICY_OFF;
+  }
+  else if (policy != NULL && strcmp(policy, "auto") == 0)
+  {
+    newPolicy = SWKEY_POLICY_AUTO;
+  }
+  else if (policy != NULL && strcmp(policy, "always") == 0)
+  {
+    newPolicy = SWKEY_POLICY_ALWAYS;
+  }
+  else
+  {
+    ERRFN("Invalid software sign policy, expected \"off\", \"auto\" or \"always\".");
+    return -1;
+  }
+
+  pthread_mutex_lock(&keys->mutex);
+  __atomic_store_n(&keys->policy, newPolicy, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&keys->mutex);
+  return 0;
+}
+
+
+
+int swkey_setThreshold(
+  SW_KEYS  *keys,
+  long      threshold)
+{
+  if (threshold < 1)
+  {
+    ERRFN("Invalid overload threshold %ld.", threshold);
+    return -1;
+  }
+
+  pthread_mutex_lock(&keys->mutex);
+  keys->threshold = (int) threshold;
+  pthread_mutex_unlock(&keys->mutex);
+  return 0;
+}
+
+
+
+int swkey_has(
+  SW_KEYS         *keys,
+  TPMI_DH_OBJECT   handle)
+{
+  int found;
+
+  pthread_mutex_lock(&keys->mutex);
+  found = (swkey_find(keys, handle) >= 0);
+  pthread_mutex_unlock(&keys->mutex);
+
+  return found;
+}
+
+
+
+/**********************************************************************
+ * Returns a copy of publicKey with the private scalar of secret, to be
+ * freed with EC_KEY_free() (which clears the scalar), or NULL. It signs
+ * with OpenSSL's own ECDSA method, not with the default one, which may
+ * be this engine's.
+ **********************************************************************/
+static EC_KEY* swkey_privateKey(
+  EC_KEY        *publicKey,
+  SWKEY_SECRET  *secret)
+{
+  EC_KEY  *privateKey;
+  BIGNUM  *scalar;
+  int      ok;
+
+  if ((privateKey = EC_KEY_dup(publicKey)) == NULL)
+  {
+    return NULL;
+  }
+  if ((scalar = BN_bin2bn(secret->scalar, secret->scalarLen, NULL)) == NULL)
+  {
+    EC_KEY_free(privateKey);
+    return NULL;
+  }
+  ok = EC_KEY_set_private_key(privateKey, scalar) &&
+       ECDSA_set_method(privateKey, ECDSA_OpenSSL());
+  BN_clear_free(scalar);
+
+  if (!ok)
+  {
+    EC_KEY_free(privateKey);
+    return NULL;
+  }
+  return privateKey;
+}
+
+
+
+/**********************************************************************
+ * Unseals the software copy of handle on the TPM and checks it against
+ * publicKey, the public key of the TPM key. Does nothing if it is
+ * unsealed already. Returns 0 on success.
+ **********************************************************************/
+int swkey_unseal(
+  SW_KEYS         *keys,
+  TSS_POOL        *tssPool,
+  TPMI_DH_OBJECT   handle,
+  EC_KEY          *publicKey)
+{
+  SWKEY          key;
+  SWKEY_SECRET   secret;
+  TSS_CONN      *conn;
+  EC_KEY        *privateKey = NULL;
+  int            index;
+  int            retried = 0;
+  int            status = -1;
+
+  // The TPM round trip is made without the mutex, which software signs
+  // and overload counting take for every signature
+  pthread_mutex_lock(&keys->mutex);
+  if ((index = swkey_find(keys, handle)) < 0)
+  {
+    pthread_mutex_unlock(&keys->mutex);
+    ERRFN("No software copy of key 0x%x.", handle);
+    return -1;
+  }
+  if (keys->keys[index].privateKey != NULL)
+  {
+    pthread_mutex_unlock(&keys->mutex);
+    return 0;
+  }
+  memcpy(&key, &keys->keys[index], sizeof(SWKEY));
+  pthread_mutex_unlock(&keys->mutex);
+
+  memset(&secret, 0, sizeof(SWKEY_SECRET));
+  do
+  {
+    if ((conn = tsspool_acquire(tssPool, TSSPOOL_CLASS_FOREGROUND, NULL)) == NULL)
+    {
+      break;
+    }
+    secret.scalarLen = sizeof(secret.scalar);
+    while (tpm20w_unseal(
+       conn->sysContext,
+       key.parentPath,
+       key.parentPassword,
+       key.objectPath,
+       key.objectPassword,
+       secret.scalar,
+      &secret.scalarLen) != 1)
+    {
+      secret.scalarLen = 0;
+      if (retried || !tssconn_recover(conn))
+      {
+        break;
+      }
+      retried = 1;
+      secret.scalarLen = sizeof(secret.scalar);
+    }
+    tsspool_release(tssPool, conn);
+
+    if (secret.scalarLen == 0)
+    {
+      ERRFN("Could not unseal software copy of key 0x%x.", handle);
+      break;
+    }
+
+    // A copy of another key would sign with the wrong scalar
+    if ((privateKey = swkey_privateKey(publicKey, &secret)) == NULL ||
+        !EC_KEY_check_key(privateKey))
+    {
+      ERRFN("Software copy of key 0x%x does not match the TPM key.", handle);
+      break;
+    }
+
+    // Publish, unless another caller unsealed the key meanwhile
+    pthread_mutex_lock(&keys->mutex);
+    if (keys->keys[index].privateKey == NULL)
+    {
+      keys->keys[index].privateKey = privateKey;
+      privateKey = NULL;
+      DBGFN("Software copy of key 0x%x ready.", handle);
+    }
+    pthread_mutex_unlock(&keys->mutex);
+    status = 0;
+  } while (0);
+
+  OPENSSL_cleanse(&secret, sizeof(SWKEY_SECRET));
+  OPENSSL_cleanse(&key, sizeof(SWKEY));
+  if (privateKey != NULL)
+  {
+    EC_KEY_free(privateKey);
+  }
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Frees the unsealed keys, which clears their scalars. Signatures in
+ * progress hold their own reference.
+ **********************************************************************/
+void swkey_close(
+  SW_KEYS  *keys)
+{
+  int i;
+
+  pthread_mutex_lock(&keys->mutex);
+  for (i = 0; i < keys->nrKeys; i++)
+  {
+    if (keys->keys[i].privateKey != NULL)
+    {
+      EC_KEY_free(keys->keys[i].privateKey);
+      keys->keys[i].privateKey = NULL;
+    }
+  }
+  pthread_mutex_unlock(&keys->mutex);
+}
+
+
+
+/**********************************************************************
+ * Signs digest in software if the policy says so for a sign queue of
+ * queueDepth jobs and handle has an unsealed copy. Returns the
+ * signature, or NULL if the TPM is to sign.
+ **********************************************************************/
+ECDSA_SIG* swkey_sign(
+  SW_KEYS              *keys,
+  TPMI_DH_OBJECT        handle,
+  int                   queueDepth,
+  const unsigned char  *digest,
+  int                   digestLen)
+{
+  EC_KEY     *privateKey = NULL;
+  ECDSA_SIG  *signature;
+  int         overloaded;
+  int         index;
+
+  // The default policy must not cost every TPM signature a lock
+  if (__atomic_load_n(&keys->policy, __ATOMIC_RELAXED) == SWKEY_POLICY_OFF)
+  {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&keys->mutex);
+  if ((overloaded = (queueDepth >= keys->threshold)))
+  {
+    keys->overloads++;
+  }
+  if ((keys->policy == SWKEY_POLICY_ALWAYS || (keys->policy == SWKEY_POLICY_AUTO && overloaded)) &&
+      (index = swkey_find(keys, handle)) >= 0 &&
+      (privateKey = keys->keys[index].privateKey) != NULL)
+  {
+    // Kept alive by this reference if swkey_close() runs meanwhile
+    EC_KEY_up_ref(privateKey);
+  }
+  pthread_mutex_unlock(&keys->mutex);
+
+  if (privateKey == NULL)
+  {
+    return NULL;
+  }
+
+  signature = ECDSA_do_sign(digest, digestLen, privateKey);
+  EC_KEY_free(privateKey);
+
+  if (signature != NULL)
+  {
+    pthread_mutex_lock(&keys->mutex);
+    keys->swSigns++;
+    pthread_mutex_unlock(&keys->mutex);
+  }
+  return signature;
+}
+
+
+
+unsigned long swkey_getSwSigns(
+  SW_KEYS  *keys)
+{
+  unsigned long swSigns;
+
+  pthread_mutex_lock(&keys->mutex);
+  swSigns = keys->swSigns;
+  pthread_mutex_unlock(&keys->mutex);
+
+  return swSigns;
+}
+
+
+
+unsigned long swkey_getOverloads(
+  SW_KEYS  *keys)
+{
+  unsigned long overloads;
+
+  pthread_mutex_lock(&keys->mutex);
+  overloads = keys->overloads;
+  pthread_mutex_unlock(&keys->mutex);
+
+  return overloads;
+}
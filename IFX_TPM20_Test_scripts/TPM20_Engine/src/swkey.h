@@ -0,0 +1,117 @@
+#ifndef _SWKEY_H_
+#define _SWKEY_H_
+
+#include <pthread.h>
+
+#include <sapi/tpm20.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+
+#include "tsspool.h"
+
+#define SWKEY_MAX_KEYS          (8)
+#define SWKEY_MAX_SCALAR       (66) /* Bytes, up to P-521                   */
+#define SWKEY_PATH_MAX_LEN    (128)
+#define SWKEY_DEFAULT_THRESHOLD (32) /* Sign queue depth that is an overload */
+
+#define SWKEY_POLICY_OFF    (0) /* Always sign on the TPM                    */
+#define SWKEY_POLICY_AUTO   (1) /* In software while the sign queue is full  */
+#define SWKEY_POLICY_ALWAYS (2) /* In software whenever there is a copy      */
+
+/*
+ * Private scalar of a key as unsealed by the TPM, wiped as soon as it is
+ * in the key's EC_KEY.
+ */
+typedef struct {
+  unsigned char   scalar[SWKEY_MAX_SCALAR];
+  int             scalarLen;         /* 0: not unsealed */
+} SWKEY_SECRET;
+
+/*
+ * Software copy of a duplicable TPM key, sealed under a TPM storage key
+ * (public and private blob as for tpm20w_loadSigningKey()).
+ */
+typedef struct {
+  TPMI_DH_OBJECT  handle;            /* Of the TPM key */
+  char            parentPath[SWKEY_PATH_MAX_LEN];
+  char            parentPassword[SWKEY_PATH_MAX_LEN];
+  char            objectPath[SWKEY_PATH_MAX_LEN];
+  char            objectPassword[SWKEY_PATH_MAX_LEN];
+  EC_KEY         *privateKey;        /* NULL until unsealed */
+} SWKEY;
+
+/*
+ * Overload fallback for signatures: keys with a software copy are
+ * unsealed once into an EC_KEY and, depending on the policy, sign in
+ * software instead of queueing for the TPM. The scalar is then in
+ * ordinary process memory (OpenSSL 1.0 has no secure heap) until
+ * swkey_close(). This trades the key never leaving the TPM for
+ * throughput and is meant for low-assurance endpoints only.
+ */
+typedef struct {
+  SWKEY             keys[SWKEY_MAX_KEYS];
+  int               nrKeys;
+  int               policy;
+  int               threshold;
+  unsigned long     overloads;       /* Signatures that found the queue full,
+                                        not counted while the policy is off  */
+  unsigned long     swSigns;         /* Signatures made in software          */
+  pthread_mutex_t   mutex;
+} SW_KEYS;
+
+void swkey_init(
+  SW_KEYS  *keys
+);
+
+void swkey_destroy(
+  SW_KEYS  *keys
+);
+
+int swkey_add(
+  SW_KEYS     *keys,
+  const char  *spec
+);
+
+int swkey_setPolicy(
+  SW_KEYS     *keys,
+  const char  *policy
+);
+
+int swkey_setThreshold(
+  SW_KEYS  *keys,
+  long      threshold
+);
+
+int swkey_has(
+  SW_KEYS         *keys,
+  TPMI_DH_OBJECT   handle
+);
+
+int swkey_unseal(
+  SW_KEYS         *keys,
+  TSS_POOL        *tssPool,
+  TPMI_DH_OBJECT   handle,
+  EC_KEY          *publicKey
+);
+
+void swkey_close(
+  SW_KEYS  *keys
+);
+
+ECDSA_SIG* swkey_sign(
+  SW_KEYS              *keys,
+  TPMI_DH_OBJECT        handle,
+  int                   queueDepth,
+  const unsigned char  *digest,
+  int                   digestLen
+);
+
+unsigned long swkey_getSwSigns(
+  SW_KEYS  *keys
+);
+
+unsigned long swkey_getOverloads(
+  SW_KEYS  *keys
+);
+
+#endif
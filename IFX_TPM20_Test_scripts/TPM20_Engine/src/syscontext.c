@@ -28,6 +28,8 @@
 #include <sapi/tpm20.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include "syscontext.h"
 
 
 // Allocates space for and initializes system
@@ -77,4 +79,194 @@ void TeardownSysContext( TSS2_SYS_CONTEXT **sysContext )
         free(*sysContext);
         *sysContext = 0;
     }
-} 
+}
+
+//
+// Per-thread cache of sys contexts for the helper functions (TpmHash,
+// TpmHmac, StartAuthSession, ...), which used to malloc and initialize a
+// context for every single command.  Contexts are sized for the largest
+// command and stay bound to the TCTI they were created for.  Each thread
+// keeps a few of them, so nested helpers (StartAuthSession calling
+// TpmHmac, say) find one too; beyond that, contexts are plain
+// InitSysContext/TeardownSysContext.
+//
+// FlushSysContexts can only reach the calling thread's cache, so it also
+// bumps a global TCTI generation; other threads drop their entries from
+// an older generation on their next borrow.
+//
+#define SYS_CONTEXT_CACHE_SIZE 4
+
+typedef struct {
+    TSS2_SYS_CONTEXT *sysContext;
+    TSS2_TCTI_CONTEXT *tctiContext;
+    unsigned int generation;
+    int inUse;
+} SYS_CONTEXT_CACHE_ENTRY;
+
+static unsigned int tctiGeneration = 0;
+static pthread_mutex_t tctiGenerationMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int GetTctiGeneration( void )
+{
+    unsigned int generation;
+
+    pthread_mutex_lock( &tctiGenerationMutex );
+    generation = tctiGeneration;
+    pthread_mutex_unlock( &tctiGenerationMutex );
+    return generation;
+}
+
+typedef struct {
+    SYS_CONTEXT_CACHE_ENTRY entries[SYS_CONTEXT_CACHE_SIZE];
+} SYS_CONTEXT_CACHE;
+
+static pthread_key_t sysContextCacheKey;
+static pthread_once_t sysContextCacheOnce = PTHREAD_ONCE_INIT;
+
+static void FreeSysContextCache( void *cache )
+{
+    SYS_CONTEXT_CACHE *threadCache = (SYS_CONTEXT_CACHE *)cache;
+    int i;
+
+    for( i = 0; i < SYS_CONTEXT_CACHE_SIZE; i++ )
+        TeardownSysContext( &threadCache->entries[i].sysContext );
+    free( threadCache );
+}
+
+static void CreateSysContextCacheKey( void )
+{
+    pthread_key_create( &sysContextCacheKey, FreeSysContextCache );
+}
+
+static SYS_CONTEXT_CACHE *GetSysContextCache( void )
+{
+    SYS_CONTEXT_CACHE *cache;
+
+    pthread_once( &sysContextCacheOnce, CreateSysContextCacheKey );
+
+    cache = pthread_getspecific( sysContextCacheKey );
+    if( cache == 0 )
+    {
+        cache = calloc( 1, sizeof( SYS_CONTEXT_CACHE ) );
+        if( cache != 0 && pthread_setspecific( sysContextCacheKey, cache ) != 0 )
+        {
+            free( cache );
+            cache = 0;
+        }
+    }
+    return cache;
+}
+
+TSS2_SYS_CONTEXT *BorrowSysContext(
+    TSS2_TCTI_CONTEXT *tctiContext,
+    TSS2_ABI_VERSION *abiVersion
+ )
+{
+    SYS_CONTEXT_CACHE *cache = GetSysContextCache();
+    SYS_CONTEXT_CACHE_ENTRY *freeEntry = 0;
+    SYS_CONTEXT_CACHE_ENTRY *idleEntry = 0;
+    unsigned int generation = GetTctiGeneration();
+    int i;
+
+    if( cache != 0 )
+    {
+        for( i = 0; i < SYS_CONTEXT_CACHE_SIZE; i++ )
+        {
+            SYS_CONTEXT_CACHE_ENTRY *entry = &cache->entries[i];
+
+            // Bound to a TCTI that may have been closed since
+            if( entry->sysContext != 0 && !entry->inUse && entry->generation != generation )
+                TeardownSysContext( &entry->sysContext );
+
+            if( entry->sysContext != 0 && !entry->inUse && entry->tctiContext == tctiContext )
+            {
+                entry->inUse = 1;
+                return entry->sysContext;
+            }
+            if( entry->sysContext == 0 && freeEntry == 0 )
+                freeEntry = entry;
+            if( entry->sysContext != 0 && !entry->inUse && idleEntry == 0 )
+                idleEntry = entry;
+        }
+    }
+
+    // All slots hold idle contexts of other TCTIs: make room for this one
+    if( freeEntry == 0 && idleEntry != 0 )
+    {
+        TeardownSysContext( &idleEntry->sysContext );
+        freeEntry = idleEntry;
+    }
+
+    // Size 0 gets a context for the largest command.
+    if( freeEntry == 0 )
+        return InitSysContext( 0, tctiContext, abiVersion );
+
+    freeEntry->sysContext = InitSysContext( 0, tctiContext, abiVersion );
+    if( freeEntry->sysContext != 0 )
+    {
+        freeEntry->tctiContext = tctiContext;
+        freeEntry->generation = generation;
+        freeEntry->inUse = 1;
+    }
+    return freeEntry->sysContext;
+}
+
+void ReturnSysContext( TSS2_SYS_CONTEXT **sysContext, TSS2_RC rval )
+{
+    SYS_CONTEXT_CACHE *cache;
+    TSS2_RC level = rval & TSS2_ERROR_LEVEL_MASK;
+    int i;
+
+    if( *sysContext == 0 )
+        return;
+
+    pthread_once( &sysContextCacheOnce, CreateSysContextCacheKey );
+
+    cache = pthread_getspecific( sysContextCacheKey );
+    if( cache != 0 )
+    {
+        for( i = 0; i < SYS_CONTEXT_CACHE_SIZE; i++ )
+        {
+            if( cache->entries[i].sysContext == *sysContext )
+            {
+                // A SAPI or TCTI error may leave the context in the middle
+                // of a command; such a context is not reused.
+                if( level == TSS2_SYS_ERROR_LEVEL || level == TSS2_SYS_PART2_ERROR_LEVEL ||
+                        level == TSS2_TCTI_ERROR_LEVEL )
+                {
+                    TeardownSysContext( &cache->entries[i].sysContext );
+                }
+                cache->entries[i].inUse = 0;
+                *sysContext = 0;
+                return;
+            }
+        }
+    }
+
+    TeardownSysContext( sysContext );
+}
+
+void FlushSysContexts( TSS2_TCTI_CONTEXT *tctiContext )
+{
+    SYS_CONTEXT_CACHE *cache;
+    int i;
+
+    pthread_mutex_lock( &tctiGenerationMutex );
+    tctiGeneration++;
+    pthread_mutex_unlock( &tctiGenerationMutex );
+
+    pthread_once( &sysContextCacheOnce, CreateSysContextCacheKey );
+
+    cache = pthread_getspecific( sysContextCacheKey );
+    if( cache == 0 )
+        return;
+
+    for( i = 0; i < SYS_CONTEXT_CACHE_SIZE; i++ )
+    {
+        if( cache->entries[i].sysContext != 0 && !cache->entries[i].inUse &&
+                cache->entries[i].tctiContext == tctiContext )
+        {
+            TeardownSysContext( &cache->entries[i].sysContext );
+        }
+    }
+}
@@ -40,4 +40,20 @@ TSS2_SYS_CONTEXT *InitSysContext(
 
 void TeardownSysContext( TSS2_SYS_CONTEXT **sysContext );
 
+//
+// Borrow a sys context from the calling thread's cache and give it back
+// with the return code of the last command on it; contexts that saw a
+// SAPI or TCTI error are torn down instead of being reused.
+//
+TSS2_SYS_CONTEXT *BorrowSysContext(
+    TSS2_TCTI_CONTEXT *tctiContext,
+    TSS2_ABI_VERSION *abiVersion
+ );
+
+void ReturnSysContext( TSS2_SYS_CONTEXT **sysContext, TSS2_RC rval );
+
+// Drops the calling thread's cached contexts for a TCTI that goes away;
+// other threads drop theirs on their next BorrowSysContext.
+void FlushSysContexts( TSS2_TCTI_CONTEXT *tctiContext );
+
 #endif
@@ -0,0 +1,479 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tctiasync.h"
+#include "tpm20w.h"
+
+#define TCTIASYNC_MAGIC        (0x7463746961737963ULL) /* "tctiasyc" */
+#define TCTIASYNC_SEND_COMMAND (8)  /* Simulator protocol: TPM_SEND_COMMAND */
+#define TCTIASYNC_TX_HEADER    (9)  /* Command code, locality, size       */
+#define TCTIASYNC_RX_HEADER    (4)  /* Size                               */
+#define TCTIASYNC_RX_TRAILER   (4)  /* Acknowledgement, always 0          */
+
+#define TCTIASYNC_STATE_IDLE      (0)
+#define TCTIASYNC_STATE_SENDING   (1)
+#define TCTIASYNC_STATE_RECEIVING (2)
+
+typedef struct {
+  TSS2_TCTI_CONTEXT_COMMON_V1  common;
+  int                          fd;
+  int                          state;
+  UINT8                        locality;
+  unsigned char                txBuffer[TCTIASYNC_TX_HEADER + TCTIASYNC_MAX_COMMAND];
+  size_t                       txSize;
+  size_t                       txDone;
+  unsigned char                rxBuffer[TCTIASYNC_RX_HEADER + TCTIASYNC_MAX_COMMAND + TCTIASYNC_RX_TRAILER];
+  size_t                       rxSize;   /* Whole frame, known after the header */
+  size_t                       rxDone;
+} TCTI_ASYNC_CONTEXT;
+
+
+
+static void tctiasync_putUint32(
+  unsigned char  *buffer,
+  UINT32          value)
+{
+  buffer[0] = (unsigned char) (value >> 24);
+  buffer[1] = (unsigned char) (value >> 16);
+  buffer[2] = (unsigned char) (value >> 8);
+  buffer[3] = (unsigned char) value;
+}
+
+
+
+static UINT32 tctiasync_getUint32(
+  const unsigned char  *buffer)
+{
+  return ((UINT32) buffer[0] << 24) | ((UINT32) buffer[1] << 16) |
+         ((UINT32) buffer[2] << 8)  |  (UINT32) buffer[3];
+}
+
+
+
+/**********************************************************************
+ * Opens a TCP connection. Returns the socket or -1.
+ **********************************************************************/
+static int tctiasync_connect(
+  const char  *hostName,
+  int          port)
+{
+  struct addrinfo   hints;
+  struct addrinfo  *addresses;
+  struct addrinfo  *address;
+  char              service[16];
+  int               fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%d", port);
+
+  if (getaddrinfo(hostName, service, &hints, &addresses) != 0)
+  {
+    ERRFN("Could not resolve %s.", hostName);
+    return -1;
+  }
+
+  for (address = addresses; address != NULL; address = address->ai_next)
+  {
+    if ((fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol)) < 0)
+    {
+      continue;
+    }
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+    {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+
+  return fd;
+}
+
+
+
+/**********************************************************************
+ * Writes as much of the pending command as the socket takes.
+ **********************************************************************/
+static TSS2_RC tctiasync_flush(
+  TCTI_ASYNC_CONTEXT  *ctx)
+{
+  ssize_t n;
+
+  while (ctx->txDone < ctx->txSize)
+  {
+    n = send(ctx->fd, ctx->txBuffer + ctx->txDone, ctx->txSize - ctx->txDone, 0);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return TSS2_RC_SUCCESS;
+    }
+    if (n <= 0)
+    {
+      ERRFN("Sending to resource manager failed (errno %d).", errno);
+      return TSS2_TCTI_RC_IO_ERROR;
+    }
+    ctx->txDone += n;
+  }
+
+  ctx->state = TCTIASYNC_STATE_RECEIVING;
+  return TSS2_RC_SUCCESS;
+}
+
+
+
+/**********************************************************************
+ * Reads whatever part of the response frame has arrived. Returns
+ * TSS2_RC_SUCCESS once the frame is complete, TSS2_TCTI_RC_TRY_AGAIN
+ * if more is to come.
+ **********************************************************************/
+static TSS2_RC tctiasync_fill(
+  TCTI_ASYNC_CONTEXT  *ctx)
+{
+  size_t   want;
+  ssize_t  n;
+  UINT32   responseSize;
+
+  while (1)
+  {
+    want = (ctx->rxSize == 0 ? TCTIASYNC_RX_HEADER : ctx->rxSize) - ctx->rxDone;
+    if (want == 0)
+    {
+      if (ctx->rxSize != 0)
+      {
+        return TSS2_RC_SUCCESS;
+      }
+
+      // Header complete, now the size of the whole frame is known
+      responseSize = tctiasync_getUint32(ctx->rxBuffer);
+      if (responseSize > TCTIASYNC_MAX_COMMAND)
+      {
+        ERRFN("Response of %u bytes is too large.", responseSize);
+        return TSS2_TCTI_RC_IO_ERROR;
+      }
+      ctx->rxSize = TCTIASYNC_RX_HEADER + responseSize + TCTIASYNC_RX_TRAILER;
+      continue;
+    }
+
+    n = recv(ctx->fd, ctx->rxBuffer + ctx->rxDone, want, 0);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    if (n <= 0)
+    {
+      ERRFN("Receiving from resource manager failed (errno %d).", errno);
+      return TSS2_TCTI_RC_IO_ERROR;
+    }
+    ctx->rxDone += n;
+  }
+}
+
+
+
+static TSS2_RC tctiasync_transmit(
+  TSS2_TCTI_CONTEXT  *tctiContext,
+  size_t              size,
+  uint8_t            *command)
+{
+  TCTI_ASYNC_CONTEXT  *ctx = (TCTI_ASYNC_CONTEXT*) tctiContext;
+
+  if (ctx == NULL || command == NULL)
+  {
+    return TSS2_TCTI_RC_BAD_REFERENCE;
+  }
+  if (ctx->state != TCTIASYNC_STATE_IDLE)
+  {
+    return TSS2_TCTI_RC_BAD_SEQUENCE;
+  }
+  if (size > TCTIASYNC_MAX_COMMAND)
+  {
+    return TSS2_TCTI_RC_BAD_VALUE;
+  }
+
+  tctiasync_putUint32(ctx->txBuffer, TCTIASYNC_SEND_COMMAND);
+  ctx->txBuffer[4] = ctx->locality;
+  tctiasync_putUint32(ctx->txBuffer + 5, (UINT32) size);
+  memcpy(ctx->txBuffer + TCTIASYNC_TX_HEADER, command, size);
+
+  ctx->txSize = TCTIASYNC_TX_HEADER + size;
+  ctx->txDone = 0;
+  ctx->rxSize = 0;
+  ctx->rxDone = 0;
+  ctx->state  = TCTIASYNC_STATE_SENDING;
+
+  // Whatever does not fit into the socket buffer goes out in receive()
+  return tctiasync_flush(ctx);
+}
+
+
+
+static TSS2_RC tctiasync_receive(
+  TSS2_TCTI_CONTEXT  *tctiContext,
+  size_t             *size,
+  uint8_t            *response,
+  int32_t             timeout)
+{
+  TCTI_ASYNC_CONTEXT  *ctx = (TCTI_ASYNC_CONTEXT*) tctiContext;
+  struct pollfd        pfd;
+  size_t               responseSize;
+  TSS2_RC              rval;
+  int                  n;
+
+  if (ctx == NULL || size == NULL || response == NULL)
+  {
+    return TSS2_TCTI_RC_BAD_REFERENCE;
+  }
+  if (ctx->state == TCTIASYNC_STATE_IDLE)
+  {
+    return TSS2_TCTI_RC_BAD_SEQUENCE;
+  }
+
+  while (1)
+  {
+    if (ctx->state == TCTIASYNC_STATE_SENDING)
+    {
+      rval = tctiasync_flush(ctx);
+    }
+    else
+    {
+      rval = tctiasync_fill(ctx);
+    }
+
+    if (rval == TSS2_RC_SUCCESS && ctx->state == TCTIASYNC_STATE_SENDING)
+    {
+      rval = TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    else if (rval == TSS2_RC_SUCCESS && ctx->state == TCTIASYNC_STATE_RECEIVING)
+    {
+      if (ctx->rxSize == 0 || ctx->rxDone < ctx->rxSize)
+      {
+        continue;
+      }
+      break;
+    }
+
+    if (rval != TSS2_TCTI_RC_TRY_AGAIN)
+    {
+      ctx->state = TCTIASYNC_STATE_IDLE;
+      return rval;
+    }
+    if (timeout == 0)
+    {
+      return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+
+    pfd.fd      = ctx->fd;
+    pfd.events  = (ctx->state == TCTIASYNC_STATE_SENDING) ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    n = poll(&pfd, 1, timeout == TSS2_TCTI_TIMEOUT_BLOCK ? -1 : timeout);
+    if (n == 0)
+    {
+      return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    if (n < 0 && errno != EINTR)
+    {
+      ctx->state = TCTIASYNC_STATE_IDLE;
+      return TSS2_TCTI_RC_IO_ERROR;
+    }
+  }
+
+  responseSize = ctx->rxSize - TCTIASYNC_RX_HEADER - TCTIASYNC_RX_TRAILER;
+  if (*size < responseSize)
+  {
+    // The caller may retry with a larger buffer
+    *size = responseSize;
+    return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+  }
+
+  memcpy(response, ctx->rxBuffer + TCTIASYNC_RX_HEADER, responseSize);
+  *size      = responseSize;
+  ctx->state = TCTIASYNC_STATE_IDLE;
+  return TSS2_RC_SUCCESS;
+}
+
+
+
+static void tctiasync_finalize(
+  TSS2_TCTI_CONTEXT  *tctiContext)
+{
+  TCTI_ASYNC_CONTEXT  *ctx = (TCTI_ASYNC_CONTEXT*) tctiContext;
+
+  if (ctx != NULL && ctx->fd >= 0)
+  {
+    close(ctx->fd);
+    ctx->fd = -1;
+  }
+}
+
+
+
+static TSS2_RC tctiasync_cancel(
+  TSS2_TCTI_CONTEXT  *tctiContext)
+{
+  (void) tctiContext;
+  return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+}
+
+
+
+static TSS2_RC tctiasync_getPollHandles(
+  TSS2_TCTI_CONTEXT      *tctiContext,
+  TSS2_TCTI_POLL_HANDLE  *handles,
+  size_t                 *numHandles)
+{
+  TCTI_ASYNC_CONTEXT  *ctx = (TCTI_ASYNC_CONTEXT*) tctiContext;
+
+  if (ctx == NULL || numHandles == NULL)
+  {
+    return TSS2_TCTI_RC_BAD_REFERENCE;
+  }
+
+  if (handles != NULL)
+  {
+    if (*numHandles < 1)
+    {
+      return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    handles[0].fd      = ctx->fd;
+    handles[0].events  = (ctx->state == TCTIASYNC_STATE_SENDING) ? POLLOUT : POLLIN;
+    handles[0].revents = 0;
+  }
+  *numHandles = 1;
+  return TSS2_RC_SUCCESS;
+}
+
+
+
+static TSS2_RC tctiasync_setLocality(
+  TSS2_TCTI_CONTEXT  *tctiContext,
+  uint8_t             locality)
+{
+  TCTI_ASYNC_CONTEXT  *ctx = (TCTI_ASYNC_CONTEXT*) tctiContext;
+
+  if (ctx == NULL)
+  {
+    return TSS2_TCTI_RC_BAD_REFERENCE;
+  }
+  if (ctx->state != TCTIASYNC_STATE_IDLE)
+  {
+    return TSS2_TCTI_RC_BAD_SEQUENCE;
+  }
+  ctx->locality = locality;
+  return TSS2_RC_SUCCESS;
+}
+
+
+
+/**********************************************************************
+ * Like InitSocketTcti: with a NULL context only the size is returned.
+ * The connection is made blocking and then switched to non-blocking.
+ **********************************************************************/
+TSS2_RC InitAsyncSocketTcti(
+  TSS2_TCTI_CONTEXT       *tctiContext,
+  size_t                  *contextSize,
+  const TCTI_SOCKET_CONF  *config)
+{
+  TCTI_ASYNC_CONTEXT  *ctx = (TCTI_ASYNC_CONTEXT*) tctiContext;
+  int                  flags;
+  int                  noDelay = 1;
+
+  if (contextSize == NULL)
+  {
+    return TSS2_TCTI_RC_BAD_REFERENCE;
+  }
+  if (ctx == NULL)
+  {
+    *contextSize = sizeof(TCTI_ASYNC_CONTEXT);
+    return TSS2_RC_SUCCESS;
+  }
+  if (config == NULL || *contextSize < sizeof(TCTI_ASYNC_CONTEXT))
+  {
+    return TSS2_TCTI_RC_BAD_VALUE;
+  }
+
+  memset(ctx, 0, sizeof(TCTI_ASYNC_CONTEXT));
+  ctx->common.magic          = TCTIASYNC_MAGIC;
+  ctx->common.version        = 1;
+  ctx->common.transmit       = tctiasync_transmit;
+  ctx->common.receive        = tctiasync_receive;
+  ctx->common.finalize       = tctiasync_finalize;
+  ctx->common.cancel         = tctiasync_cancel;
+  ctx->common.getPollHandles = tctiasync_getPollHandles;
+  ctx->common.setLocality    = tctiasync_setLocality;
+  ctx->state                 = TCTIASYNC_STATE_IDLE;
+
+  if ((ctx->fd = tctiasync_connect(config->hostname, config->port)) < 0)
+  {
+    return TSS2_TCTI_RC_IO_ERROR;
+  }
+
+  // Commands are small and latency bound
+  setsockopt(ctx->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  fcntl(ctx->fd, F_SETFD, FD_CLOEXEC);
+  if ((flags = fcntl(ctx->fd, F_GETFL)) < 0 ||
+      fcntl(ctx->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    close(ctx->fd);
+    ctx->fd = -1;
+    return TSS2_TCTI_RC_IO_ERROR;
+  }
+
+  return TSS2_RC_SUCCESS;
+}
+
+
+
+TSS2_RC tctiasync_platformCommand(
+  const char  *hostName,
+  int          platformPort,
+  UINT32       command)
+{
+  unsigned char  buffer[4];
+  size_t         done = 0;
+  ssize_t        n;
+  int            fd;
+  TSS2_RC        rval = TSS2_TCTI_RC_IO_ERROR;
+
+  if ((fd = tctiasync_connect(hostName, platformPort)) < 0)
+  {
+    return TSS2_TCTI_RC_IO_ERROR;
+  }
+
+  tctiasync_putUint32(buffer, command);
+  if (send(fd, buffer, sizeof(buffer), 0) == (ssize_t) sizeof(buffer))
+  {
+    // The simulator acknowledges with a 0 UINT32
+    while (done < sizeof(buffer) &&
+           ((n = recv(fd, buffer + done, sizeof(buffer) - done, 0)) > 0 ||
+            (n < 0 && errno == EINTR)))
+    {
+      done += (n > 0) ? n : 0;
+    }
+    if (done == sizeof(buffer))
+    {
+      rval = tctiasync_getUint32(buffer) == 0 ? TSS2_RC_SUCCESS : TSS2_TCTI_RC_GENERAL_FAILURE;
+    }
+  }
+
+  close(fd);
+  return rval;
+}
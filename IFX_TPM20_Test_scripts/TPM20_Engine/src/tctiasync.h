@@ -0,0 +1,34 @@
+#ifndef _TCTIASYNC_H_
+#define _TCTIASYNC_H_
+
+#include <sapi/tpm20.h>
+#include <tcti/tcti_socket.h>
+
+#define TCTIASYNC_MAX_COMMAND (4096) /* Largest TPM command/response */
+
+/*
+ * Non-blocking socket TCTI for the resource manager (same wire protocol
+ * as the socket TCTI). transmit() never waits for the socket and
+ * receive() with a timeout of 0 returns TSS2_TCTI_RC_TRY_AGAIN until the
+ * whole response is in, so Tss2_Sys_ExecuteAsync/ExecuteFinish can drive
+ * it from an event loop. getPollHandles() reports the socket and whether
+ * it is waiting to become writable or readable.
+ */
+TSS2_RC InitAsyncSocketTcti(
+  TSS2_TCTI_CONTEXT       *tctiContext,
+  size_t                  *contextSize,
+  const TCTI_SOCKET_CONF  *config
+);
+
+/*
+ * Sends a simulator platform command (MS_SIM_POWER_ON, ...) to the
+ * platform port of the resource manager. The async TCTI has no
+ * platform channel of its own.
+ */
+TSS2_RC tctiasync_platformCommand(
+  const char  *hostName,
+  int          platformPort,
+  UINT32       command
+);
+
+#endif
@@ -1,34 +1,38 @@
 #include "tpm20w.h"
 
+#include <openssl/crypto.h>
 #include <openssl/obj_mac.h>
+#include <openssl/sha.h>
 
 
 int load(
+  TSS2_SYS_CONTEXT *sysContext,
   TPMI_DH_OBJECT   parentHandle,
   TPM2B_PUBLIC    *inPublic,
   TPM2B_PRIVATE   *inPrivate,
   const char      *outFileName,
-  TPM_HANDLE      *keyHandle);
+  TPM_HANDLE      *keyHandle,
+  TPMS_AUTH_COMMAND *sessionData);
 
 
-TPMS_AUTH_COMMAND   sessionData;
-
-
-int tpm20w_signEcdsaWithSha256(
+/**********************************************************************
+ * Runs TPM2_Sign on a digest with the given scheme and HASHCHECK
+ * ticket, using a password session for the key.
+ **********************************************************************/
+static int tpm20w_signDigest(
+  TSS2_SYS_CONTEXT     *sysContext,
   const unsigned char  *digestBytes,
   int                   digestLen,
+  TPMT_SIG_SCHEME      *inScheme,
+  TPMT_TK_HASHCHECK    *validation,
   TPMI_DH_OBJECT        keyHandle,
   const char           *keyPassword,
   TPMT_SIGNATURE       *signature)
 {
-  TPMI_ALG_HASH        halg = 0x000B; // SHA-256
-
   TPM2B_DIGEST         digest = { {sizeof(TPM2B_DIGEST), } };
-  TPMT_SIG_SCHEME      inScheme;
-  
-  TPMT_TK_HASHCHECK    validation;
 
   TSS2_SYS_CMD_AUTHS   sessionsData;
+  TPMS_AUTH_COMMAND    sessionData;
   TPMS_AUTH_RESPONSE   sessionDataOut;
   TSS2_SYS_RSP_AUTHS   sessionsDataOut;
   TPMS_AUTH_COMMAND*   sessionDataArray[1];
@@ -47,10 +51,6 @@ int tpm20w_signEcdsaWithSha256(
   sessionData.nonce.t.size = 0;
   *((UINT8 *)((void *)&sessionData.sessionAttributes)) = 0;
   
-  validation.tag = TPM_ST_HASHCHECK;
-  validation.hierarchy = TPM_RH_NULL;
-  validation.digest.t.size = 0;
-  
   do
   {
     DBGFN("Key password: '%s'", keyPassword);
@@ -66,8 +66,11 @@ int tpm20w_signEcdsaWithSha256(
       break;
     }
 
-    inScheme.scheme = TPM_ALG_ECDSA;
-    inScheme.details.ecdsa.hashAlg = halg;
+    if (digestLen < 1 || digestLen > (int) sizeof(digest.t.buffer))
+    {
+      ERRFN("Invalid digest size %d.", digestLen);
+      break;
+    }
     digest.t.size = digestLen;
     memcpy(digest.t.buffer, digestBytes, digestLen);
     
@@ -75,15 +78,15 @@ int tpm20w_signEcdsaWithSha256(
     DBGFN("Key handle: 0x%x", keyHandle);
     DBGFN("Session Data at 0x%x", (unsigned int) &sessionData);
     DBGFN("Digest size: %d", digestLen);
-    DBGFN("In-scheme at 0x%x", (unsigned int) &inScheme);
+    DBGFN("In-scheme at 0x%x", (unsigned int) inScheme);
 
     if ((status = Tss2_Sys_Sign(
        sysContext,
        keyHandle,
       &sessionsData,
       &digest,
-      &inScheme,
-      &validation,
+       inScheme,
+       validation,
        signature,
       &sessionsDataOut)) != TPM_RC_SUCCESS)
     {
@@ -97,7 +100,495 @@ int tpm20w_signEcdsaWithSha256(
   return -1;
 }
 
+int tpm20w_signEcdsaWithSha256(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const unsigned char  *digestBytes,
+  int                   digestLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  TPMT_SIGNATURE       *signature)
+{
+  TPMI_ALG_HASH        halg = 0x000B; // SHA-256
+  TPMT_SIG_SCHEME      inScheme;
+  TPMT_TK_HASHCHECK    validation;
+
+  inScheme.scheme = TPM_ALG_ECDSA;
+  inScheme.details.ecdsa.hashAlg = halg;
+
+  validation.tag = TPM_ST_HASHCHECK;
+  validation.hierarchy = TPM_RH_NULL;
+  validation.digest.t.size = 0;
+
+  return tpm20w_signDigest(sysContext, digestBytes, digestLen, &inScheme, &validation,
+    keyHandle, keyPassword, signature);
+}
+
+
+
+/**********************************************************************
+ * First half of a TPM2_Sign for asynchronous use: puts the command with
+ * its password session into the system context, ready for
+ * Tss2_Sys_ExecuteAsync. The signature is read with
+ * Tss2_Sys_Sign_Complete once the response is in. Returns 1 on
+ * success, -1 on error.
+ **********************************************************************/
+static int tpm20w_signPrepare(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const unsigned char  *digestBytes,
+  int                   digestLen,
+  TPMT_SIG_SCHEME      *inScheme,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword)
+{
+  TPM2B_DIGEST         digest = { {sizeof(TPM2B_DIGEST), } };
+  TPMT_TK_HASHCHECK    validation;
+
+  TSS2_SYS_CMD_AUTHS   sessionsData;
+  TPMS_AUTH_COMMAND    sessionData;
+  TPMS_AUTH_COMMAND*   sessionDataArray[1];
+
+  UINT32               status;
+  int                  result = -1;
+
+  sessionDataArray[0] = &sessionData;
+  sessionsData.cmdAuths = &sessionDataArray[0];
+  sessionsData.cmdAuthsCount = 1;
+
+  sessionData.sessionHandle = TPM_RS_PW;
+  sessionData.nonce.t.size = 0;
+  *((UINT8 *)((void *)&sessionData.sessionAttributes)) = 0;
+
+  validation.tag = TPM_ST_HASHCHECK;
+  validation.hierarchy = TPM_RH_NULL;
+  validation.digest.t.size = 0;
+
+  do
+  {
+    sessionData.hmac.t.size = sizeof(sessionData.hmac.t) - 2;
+    if ((status = str2ByteStructure(
+      keyPassword,
+      &sessionData.hmac.t.size,
+      sessionData.hmac.t.buffer)) != 0)
+    {
+      ERRFN("Error setting key password, returned 0x%x.", status);
+      break;
+    }
+
+    if (digestLen < 1 || digestLen > (int) sizeof(digest.t.buffer))
+    {
+      ERRFN("Invalid digest size %d.", digestLen);
+      break;
+    }
+    digest.t.size = digestLen;
+    memcpy(digest.t.buffer, digestBytes, digestLen);
+
+    if ((status = Tss2_Sys_Sign_Prepare(sysContext, keyHandle, &digest, inScheme, &validation)) != TSS2_RC_SUCCESS ||
+        (status = Tss2_Sys_SetCmdAuths(sysContext, &sessionsData)) != TSS2_RC_SUCCESS)
+    {
+      ERRFN("Preparing TPM2_Sign failed with 0x%x.", status);
+      break;
+    }
+
+    result = 1;
+  } while (0);
+
+  OPENSSL_cleanse(&sessionData, sizeof(sessionData));
+  return result;
+}
+
+
+
+int tpm20w_signEcdsaWithSha256Prepare(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const unsigned char  *digestBytes,
+  int                   digestLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword)
+{
+  TPMT_SIG_SCHEME      inScheme;
+
+  inScheme.scheme = TPM_ALG_ECDSA;
+  inScheme.details.ecdsa.hashAlg = TPM_ALG_SHA256;
+
+  return tpm20w_signPrepare(sysContext, digestBytes, digestLen, &inScheme, keyHandle, keyPassword);
+}
+
+
+
+int tpm20w_signEcdaaWithSha256Prepare(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const unsigned char  *digestBytes,
+  int                   digestLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  UINT16                counter)
+{
+  TPMT_SIG_SCHEME      inScheme;
+
+  inScheme.scheme = TPM_ALG_ECDAA;
+  inScheme.details.ecdaa.hashAlg = TPM_ALG_SHA256;
+  inScheme.details.ecdaa.count = counter;
+
+  return tpm20w_signPrepare(sysContext, digestBytes, digestLen, &inScheme, keyHandle, keyPassword);
+}
+
+
+
+/**********************************************************************
+ * TPM2_Commit without P1, s2 and y2, i.e. only the first phase of an
+ * ECDAA signature: the TPM picks the nonce r, computes E = [r]G and
+ * remembers r under the returned counter. A later TPM2_Sign with the
+ * ECDAA scheme and this counter then only does the scalar arithmetic.
+ * Every counter can be used once. Returns 1 on success, -1 on error.
+ **********************************************************************/
+int tpm20w_commit(
+  TSS2_SYS_CONTEXT     *sysContext,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  UINT16               *counter)
+{
+  TPM2B_ECC_POINT      P1 = { { 0, } };
+  TPM2B_SENSITIVE_DATA s2 = { { 0, } };
+  TPM2B_ECC_PARAMETER  y2 = { { 0, } };
+  TPM2B_ECC_POINT      K = { { sizeof(TPM2B_ECC_POINT), } };
+  TPM2B_ECC_POINT      L = { { sizeof(TPM2B_ECC_POINT), } };
+  TPM2B_ECC_POINT      E = { { sizeof(TPM2B_ECC_POINT), } };
+
+  TSS2_SYS_CMD_AUTHS   sessionsData;
+  TPMS_AUTH_COMMAND    sessionData;
+  TPMS_AUTH_RESPONSE   sessionDataOut;
+  TSS2_SYS_RSP_AUTHS   sessionsDataOut;
+  TPMS_AUTH_COMMAND*   sessionDataArray[1];
+  TPMS_AUTH_RESPONSE*  sessionDataOutArray[1];
+
+  UINT32               status;
+  int                  result = -1;
+
+  sessionDataArray[0] = &sessionData;
+  sessionsData.cmdAuths = &sessionDataArray[0];
+  sessionDataOutArray[0] = &sessionDataOut;
+  sessionsDataOut.rspAuths = &sessionDataOutArray[0];
+  sessionsDataOut.rspAuthsCount = 1;
+  sessionsData.cmdAuthsCount = 1;
+
+  sessionData.sessionHandle = TPM_RS_PW;
+  sessionData.nonce.t.size = 0;
+  *((UINT8 *)((void *)&sessionData.sessionAttributes)) = 0;
+
+  do
+  {
+    sessionData.hmac.t.size = sizeof(sessionData.hmac.t) - 2;
+    if ((status = str2ByteStructure(
+      keyPassword,
+      &sessionData.hmac.t.size,
+      sessionData.hmac.t.buffer)) != 0)
+    {
+      ERRFN("Error setting key password, returned 0x%x.", status);
+      break;
+    }
+
+    if ((status = Tss2_Sys_Commit(
+       sysContext,
+       keyHandle,
+      &sessionsData,
+      &P1,
+      &s2,
+      &y2,
+      &K,
+      &L,
+      &E,
+       counter,
+      &sessionsDataOut)) != TPM_RC_SUCCESS)
+    {
+      ERRFN("Tss2_Sys_Commit failed with error code 0x%x.", status);
+      break;
+    }
+
+    result = 1;
+  } while (0);
+
+  OPENSSL_cleanse(&sessionData, sizeof(sessionData));
+  return result;
+}
+
+
+
+/**********************************************************************
+ * Second phase of an ECDAA signature with SHA-256, using the nonce the
+ * TPM committed to under counter (see tpm20w_commit()). Returns 1 on
+ * success, -1 on error.
+ **********************************************************************/
+int tpm20w_signEcdaaWithSha256(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const unsigned char  *digestBytes,
+  int                   digestLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  UINT16                counter,
+  TPMT_SIGNATURE       *signature)
+{
+  TPMT_SIG_SCHEME      inScheme;
+  TPMT_TK_HASHCHECK    validation;
+
+  inScheme.scheme = TPM_ALG_ECDAA;
+  inScheme.details.ecdaa.hashAlg = TPM_ALG_SHA256;
+  inScheme.details.ecdaa.count = counter;
+
+  validation.tag = TPM_ST_HASHCHECK;
+  validation.hierarchy = TPM_RH_NULL;
+  validation.digest.t.size = 0;
+
+  return tpm20w_signDigest(sysContext, digestBytes, digestLen, &inScheme, &validation,
+    keyHandle, keyPassword, signature);
+}
+
+
+
+/**********************************************************************
+ * Signs dataLen bytes of data with SHA-256. For unrestricted keys the
+ * digest is computed in software and sent with a NULL ticket, so the
+ * data never goes through the TPM. A restricted key only signs digests
+ * the TPM made itself (the ticket proves the data does not start with
+ * TPM_GENERATED_VALUE), so for those the TPM hashes all of the data
+ * and returns a ticket for hierarchy. keyPublic may be 0, the public
+ * area is then read from the TPM. Returns 1 on success, -1 on error.
+ **********************************************************************/
+int tpm20w_signDataWithSha256(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const TPM2B_PUBLIC   *keyPublic,
+  const unsigned char  *data,
+  size_t                dataLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  TPMI_RH_HIERARCHY     hierarchy,
+  TPMT_SIGNATURE       *signature)
+{
+  TPMI_ALG_HASH        halg = 0x000B; // SHA-256
+  TPM2B_PUBLIC         readPublic;
+  TPM2B_NAME           name;
+  TPMT_SIG_SCHEME      inScheme;
+  TPMT_TK_HASHCHECK    validation;
+  TPM2B_DIGEST         digest;
+  TPM2B_MAX_BUFFER     buffer;
+  TPM_ALG_ID           keyScheme;
+  TPMI_ALG_HASH        keySchemeHash;
+  UINT32               status;
+
+  memset(&inScheme, 0, sizeof(inScheme));
+
+  do
+  {
+    if (keyPublic == 0)
+    {
+      if (tpm20w_readPublicArea(sysContext, keyHandle, &readPublic, &name) != 0)
+        break;
+      keyPublic = &readPublic;
+    }
+
+    // A key with its own scheme must be used with that scheme
+    if (keyPublic->t.publicArea.type == TPM_ALG_ECC)
+    {
+      inScheme.scheme = TPM_ALG_ECDSA;
+      keyScheme = keyPublic->t.publicArea.parameters.eccDetail.scheme.scheme;
+      keySchemeHash = keyPublic->t.publicArea.parameters.eccDetail.scheme.details.ecdsa.hashAlg;
+    }
+    else if (keyPublic->t.publicArea.type == TPM_ALG_RSA)
+    {
+      inScheme.scheme = TPM_ALG_RSASSA;
+      keyScheme = keyPublic->t.publicArea.parameters.rsaDetail.scheme.scheme;
+      keySchemeHash = keyPublic->t.publicArea.parameters.rsaDetail.scheme.details.rsassa.hashAlg;
+    }
+    else
+    {
+      ERRFN("Key 0x%x is not a signing key.", keyHandle);
+      break;
+    }
+    if (keyScheme != TPM_ALG_NULL)
+    {
+      // ECDAA would need a TPM2_Commit first, ECSCHNORR/SM2 other details
+      if (keyScheme != TPM_ALG_ECDSA && keyScheme != TPM_ALG_RSASSA && keyScheme != TPM_ALG_RSAPSS)
+      {
+        ERRFN("Key 0x%x has unsupported signing scheme 0x%x.", keyHandle, keyScheme);
+        break;
+      }
+      if (keySchemeHash != halg)
+      {
+        ERRFN("Key 0x%x is bound to hash 0x%x.", keyHandle, keySchemeHash);
+        break;
+      }
+      inScheme.scheme = keyScheme;
+    }
+    // ecdsa and rsassa share the layout of the hash scheme details
+    inScheme.details.ecdsa.hashAlg = halg;
+
+    validation.tag = TPM_ST_HASHCHECK;
+    validation.hierarchy = TPM_RH_NULL;
+    validation.digest.t.size = 0;
+    digest.t.size = 0;
+
+    if (!keyPublic->t.publicArea.objectAttributes.restricted)
+    {
+      if (SHA256(data, dataLen, digest.t.buffer) == 0)
+      {
+        ERRFN("SHA-256 failed.");
+        break;
+      }
+      digest.t.size = SHA256_DIGEST_LENGTH;
+    }
+    else if (dataLen <= MAX_DIGEST_BUFFER)
+    {
+      // One TPM2_Hash is cheaper than a sequence for a single block. It
+      // has no authorization handle, so it is sent without sessions.
+      buffer.t.size = (UINT16) dataLen;
+      memcpy(buffer.t.buffer, data, dataLen);
+      digest.t.size = sizeof(digest.t.buffer);
+      if ((status = Tss2_Sys_Hash(sysContext, 0, &buffer, halg, hierarchy,
+          &digest, &validation, 0)) != TPM_RC_SUCCESS)
+      {
+        ERRFN("Tss2_Sys_Hash failed with error code 0x%x.", status);
+        break;
+      }
+    }
+    else if (computeDataHashTicket(sysContext, data, dataLen, halg, hierarchy, 1,
+      &digest, &validation) != 0)
+    {
+      ERRFN("TPM hash sequence failed.");
+      break;
+    }
+
+    return tpm20w_signDigest(sysContext, digest.t.buffer, digest.t.size, &inScheme,
+      &validation, keyHandle, keyPassword, signature);
+  } while (0);
+
+  return -1;
+}
+
+
+
+/**********************************************************************
+ * Signs nrDigests digests of digestLen bytes each (stored back to back
+ * in digests) with one key. The password session is set up once and
+ * the commands are pipelined over the given system contexts, each of
+ * which has one TPM2_Sign in flight at a time. results[i] is 1 if
+ * signatures[i] is valid. Returns the number of signatures made, or -1
+ * on a setup error.
+ **********************************************************************/
+int tpm20w_signEcdsaWithSha256Batch(
+  TSS2_SYS_CONTEXT    **sysContexts,
+  int                   nrContexts,
+  const unsigned char  *digests,
+  int                   digestLen,
+  int                   nrDigests,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  TPMT_SIGNATURE       *signatures,
+  int                  *results)
+{
+  TPM2B_DIGEST         digest = { {sizeof(TPM2B_DIGEST), } };
+  TPMT_SIG_SCHEME      inScheme;
+  TPMT_TK_HASHCHECK    validation;
+
+  TSS2_SYS_CMD_AUTHS   sessionsData;
+  TPMS_AUTH_COMMAND    sessionData;
+  TPMS_AUTH_COMMAND*   sessionDataArray[1];
+
+  int                  inFlight[TPM20W_BATCH_MAX_CONTEXTS];
+  int                  next = 0;
+  int                  pending = 0;
+  int                  signedCount = 0;
+  int                  i;
+  UINT32               status;
+
+  if (nrContexts < 1 || nrContexts > TPM20W_BATCH_MAX_CONTEXTS ||
+      digestLen < 1 || digestLen > (int) sizeof(digest.t.buffer))
+  {
+    ERRFN("Invalid batch parameters.");
+    return -1;
+  }
+
+  sessionDataArray[0] = &sessionData;
+  sessionsData.cmdAuths = &sessionDataArray[0];
+  sessionsData.cmdAuthsCount = 1;
+
+  sessionData.sessionHandle = TPM_RS_PW;
+  sessionData.nonce.t.size = 0;
+  *((UINT8 *)((void *)&sessionData.sessionAttributes)) = 0;
+
+  sessionData.hmac.t.size = sizeof(sessionData.hmac.t) - 2;
+  if ((status = str2ByteStructure(
+    keyPassword,
+    &sessionData.hmac.t.size,
+    sessionData.hmac.t.buffer)) != 0)
+  {
+    ERRFN("Error setting key password, returned 0x%x.", status);
+    return -1;
+  }
+
+  inScheme.scheme = TPM_ALG_ECDSA;
+  inScheme.details.ecdsa.hashAlg = TPM_ALG_SHA256;
+
+  validation.tag = TPM_ST_HASHCHECK;
+  validation.hierarchy = TPM_RH_NULL;
+  validation.digest.t.size = 0;
+
+  digest.t.size = digestLen;
+
+  for (i = 0; i < nrDigests; i++)
+  {
+    results[i] = -1;
+  }
+
+  while (next < nrDigests || pending > 0)
+  {
+    // Fill every idle context with the next digest
+    for (i = 0; i < nrContexts && next < nrDigests; i++)
+    {
+      if (pending & (1 << i))
+      {
+        continue;
+      }
+
+      memcpy(digest.t.buffer, digests + next * digestLen, digestLen);
+      if ((status = Tss2_Sys_Sign_Prepare(sysContexts[i], keyHandle, &digest, &inScheme, &validation)) != TSS2_RC_SUCCESS ||
+          (status = Tss2_Sys_SetCmdAuths(sysContexts[i], &sessionsData)) != TSS2_RC_SUCCESS ||
+          (status = Tss2_Sys_ExecuteAsync(sysContexts[i])) != TSS2_RC_SUCCESS)
+      {
+        ERRFN("Sending TPM2_Sign for digest %d failed with 0x%x.", next, status);
+        next++;
+        continue;
+      }
+      inFlight[i] = next++;
+      pending |= (1 << i);
+    }
+
+    // Collect the responses in submission order of the contexts
+    for (i = 0; i < nrContexts; i++)
+    {
+      if (!(pending & (1 << i)))
+      {
+        continue;
+      }
+      pending &= ~(1 << i);
+
+      if ((status = Tss2_Sys_ExecuteFinish(sysContexts[i], TSS2_TCTI_TIMEOUT_BLOCK)) != TSS2_RC_SUCCESS ||
+          (status = Tss2_Sys_Sign_Complete(sysContexts[i], &signatures[inFlight[i]])) != TSS2_RC_SUCCESS)
+      {
+        ERRFN("TPM2_Sign for digest %d failed with 0x%x.", inFlight[i], status);
+        continue;
+      }
+      results[inFlight[i]] = 1;
+      signedCount++;
+    }
+  }
+
+  OPENSSL_cleanse(&sessionData, sizeof(sessionData));
+  return signedCount;
+}
+
+
+
 int tpm20w_loadSigningKey(
+  TSS2_SYS_CONTEXT* sysContext,
   const char* parentFilePath,
   const char* parentPassword,
   const char* objectFilePath,
@@ -111,6 +602,7 @@ int tpm20w_loadSigningKey(
   TPMI_DH_OBJECT parentHandle;
   TPM2B_PUBLIC   inPublic;
   TPM2B_PRIVATE  inPrivate;
+  TPMS_AUTH_COMMAND sessionData;
   
   int status;
   int size;
@@ -182,11 +674,13 @@ int tpm20w_loadSigningKey(
     }
     
     if ((status = load(
+      sysContext,
       parentHandle,
       &inPublic,
       &inPrivate,
       nameStructureFilePath,
-      keyHandle)) != 0)
+      keyHandle,
+      &sessionData)) != 0)
     {
       ERRFN("Error loading object, returned 0x%x.", status);
       break;
@@ -202,12 +696,158 @@ int tpm20w_loadSigningKey(
 }
 
 
+/**********************************************************************
+ * Loads a sealed data object (files "public" and "private" in
+ * objectFilePath, as for tpm20w_loadSigningKey) under the parent whose
+ * context is saved in parentFilePath, unseals it into buffer and
+ * flushes both again. On entry *size is the size of buffer. Returns 1
+ * on success, -1 on error.
+ **********************************************************************/
+int tpm20w_unseal(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const char           *parentFilePath,
+  const char           *parentPassword,
+  const char           *objectFilePath,
+  const char           *objectPassword,
+  unsigned char        *buffer,
+  int                  *size)
+{
+  char                  nameStructureFilePath[128];
+  char                  publicComponentFilePath[128];
+  char                  privateComponentFilePath[128];
+  char                  contextParentFilePath[128];
+
+  TPMI_DH_OBJECT        parentHandle = 0;
+  TPM_HANDLE            objectHandle = 0;
+  TPM2B_PUBLIC          inPublic;
+  TPM2B_PRIVATE         inPrivate;
+  TPM2B_SENSITIVE_DATA  outData = { { sizeof(TPM2B_SENSITIVE_DATA), } };
+
+  TSS2_SYS_CMD_AUTHS    sessionsData;
+  TPMS_AUTH_COMMAND     sessionData;
+  TPMS_AUTH_RESPONSE    sessionDataOut;
+  TSS2_SYS_RSP_AUTHS    sessionsDataOut;
+  TPMS_AUTH_COMMAND*    sessionDataArray[1];
+  TPMS_AUTH_RESPONSE*   sessionDataOutArray[1];
+
+  UINT16                fileSize;
+  UINT32                status;
+  int                   result = -1;
+
+  memset(&inPublic,  0, sizeof(TPM2B_PUBLIC));
+  memset(&inPrivate, 0, sizeof(TPM2B_PRIVATE));
+
+  snprintf(contextParentFilePath,    sizeof(contextParentFilePath),    "%s/context", parentFilePath);
+  snprintf(nameStructureFilePath,    sizeof(nameStructureFilePath),    "%s/name",    objectFilePath);
+  snprintf(publicComponentFilePath,  sizeof(publicComponentFilePath),  "%s/public",  objectFilePath);
+  snprintf(privateComponentFilePath, sizeof(privateComponentFilePath), "%s/private", objectFilePath);
+
+  sessionDataArray[0] = &sessionData;
+  sessionsData.cmdAuths = &sessionDataArray[0];
+  sessionDataOutArray[0] = &sessionDataOut;
+  sessionsDataOut.rspAuths = &sessionDataOutArray[0];
+  sessionsDataOut.rspAuthsCount = 1;
+  sessionsData.cmdAuthsCount = 1;
+
+  do
+  {
+    fileSize = sizeof(inPublic);
+    if ((status = loadDataFromFile(publicComponentFilePath, (UINT8*) &inPublic, &fileSize)) != 0)
+    {
+      ERRFN("Error loading public part, returned 0x%x.", status);
+      break;
+    }
+    fileSize = sizeof(inPrivate);
+    if ((status = loadDataFromFile(privateComponentFilePath, (UINT8*) &inPrivate, &fileSize)) != 0)
+    {
+      ERRFN("Error loading private part, returned 0x%x.", status);
+      break;
+    }
+    if ((status = loadTpmContextFromFile(sysContext, &parentHandle, contextParentFilePath)) != 0)
+    {
+      ERRFN("Error loading parent context, returned 0x%x.", status);
+      parentHandle = 0;
+      break;
+    }
+
+    sessionData.hmac.t.size = sizeof(sessionData.hmac.t) - 2;
+    if ((status = str2ByteStructure(
+      parentPassword,
+      &sessionData.hmac.t.size,
+      sessionData.hmac.t.buffer)) != 0)
+    {
+      ERRFN("Error setting parent context password, returned 0x%x.", status);
+      break;
+    }
+    if ((status = load(
+      sysContext,
+      parentHandle,
+      &inPublic,
+      &inPrivate,
+      nameStructureFilePath,
+      &objectHandle,
+      &sessionData)) != 0)
+    {
+      ERRFN("Error loading sealed object, returned 0x%x.", status);
+      objectHandle = 0;
+      break;
+    }
+
+    // load() has set up a password session, only the password differs
+    sessionData.hmac.t.size = sizeof(sessionData.hmac.t) - 2;
+    if ((status = str2ByteStructure(
+      objectPassword,
+      &sessionData.hmac.t.size,
+      sessionData.hmac.t.buffer)) != 0)
+    {
+      ERRFN("Error setting object password, returned 0x%x.", status);
+      break;
+    }
+    if ((status = Tss2_Sys_Unseal(
+       sysContext,
+       objectHandle,
+      &sessionsData,
+      &outData,
+      &sessionsDataOut)) != TPM_RC_SUCCESS)
+    {
+      ERRFN("Tss2_Sys_Unseal failed with error code 0x%x.", status);
+      break;
+    }
+
+    if (outData.t.size > *size)
+    {
+      ERRFN("Sealed data too large (%d bytes).", outData.t.size);
+      break;
+    }
+    memcpy(buffer, outData.t.buffer, outData.t.size);
+    *size  = outData.t.size;
+    result = 1;
+  } while (0);
+
+  if (objectHandle != 0)
+  {
+    Tss2_Sys_FlushContext(sysContext, objectHandle);
+  }
+  if (parentHandle != 0)
+  {
+    Tss2_Sys_FlushContext(sysContext, parentHandle);
+  }
+
+  OPENSSL_cleanse(&outData, sizeof(outData));
+  OPENSSL_cleanse(&sessionData, sizeof(sessionData));
+  return result;
+}
+
+
+
 int load(
+  TSS2_SYS_CONTEXT     *sysContext,
   TPMI_DH_OBJECT        parentHandle,
   TPM2B_PUBLIC         *inPublic,
   TPM2B_PRIVATE        *inPrivate,
   const char           *outFileName,
-  TPM_HANDLE           *keyHandle)
+  TPM_HANDLE           *keyHandle,
+  TPMS_AUTH_COMMAND    *sessionData)  // carries the parent password
 {
   TPMS_AUTH_RESPONSE    sessionDataOut;
   TPMS_AUTH_COMMAND    *sessionDataArray[1];
@@ -220,7 +860,7 @@ int load(
 
   TPM2B_NAME            nameExt     = { { sizeof(TPM2B_NAME)-2, } };
 
-  sessionDataArray[0]    = &sessionData;
+  sessionDataArray[0]    = sessionData;
   sessionDataOutArray[0] = &sessionDataOut;
 
   // TSS2_SYS_CMD_AUTHS specifies the number of authorization areas for
@@ -237,10 +877,10 @@ int load(
   // handle TPM_RS_PW (0x40000009). This handle is used for plaintext
   // password authorization (as opposed to HMAC authorization).
   // [Arthur & Challener 2015, p. 99]
-  sessionData.sessionHandle = TPM_RS_PW;
-  sessionData.nonce.t.size  = 0;
+  sessionData->sessionHandle = TPM_RS_PW;
+  sessionData->nonce.t.size  = 0;
 
-  *((UINT8 *)((void *)&sessionData.sessionAttributes)) = 0;
+  *((UINT8 *)((void *)&sessionData->sessionAttributes)) = 0;
 
   rval = Tss2_Sys_Load(
      sysContext,
@@ -269,18 +909,19 @@ int load(
 
 
 
-int tpm20w_readPublic(
+/**********************************************************************
+ * Reads the public area and the name of a loaded or persistent object.
+ **********************************************************************/
+int tpm20w_readPublicArea(
+  TSS2_SYS_CONTEXT      *sysContext,
   const TPMI_DH_OBJECT   objectHandle,
-  EC_KEY               **ecKey
+  TPM2B_PUBLIC          *key,
+  TPM2B_NAME            *name
 )
 {
-  BIGNUM              *x;
-  BIGNUM              *y;
-  TPM2B_PUBLIC         key = { { 0, } };  
   TPMS_AUTH_RESPONSE   sessionDataOut;
   TSS2_SYS_RSP_AUTHS   sessionsDataOut;
   TPMS_AUTH_RESPONSE  *sessionDataOutArray[1];
-  TPM2B_NAME           name          = { { sizeof(TPM2B_NAME)-2, } };
   TPM2B_NAME           qualifiedName = { { sizeof(TPM2B_NAME)-2, } };
   UINT32               status;
 
@@ -288,12 +929,15 @@ int tpm20w_readPublic(
   sessionsDataOut.rspAuths = &sessionDataOutArray[0];
   sessionsDataOut.rspAuthsCount = 1;
 
+  key->t.size  = 0;
+  name->t.size = sizeof(TPM2B_NAME)-2;
+
   if ((status = Tss2_Sys_ReadPublic(
      sysContext,
      objectHandle,
      0,
-    &key,
-    &name,
+     key,
+     name,
     &qualifiedName,
     &sessionsDataOut
   )) != TPM_RC_SUCCESS)
@@ -301,23 +945,84 @@ int tpm20w_readPublic(
     ERRFN("TPM2_ReadPublic error: status = 0x%0x", status);
     return -1;
   }
-    
+
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Builds an OpenSSL EC_KEY from the public area of a TPM ECC key.
+ **********************************************************************/
+int tpm20w_publicToEcKey(
+  const TPM2B_PUBLIC    *key,
+  EC_KEY               **ecKey
+)
+{
+  BIGNUM  *x;
+  BIGNUM  *y;
+  int      nid;
+  int      status = -1;
+
+  switch (key->t.publicArea.parameters.eccDetail.curveID)
+  {
+    case TPM_ECC_NIST_P256: nid = NID_X9_62_prime256v1; break;
+    case TPM_ECC_NIST_P384: nid = NID_secp384r1;        break;
+    case TPM_ECC_NIST_P521: nid = NID_secp521r1;        break;
+    default:
+      ERRFN("Unsupported curve 0x%x.", key->t.publicArea.parameters.eccDetail.curveID);
+      return -1;
+  }
+
   x = BN_bin2bn(
-    key.t.publicArea.unique.ecc.x.t.buffer,
-    key.t.publicArea.unique.ecc.x.t.size,
+    key->t.publicArea.unique.ecc.x.t.buffer,
+    key->t.publicArea.unique.ecc.x.t.size,
     NULL);
   y = BN_bin2bn(
-    key.t.publicArea.unique.ecc.y.t.buffer,
-    key.t.publicArea.unique.ecc.y.t.size,
+    key->t.publicArea.unique.ecc.y.t.buffer,
+    key->t.publicArea.unique.ecc.y.t.size,
     NULL);
-    
-  DBGFN("len(X) = 0x%x", key.t.publicArea.unique.ecc.x.t.size);
 
-  *ecKey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-  // Specify the named curve name instead of all parameters explicitly
-  // because in OpenSSL version < 1.1 explicit form is default).
-  EC_KEY_set_asn1_flag(*ecKey, OPENSSL_EC_NAMED_CURVE);
-  EC_KEY_set_public_key_affine_coordinates(*ecKey, x, y);
-  
-  return 0;
+  DBGFN("len(X) = 0x%x", key->t.publicArea.unique.ecc.x.t.size);
+
+  if (x != NULL && y != NULL &&
+      (*ecKey = EC_KEY_new_by_curve_name(nid)) != NULL)
+  {
+    // Specify the named curve name instead of all parameters explicitly
+    // because in OpenSSL version < 1.1 explicit form is default).
+    EC_KEY_set_asn1_flag(*ecKey, OPENSSL_EC_NAMED_CURVE);
+    if (EC_KEY_set_public_key_affine_coordinates(*ecKey, x, y))
+    {
+      status = 0;
+    }
+    else
+    {
+      ERRFN("Public point is not on the curve.");
+      EC_KEY_free(*ecKey);
+      *ecKey = NULL;
+    }
+  }
+
+  BN_free(x);
+  BN_free(y);
+  return status;
+}
+
+
+
+int tpm20w_readPublic(
+  TSS2_SYS_CONTEXT      *sysContext,
+  const TPMI_DH_OBJECT   objectHandle,
+  EC_KEY               **ecKey
+)
+{
+  TPM2B_PUBLIC  key;
+  TPM2B_NAME    name;
+
+  if (tpm20w_readPublicArea(sysContext, objectHandle, &key, &name) != 0)
+  {
+    return -1;
+  }
+
+  return tpm20w_publicToEcKey(&key, ecKey);
 }
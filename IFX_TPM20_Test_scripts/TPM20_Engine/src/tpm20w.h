@@ -21,14 +21,28 @@
 
 #endif
 
+#define TPM20W_BATCH_MAX_CONTEXTS (16) /* Commands in flight in a batch */
+
 int tpm20w_loadSigningKey(
+  TSS2_SYS_CONTEXT  *sysContext,
   const char  *parentFilePath,
   const char  *parentPassword,
   const char  *objectFilePath,
   TPM_HANDLE  *keyHandle
 );
 
+int tpm20w_unseal(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const char           *parentFilePath,
+  const char           *parentPassword,
+  const char           *objectFilePath,
+  const char           *objectPassword,
+  unsigned char        *buffer,
+  int                  *size
+);
+
 int tpm20w_signEcdsaWithSha256(
+  TSS2_SYS_CONTEXT     *sysContext,
   const unsigned char  *digestBytes,
   int                   digestLen,
   TPMI_DH_OBJECT        keyHandle,
@@ -36,7 +50,77 @@ int tpm20w_signEcdsaWithSha256(
   TPMT_SIGNATURE       *signature
 );
 
+int tpm20w_signEcdsaWithSha256Prepare(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const unsigned char  *digestBytes,
+  int                   digestLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword
+);
+
+int tpm20w_signEcdaaWithSha256Prepare(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const unsigned char  *digestBytes,
+  int                   digestLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  UINT16                counter
+);
+
+int tpm20w_commit(
+  TSS2_SYS_CONTEXT     *sysContext,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  UINT16               *counter
+);
+
+int tpm20w_signEcdaaWithSha256(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const unsigned char  *digestBytes,
+  int                   digestLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  UINT16                counter,
+  TPMT_SIGNATURE       *signature
+);
+
+int tpm20w_signDataWithSha256(
+  TSS2_SYS_CONTEXT     *sysContext,
+  const TPM2B_PUBLIC   *keyPublic,
+  const unsigned char  *data,
+  size_t                dataLen,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  TPMI_RH_HIERARCHY     hierarchy,
+  TPMT_SIGNATURE       *signature
+);
+
+int tpm20w_signEcdsaWithSha256Batch(
+  TSS2_SYS_CONTEXT    **sysContexts,
+  int                   nrContexts,
+  const unsigned char  *digests,
+  int                   digestLen,
+  int                   nrDigests,
+  TPMI_DH_OBJECT        keyHandle,
+  const char           *keyPassword,
+  TPMT_SIGNATURE       *signatures,
+  int                  *results
+);
+
+int tpm20w_readPublicArea(
+  TSS2_SYS_CONTEXT       *sysContext,
+  const TPMI_DH_OBJECT    objectHandle,
+  TPM2B_PUBLIC           *key,
+  TPM2B_NAME             *name
+);
+
+int tpm20w_publicToEcKey(
+  const TPM2B_PUBLIC     *key,
+  EC_KEY                **ecKey
+);
+
 int tpm20w_readPublic(
+  TSS2_SYS_CONTEXT       *sysContext,
   const TPMI_DH_OBJECT    objectHandle,
   EC_KEY                **ecKey
 );
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tssconn.h"
+#include "syscontext.h"
+#include "sample.h"
+#include "tpm20w.h"
+
+
+
+/**********************************************************************
+ * Describes the connection endpoint for log messages.
+ **********************************************************************/
+static const char* tssconn_describe(
+  TSS_CONN  *conn,
+  char      *buffer,
+  size_t     size)
+{
+  if (conn->devicePath != NULL)
+  {
+    return conn->devicePath;
+  }
+  snprintf(buffer, size, "%s:%d", conn->hostName, conn->port);
+  return buffer;
+}
+
+
+
+/**********************************************************************
+ * Sets up the socket or device TCTI context of the connection.
+ **********************************************************************/
+static TSS2_RC tssconn_initTcti(
+  TSS_CONN  *conn,
+  size_t    *size)
+{
+  TCTI_SOCKET_CONF  socketConfig;
+  TCTI_DEVICE_CONF  deviceConfig;
+
+  if (conn->devicePath != NULL)
+  {
+    memset(&deviceConfig, 0, sizeof(deviceConfig));
+    deviceConfig.device_path = conn->devicePath;
+    return InitDeviceTcti(conn->tctiContext, size, &deviceConfig);
+  }
+
+  memset(&socketConfig, 0, sizeof(socketConfig));
+  socketConfig.hostname = conn->hostName;
+  socketConfig.port     = conn->port;
+  if (conn->async)
+  {
+    return InitAsyncSocketTcti(conn->tctiContext, size, &socketConfig);
+  }
+  return InitSocketTcti(conn->tctiContext, size, &socketConfig, 0);
+}
+
+
+
+/**********************************************************************
+ * Opens the TCTI and system context of the connection. Returns 0 on
+ * success (or if the connection is already open), -1 otherwise.
+ * Unlike prepareTest() this never exits the calling process.
+ **********************************************************************/
+int tssconn_open(
+  TSS_CONN  *conn)
+{
+  size_t            size;
+  TSS2_RC           rval;
+  char              name[128];
+
+  if (conn->connected)
+  {
+    return 0;
+  }
+
+  DBGFN("Connecting to %s.", tssconn_describe(conn, name, sizeof(name)));
+
+  while (1)
+  {
+    conn->tctiContext = NULL;
+    if ((rval = tssconn_initTcti(conn, &size)) != TSS2_RC_SUCCESS)
+    {
+      ERRFN("Could not get TCTI context size, returned 0x%x.", rval);
+      break;
+    }
+
+    if ((conn->tctiContext = (TSS2_TCTI_CONTEXT*) malloc(size)) == NULL)
+    {
+      ERRFN("Out of memory for TCTI context.");
+      break;
+    }
+
+    if ((rval = tssconn_initTcti(conn, &size)) != TSS2_RC_SUCCESS)
+    {
+      ERRFN("TPM at %s not reachable, returned 0x%x.",
+        tssconn_describe(conn, name, sizeof(name)), rval);
+      free(conn->tctiContext);
+      conn->tctiContext = NULL;
+      break;
+    }
+
+    if ((conn->sysContext = InitSysContext(0, conn->tctiContext, &abiVersion)) == NULL)
+    {
+      ERRFN("InitSysContext failed.");
+      tss2_tcti_finalize(conn->tctiContext);
+      free(conn->tctiContext);
+      conn->tctiContext = NULL;
+      break;
+    }
+
+    // always send simulator platform command to RM,
+    // will be ignored if RM not on simulator.
+    // A device has no platform channel.
+    if (conn->async)
+    {
+      tctiasync_platformCommand(conn->hostName, conn->port + 1, MS_SIM_POWER_ON);
+      tctiasync_platformCommand(conn->hostName, conn->port + 1, MS_SIM_NV_ON);
+    }
+    else if (conn->devicePath == NULL)
+    {
+      PlatformCommand(conn->tctiContext, MS_SIM_POWER_ON);
+      PlatformCommand(conn->tctiContext, MS_SIM_NV_ON);
+    }
+
+    conn->connected = 1;
+    return 0;
+  }
+
+  return -1;
+}
+
+
+
+void tssconn_close(
+  TSS_CONN  *conn)
+{
+  if (!conn->connected)
+  {
+    return;
+  }
+
+  DBGFN("Closing connection to %s.", conn->devicePath ? conn->devicePath : conn->hostName);
+
+  TeardownSysContext(&conn->sysContext);
+  FlushSysContexts(conn->tctiContext); /* helpers may have cached some */
+  tss2_tcti_finalize(conn->tctiContext);
+  free(conn->tctiContext);
+  conn->tctiContext = NULL;
+  conn->connected   = 0;
+}
+
+
+
+/**********************************************************************
+ * Health check: sends a cheap command (TPM2_GetCapability for the
+ * manufacturer property) over the connection. Returns the TSS return
+ * code, i.e. TSS2_RC_SUCCESS if the TPM answered.
+ **********************************************************************/
+int tssconn_check(
+  TSS_CONN  *conn)
+{
+  TPMI_YES_NO           moreData;
+  TPMS_CAPABILITY_DATA  capabilityData;
+
+  if (!conn->connected)
+  {
+    return TSS2_TCTI_RC_NO_CONNECTION;
+  }
+
+  return Tss2_Sys_GetCapability(
+    conn->sysContext,
+    0,
+    TPM_CAP_TPM_PROPERTIES,
+    TPM_PT_MANUFACTURER,
+    1,
+    &moreData,
+    &capabilityData,
+    0);
+}
+
+
+
+int tssconn_isTctiError(
+  TSS2_RC  rval)
+{
+  return (rval & TSS2_ERROR_LEVEL_MASK) == TSS2_TCTI_ERROR_LEVEL;
+}
+
+
+
+/**********************************************************************
+ * Called after a TPM operation on the connection failed. If the
+ * connection itself is broken (the health check fails on TCTI level),
+ * it is re-established. Returns 1 if the connection was re-established
+ * and the failed operation is worth a retry, 0 otherwise.
+ **********************************************************************/
+int tssconn_recover(
+  TSS_CONN  *conn)
+{
+  TSS2_RC  rval;
+  char     name[128];
+
+  if (conn->connected &&
+      !tssconn_isTctiError(rval = tssconn_check(conn)))
+  {
+    DBGFN("Connection is healthy (0x%x), nothing to recover.", rval);
+    return 0;
+  }
+
+  ERRFN("Connection to %s broken, reconnecting.", tssconn_describe(conn, name, sizeof(name)));
+  tssconn_close(conn);
+
+  if (tssconn_open(conn) != 0 ||
+      tssconn_check(conn) != TSS2_RC_SUCCESS)
+  {
+    ERRFN("Reconnect to %s failed.", tssconn_describe(conn, name, sizeof(name)));
+    tssconn_close(conn);
+    return 0;
+  }
+
+  conn->reconnects++;
+  return 1;
+}
@@ -0,0 +1,51 @@
+#ifndef _TSSCONN_H_
+#define _TSSCONN_H_
+
+#include <sapi/tpm20.h>
+#include <tcti/tcti_socket.h>
+#include <tcti/tcti_device.h>
+
+#include "tctiasync.h"
+
+/*
+ * A long-lived connection to the TPM (resource manager), i.e. a TCTI
+ * context together with the system context that is bound to it.
+ * The connection is opened once and reused for all TPM commands; after a
+ * TCTI error it is torn down and re-established by tssconn_recover().
+ * With a devicePath, the device TCTI talks to the kernel (e.g. the
+ * in-kernel resource manager /dev/tpmrm0) instead of a socket. With
+ * async set, the non-blocking socket TCTI is used so that commands can
+ * be completed from an event loop (see tssloop.h).
+ */
+typedef struct {
+  const char         *hostName;
+  int                 port;
+  const char         *devicePath;  /* NULL: socket TCTI to hostName:port */
+  int                 async;       /* Socket only: InitAsyncSocketTcti   */
+  TSS2_TCTI_CONTEXT  *tctiContext;
+  TSS2_SYS_CONTEXT   *sysContext;
+  int                 connected;
+  unsigned long       reconnects;
+} TSS_CONN;
+
+int tssconn_open(
+  TSS_CONN  *conn
+);
+
+void tssconn_close(
+  TSS_CONN  *conn
+);
+
+int tssconn_check(
+  TSS_CONN  *conn
+);
+
+int tssconn_recover(
+  TSS_CONN  *conn
+);
+
+int tssconn_isTctiError(
+  TSS2_RC  rval
+);
+
+#endif
@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include "tssloop.h"
+#include "tpm20w.h"
+
+typedef struct TSSLOOP_OP_S {
+  TSS_CONN              *conn;
+  TSSLOOP_CALLBACK       callback;
+  void                  *arg;
+  int                    fd;
+  struct TSSLOOP_OP_S   *prev;
+  struct TSSLOOP_OP_S   *next;
+} TSSLOOP_OP;
+
+static void* tssloop_thread(
+  void  *arg
+);
+
+
+
+/**********************************************************************
+ * Returns the epoll events the TCTI of the connection waits for, or 0
+ * if it has no poll handle (not an async connection).
+ **********************************************************************/
+static UINT32 tssloop_pollEvents(
+  TSS_CONN  *conn,
+  int       *fd)
+{
+  TSS2_TCTI_POLL_HANDLE  handle;
+  size_t                 nrHandles = 1;
+
+  if (tss2_tcti_get_poll_handles(conn->tctiContext, &handle, &nrHandles) != TSS2_RC_SUCCESS ||
+      nrHandles != 1)
+  {
+    return 0;
+  }
+
+  *fd = handle.fd;
+  return EPOLLONESHOT |
+    ((handle.events & POLLOUT) ? EPOLLOUT : 0) |
+    ((handle.events & POLLIN) ? EPOLLIN : 0);
+}
+
+
+
+/**********************************************************************
+ * Removes op from the operations in flight. Called with the mutex held.
+ **********************************************************************/
+static void tssloop_unlink(
+  TSS_LOOP    *loop,
+  TSSLOOP_OP  *op)
+{
+  if (op->prev != NULL)
+  {
+    op->prev->next = op->next;
+  }
+  else
+  {
+    loop->ops = op->next;
+  }
+  if (op->next != NULL)
+  {
+    op->next->prev = op->prev;
+  }
+  if (--loop->inFlight == 0)
+  {
+    pthread_cond_broadcast(&loop->idle);
+  }
+}
+
+
+
+/**********************************************************************
+ * Returns 0 on success.
+ **********************************************************************/
+int tssloop_init(
+  TSS_LOOP  *loop)
+{
+  struct epoll_event  event;
+
+  memset(loop, 0, sizeof(TSS_LOOP));
+  loop->wakePipe[0] = loop->wakePipe[1] = -1;
+
+  if ((loop->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    ERRFN("Could not create epoll instance (errno %d).", errno);
+    return -1;
+  }
+
+  if (pipe(loop->wakePipe) != 0)
+  {
+    ERRFN("Could not create wake-up pipe (errno %d).", errno);
+    close(loop->epollFd);
+    loop->epollFd = -1;
+    loop->wakePipe[0] = loop->wakePipe[1] = -1;
+    return -1;
+  }
+  fcntl(loop->wakePipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(loop->wakePipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(loop->wakePipe[1], F_SETFD, FD_CLOEXEC);
+
+  // The wake-up pipe is the only event without an operation
+  memset(&event, 0, sizeof(event));
+  event.events   = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakePipe[0], &event);
+
+  pthread_mutex_init(&loop->mutex, NULL);
+  pthread_cond_init(&loop->idle, NULL);
+  return 0;
+}
+
+
+
+void tssloop_destroy(
+  TSS_LOOP  *loop)
+{
+  tssloop_stop(loop);
+
+  if (loop->epollFd >= 0)
+  {
+    pthread_cond_destroy(&loop->idle);
+    pthread_mutex_destroy(&loop->mutex);
+    close(loop->wakePipe[0]);
+    close(loop->wakePipe[1]);
+    close(loop->epollFd);
+    loop->epollFd = -1;
+  }
+}
+
+
+
+int tssloop_start(
+  TSS_LOOP  *loop)
+{
+  if (loop->running)
+  {
+    return 0;
+  }
+  if (loop->epollFd < 0)
+  {
+    return -1;
+  }
+
+  loop->running = 1;
+  loop->dead    = 0;
+  if (pthread_create(&loop->thread, NULL, tssloop_thread, loop) != 0)
+  {
+    ERRFN("Could not start TSS event loop.");
+    loop->running = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Waits for the commands in flight to complete, then stops the loop
+ * thread. Submitters must be stopped before. A dead loop has failed
+ * its commands already and only needs to be joined.
+ **********************************************************************/
+void tssloop_stop(
+  TSS_LOOP  *loop)
+{
+  const char  event = 1;
+  int         dead;
+
+  if (!loop->running)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&loop->mutex);
+  while (loop->inFlight > 0 && !loop->dead)
+  {
+    pthread_cond_wait(&loop->idle, &loop->mutex);
+  }
+  loop->running = 0;
+  dead          = loop->dead;
+  pthread_mutex_unlock(&loop->mutex);
+
+  if (!dead && write(loop->wakePipe[1], &event, 1) != 1)
+  {
+    ERRFN("Could not wake up TSS event loop (errno %d).", errno);
+  }
+  pthread_join(loop->thread, NULL);
+}
+
+
+
+/**********************************************************************
+ * Sends the command prepared in the system context of conn (i.e. after
+ * Tss2_Sys_*_Prepare and Tss2_Sys_SetCmdAuths) and returns at once;
+ * callback is run when the response is in. The connection must stay
+ * checked out until then. Returns TSS2_RC_SUCCESS if the command is in
+ * flight, otherwise the error and the callback is not run.
+ **********************************************************************/
+TSS2_RC tssloop_submit(
+  TSS_LOOP          *loop,
+  TSS_CONN          *conn,
+  TSSLOOP_CALLBACK   callback,
+  void              *arg)
+{
+  TSSLOOP_OP          *op;
+  struct epoll_event   event;
+  TSS2_RC              rval;
+
+  if (!loop->running || !conn->async)
+  {
+    return TSS2_TCTI_RC_BAD_CONTEXT;
+  }
+
+  if ((op = (TSSLOOP_OP*) malloc(sizeof(TSSLOOP_OP))) == NULL)
+  {
+    ERRFN("Out of memory for TSS operation.");
+    return TSS2_TCTI_RC_GENERAL_FAILURE;
+  }
+  op->conn     = conn;
+  op->callback = callback;
+  op->arg      = arg;
+
+  if ((rval = Tss2_Sys_ExecuteAsync(conn->sysContext)) != TSS2_RC_SUCCESS)
+  {
+    free(op);
+    return rval;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.data.ptr = op;
+  if ((event.events = tssloop_pollEvents(conn, &op->fd)) == 0)
+  {
+    free(op);
+    return TSS2_TCTI_RC_BAD_CONTEXT;
+  }
+
+  pthread_mutex_lock(&loop->mutex);
+  if (loop->dead)
+  {
+    pthread_mutex_unlock(&loop->mutex);
+    free(op);
+    return TSS2_TCTI_RC_IO_ERROR;
+  }
+  op->prev = NULL;
+  op->next = (TSSLOOP_OP*) loop->ops;
+  if (op->next != NULL)
+  {
+    op->next->prev = op;
+  }
+  loop->ops = op;
+  loop->inFlight++;
+
+  // From here on the loop thread may complete the operation
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, op->fd, &event) != 0)
+  {
+    ERRFN("Could not watch TCTI socket (errno %d).", errno);
+    tssloop_unlink(loop, op);
+    pthread_mutex_unlock(&loop->mutex);
+    free(op);
+    return TSS2_TCTI_RC_IO_ERROR;
+  }
+  pthread_mutex_unlock(&loop->mutex);
+
+  return TSS2_RC_SUCCESS;
+}
+
+
+
+/**********************************************************************
+ * Reads the response of op if it is complete. Returns 1 if the
+ * operation is done (the callback has run), 0 if it waits for more.
+ **********************************************************************/
+static int tssloop_finish(
+  TSS_LOOP    *loop,
+  TSSLOOP_OP  *op)
+{
+  struct epoll_event  event;
+  TSS2_RC             rval;
+
+  rval = Tss2_Sys_ExecuteFinish(op->conn->sysContext, 0);
+
+  memset(&event, 0, sizeof(event));
+  event.data.ptr = op;
+  if (rval == TSS2_TCTI_RC_TRY_AGAIN &&
+      (event.events = tssloop_pollEvents(op->conn, &op->fd)) != 0 &&
+      epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, op->fd, &event) == 0)
+  {
+    return 0;
+  }
+
+  epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, op->fd, &event);
+  if (rval == TSS2_TCTI_RC_TRY_AGAIN)
+  {
+    rval = TSS2_TCTI_RC_IO_ERROR;
+  }
+  op->callback(op->conn, rval, op->arg);
+  return 1;
+}
+
+
+
+/**********************************************************************
+ * Called when the loop cannot wait any more: marks it dead and fails
+ * every operation in flight, so that neither their submitters nor
+ * tssloop_stop wait for responses that are never read.
+ **********************************************************************/
+static void tssloop_failAll(
+  TSS_LOOP  *loop)
+{
+  struct epoll_event   event;
+  TSSLOOP_OP          *op;
+  TSSLOOP_OP          *next;
+
+  pthread_mutex_lock(&loop->mutex);
+  loop->dead     = 1;
+  op             = (TSSLOOP_OP*) loop->ops;
+  loop->ops      = NULL;
+  loop->inFlight = 0;
+  pthread_cond_broadcast(&loop->idle);
+  pthread_mutex_unlock(&loop->mutex);
+
+  memset(&event, 0, sizeof(event));
+  for (; op != NULL; op = next)
+  {
+    next = op->next;
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, op->fd, &event);
+    op->callback(op->conn, TSS2_TCTI_RC_IO_ERROR, op->arg);
+    free(op);
+  }
+}
+
+
+
+static void* tssloop_thread(
+  void  *arg)
+{
+  TSS_LOOP            *loop = (TSS_LOOP*) arg;
+  struct epoll_event   events[TSSLOOP_MAX_EVENTS];
+  char                 drain[16];
+  int                  nrEvents;
+  int                  i;
+
+  DBGFN("TSS event loop started.");
+
+  while (1)
+  {
+    if ((nrEvents = epoll_wait(loop->epollFd, events, TSSLOOP_MAX_EVENTS, -1)) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      ERRFN("epoll_wait failed (errno %d).", errno);
+      tssloop_failAll(loop);
+      break;
+    }
+
+    for (i = 0; i < nrEvents; i++)
+    {
+      if (events[i].data.ptr == NULL)
+      {
+        while (read(loop->wakePipe[0], drain, sizeof(drain)) > 0)
+          ;
+        continue;
+      }
+      if (tssloop_finish(loop, (TSSLOOP_OP*) events[i].data.ptr))
+      {
+        pthread_mutex_lock(&loop->mutex);
+        tssloop_unlink(loop, (TSSLOOP_OP*) events[i].data.ptr);
+        pthread_mutex_unlock(&loop->mutex);
+        free(events[i].data.ptr);
+      }
+    }
+
+    pthread_mutex_lock(&loop->mutex);
+    if (!loop->running && loop->inFlight == 0)
+    {
+      pthread_mutex_unlock(&loop->mutex);
+      break;
+    }
+    pthread_mutex_unlock(&loop->mutex);
+  }
+
+  DBGFN("TSS event loop stopped.");
+  return NULL;
+}
@@ -0,0 +1,65 @@
+#ifndef _TSSLOOP_H_
+#define _TSSLOOP_H_
+
+#include <pthread.h>
+
+#include "tssconn.h"
+
+#define TSSLOOP_MAX_EVENTS (16) /* Events handled per epoll_wait */
+
+/*
+ * Called on the loop thread when the response of a submitted command is
+ * in (rval TSS2_RC_SUCCESS, read the output with Tss2_Sys_*_Complete)
+ * or the command failed. Must not block: the connection is still owned
+ * by the submitter and is typically released from here.
+ */
+typedef void (*TSSLOOP_CALLBACK)(
+  TSS_CONN  *conn,
+  TSS2_RC    rval,
+  void      *arg
+);
+
+/*
+ * One thread that waits on the sockets of all connections with a command
+ * in flight (epoll) and finishes each command as soon as its response
+ * arrives. Submitters do not wait for the TPM, so with N connections N
+ * commands overlap at the resource manager with a single thread. Needs
+ * connections with the async TCTI (TSS_CONN.async). If waiting fails,
+ * the loop fails every command in flight and refuses new ones (dead).
+ */
+typedef struct {
+  int               epollFd;
+  int               wakePipe[2];
+  pthread_t         thread;
+  int               running;
+  int               dead;
+  int               inFlight;
+  void             *ops;          /* Operations in flight */
+  pthread_mutex_t   mutex;
+  pthread_cond_t    idle;
+} TSS_LOOP;
+
+int tssloop_init(
+  TSS_LOOP  *loop
+);
+
+void tssloop_destroy(
+  TSS_LOOP  *loop
+);
+
+int tssloop_start(
+  TSS_LOOP  *loop
+);
+
+void tssloop_stop(
+  TSS_LOOP  *loop
+);
+
+TSS2_RC tssloop_submit(
+  TSS_LOOP          *loop,
+  TSS_CONN          *conn,
+  TSSLOOP_CALLBACK   callback,
+  void              *arg
+);
+
+#endif
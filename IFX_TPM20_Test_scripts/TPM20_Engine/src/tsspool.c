@@ -0,0 +1,545 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsspool.h"
+#include "tpm20w.h"
+
+
+
+/**********************************************************************
+ * Connections class cls may hold at most. Called with the mutex held.
+ **********************************************************************/
+static int tsspool_classLimit(
+  TSS_POOL  *pool,
+  int        cls)
+{
+  return (pool->limit[cls] == 0 || pool->limit[cls] > pool->size) ? pool->size : pool->limit[cls];
+}
+
+
+
+/**********************************************************************
+ * Returns the free slot to check out (connected ones first), or -1.
+ * Called with the mutex held.
+ **********************************************************************/
+static int tsspool_freeSlot(
+  TSS_POOL  *pool)
+{
+  int slot = -1;
+  int i;
+
+  for (i = 0; i < pool->size; i++)
+  {
+    if (!pool->busy[i])
+    {
+      if (pool->conns[i].connected)
+      {
+        return i;
+      }
+      if (slot < 0)
+      {
+        slot = i;
+      }
+    }
+  }
+  return slot;
+}
+
+
+
+/**********************************************************************
+ * Whether a waiter of class cls is next in line: below its limit and
+ * no higher class waits that could take a connection. Called with the
+ * mutex held.
+ **********************************************************************/
+static int tsspool_isTurn(
+  TSS_POOL  *pool,
+  int        cls)
+{
+  int i;
+
+  if (pool->active[cls] >= tsspool_classLimit(pool, cls))
+  {
+    return 0;
+  }
+  for (i = 0; i < cls; i++)
+  {
+    if (pool->waiting[i] > 0 && pool->active[i] < tsspool_classLimit(pool, i))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+
+/**********************************************************************
+ * Wakes up a waiter of the highest class that can take a free
+ * connection. Called with the mutex held.
+ **********************************************************************/
+static void tsspool_wakeNext(
+  TSS_POOL  *pool)
+{
+  int i;
+
+  if (tsspool_freeSlot(pool) < 0)
+  {
+    return;
+  }
+  for (i = 0; i < TSSPOOL_NR_CLASSES; i++)
+  {
+    if (pool->waiting[i] > 0 && pool->active[i] < tsspool_classLimit(pool, i))
+    {
+      pthread_cond_signal(&pool->ready[i]);
+      return;
+    }
+  }
+}
+
+
+
+static void tsspool_wakeAll(
+  TSS_POOL  *pool)
+{
+  int i;
+
+  for (i = 0; i < TSSPOOL_NR_CLASSES; i++)
+  {
+    pthread_cond_broadcast(&pool->ready[i]);
+  }
+}
+
+
+
+static int tsspool_isPast(
+  const struct timespec  *deadline)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec > deadline->tv_sec ||
+    (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+
+
+void tsspool_init(
+  TSS_POOL    *pool,
+  const char  *hostName,
+  int          port,
+  int          size)
+{
+  int i;
+
+  memset(pool, 0, sizeof(TSS_POOL));
+
+  for (i = 0; i < TSSPOOL_MAX_SIZE; i++)
+  {
+    pool->conns[i].hostName = hostName;
+    pool->conns[i].port     = port;
+  }
+  pool->size = size;
+  pool->limit[TSSPOOL_CLASS_BACKGROUND] = TSSPOOL_DEFAULT_BACKGROUND_LIMIT;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  for (i = 0; i < TSSPOOL_NR_CLASSES; i++)
+  {
+    pthread_cond_init(&pool->ready[i], NULL);
+  }
+}
+
+
+
+void tsspool_destroy(
+  TSS_POOL  *pool)
+{
+  int i;
+
+  tsspool_close(pool);
+
+  for (i = 0; i < TSSPOOL_NR_CLASSES; i++)
+  {
+    pthread_cond_destroy(&pool->ready[i]);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+}
+
+
+
+/**********************************************************************
+ * Allows checkouts. If eager, opens and checks the first connection,
+ * so that a missing TPM is reported at engine init. Returns 0 on
+ * success.
+ **********************************************************************/
+int tsspool_open(
+  TSS_POOL  *pool,
+  int        eager)
+{
+  TSS_CONN  *conn;
+  int        status = -1;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->open = 1;
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (!eager)
+  {
+    return 0;
+  }
+
+  if ((conn = tsspool_acquire(pool, TSSPOOL_CLASS_FOREGROUND, NULL)) != NULL)
+  {
+    if (tssconn_check(conn) == TSS2_RC_SUCCESS || tssconn_recover(conn))
+    {
+      status = 0;
+    }
+    tsspool_release(pool, conn);
+  }
+
+  if (status != 0)
+  {
+    tsspool_close(pool);
+  }
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Stops further checkouts and closes all idle connections. Connections
+ * that are still checked out are closed when they are released.
+ **********************************************************************/
+void tsspool_close(
+  TSS_POOL  *pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->open = 0;
+  for (i = 0; i < TSSPOOL_MAX_SIZE; i++)
+  {
+    if (!pool->busy[i])
+    {
+      tssconn_close(&pool->conns[i]);
+    }
+  }
+  tsspool_wakeAll(pool);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+
+
+/**********************************************************************
+ * Whether the TCTI is a TPM device that only one process or connection
+ * can open at a time, i.e. anything but the kernel resource manager
+ * (/dev/tpmrm*). Called with the mutex held.
+ **********************************************************************/
+static int tsspool_isExclusive(
+  TSS_POOL  *pool)
+{
+  const char  *name;
+
+  if (pool->conns[0].devicePath == NULL)
+  {
+    return 0;
+  }
+  name = strrchr(pool->conns[0].devicePath, '/');
+  name = (name != NULL) ? name + 1 : pool->conns[0].devicePath;
+  return strncmp(name, "tpmrm", 5) != 0;
+}
+
+
+
+/**********************************************************************
+ * Changes the number of connections. Can be called at any time; when
+ * shrinking, surplus connections are closed as soon as they are idle.
+ * Exclusive devices are kept at 1 connection.
+ **********************************************************************/
+int tsspool_setSize(
+  TSS_POOL  *pool,
+  int        size)
+{
+  int i;
+
+  if (size < 1 || size > TSSPOOL_MAX_SIZE)
+  {
+    ERRFN("Invalid pool size %d (allowed 1..%d).", size, TSSPOOL_MAX_SIZE);
+    return -1;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if (size > 1 && tsspool_isExclusive(pool))
+  {
+    ERRFN("%s can only be opened once, using 1 connection instead of %d.",
+      pool->conns[0].devicePath, size);
+    size = 1;
+  }
+  pool->size = size;
+  for (i = size; i < TSSPOOL_MAX_SIZE; i++)
+  {
+    if (!pool->busy[i])
+    {
+      tssconn_close(&pool->conns[i]);
+    }
+  }
+  tsspool_wakeAll(pool);
+  pthread_mutex_unlock(&pool->mutex);
+
+  DBGFN("Pool size set to %d.", size);
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Limits the connections class cls can hold at the same time, 0 for
+ * no limit. Returns 0 on success.
+ **********************************************************************/
+int tsspool_setLimit(
+  TSS_POOL  *pool,
+  int        cls,
+  int        limit)
+{
+  if (cls < 0 || cls >= TSSPOOL_NR_CLASSES || limit < 0 || limit > TSSPOOL_MAX_SIZE)
+  {
+    ERRFN("Invalid limit %d for class %d (allowed 0..%d).", limit, cls, TSSPOOL_MAX_SIZE);
+    return -1;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->limit[cls] = limit;
+  tsspool_wakeAll(pool);
+  pthread_mutex_unlock(&pool->mutex);
+
+  DBGFN("Class %d limited to %d connections.", cls, limit);
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Number of checkouts dropped because their deadline passed.
+ **********************************************************************/
+unsigned long tsspool_getDrops(
+  TSS_POOL  *pool)
+{
+  unsigned long drops = 0;
+  int           i;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (i = 0; i < TSSPOOL_NR_CLASSES; i++)
+  {
+    drops += pool->drops[i];
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return drops;
+}
+
+
+
+/**********************************************************************
+ * Selects the TCTI of all connections: "socket:host:port" for a
+ * resource manager daemon (the default), or "device:path" for a TPM
+ * character device such as the kernel resource manager /dev/tpmrm0 or
+ * /dev/tpm0. The device may also be a stand-in that speaks the TPM
+ * command protocol, e.g. a vTPM proxy device. A device other than
+ * /dev/tpmrm* can only be opened once, so the pool is limited to 1
+ * connection for it. "async:host:port" is the socket TCTI in
+ * non-blocking mode, for use with an event loop. Only allowed while the
+ * pool is closed. Returns 0 on success.
+ **********************************************************************/
+int tsspool_setTcti(
+  TSS_POOL    *pool,
+  const char  *tcti)
+{
+  const char  *hostName = NULL;
+  const char  *devicePath = NULL;
+  const char  *host = NULL;
+  const char  *colon;
+  char        *end;
+  long         port = 0;
+  int          async = 0;
+  int          status = -1;
+  int          i;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  while (1)
+  {
+    for (i = 0; i < TSSPOOL_MAX_SIZE && !pool->busy[i]; i++)
+      ;
+    if (pool->open || i < TSSPOOL_MAX_SIZE)
+    {
+      ERRFN("TCTI can only be set before the engine is initialized.");
+      break;
+    }
+
+    if (tcti == NULL || strlen(tcti) >= TSSPOOL_MAX_TCTI)
+    {
+      ERRFN("Invalid TCTI.");
+      break;
+    }
+
+    if (strncmp(tcti, "device:", 7) == 0 && tcti[7] != '\0')
+    {
+      strcpy(pool->tctiDevice, tcti + 7);
+      devicePath = pool->tctiDevice;
+    }
+    else if (strncmp(tcti, "async:", 6) == 0)
+    {
+      host  = tcti + 6;
+      async = 1;
+    }
+    else if (strncmp(tcti, "socket:", 7) == 0)
+    {
+      host = tcti + 7;
+    }
+
+    if (devicePath == NULL && host != NULL && (colon = strrchr(host, ':')) != NULL && colon > host)
+    {
+      port = strtol(colon + 1, &end, 10);
+      if (*end != '\0' || port < 1 || port > 65535)
+      {
+        ERRFN("Invalid port in TCTI \"%s\".", tcti);
+        break;
+      }
+      memcpy(pool->tctiHost, host, colon - host);
+      pool->tctiHost[colon - host] = '\0';
+      hostName = pool->tctiHost;
+    }
+    else if (devicePath == NULL)
+    {
+      ERRFN("TCTI must be \"socket:host:port\", \"async:host:port\" or \"device:path\", not \"%s\".", tcti);
+      break;
+    }
+
+    for (i = 0; i < TSSPOOL_MAX_SIZE; i++)
+    {
+      tssconn_close(&pool->conns[i]);
+      pool->conns[i].devicePath = devicePath;
+      pool->conns[i].async      = async;
+      if (hostName != NULL)
+      {
+        pool->conns[i].hostName = hostName;
+        pool->conns[i].port     = (int) port;
+      }
+    }
+    if (pool->size > 1 && tsspool_isExclusive(pool))
+    {
+      ERRFN("%s can only be opened once, using 1 connection instead of %d.",
+        devicePath, pool->size);
+      pool->size = 1;
+    }
+    status = 0;
+    break;
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (status == 0)
+  {
+    DBGFN("TCTI set to %s.", tcti);
+  }
+  return status;
+}
+
+
+
+/**********************************************************************
+ * Checks out a connection for exclusive use by the calling thread,
+ * waiting until it is the turn of class cls if all are busy. Already
+ * connected idle slots are preferred over opening a new connection.
+ * With a deadline (CLOCK_REALTIME), the checkout is dropped once it has
+ * passed, as the result would come too late anyway. Returns NULL if the
+ * pool is closed, the deadline passed or the connection could not be
+ * opened.
+ **********************************************************************/
+TSS_CONN* tsspool_acquire(
+  TSS_POOL               *pool,
+  int                     cls,
+  const struct timespec  *deadline)
+{
+  TSS_CONN  *conn = NULL;
+  int        slot;
+  int        dropped = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->waiting[cls]++;
+  while (pool->open)
+  {
+    if (deadline != NULL && tsspool_isPast(deadline))
+    {
+      pool->drops[cls]++;
+      dropped = 1;
+      break;
+    }
+
+    if (tsspool_isTurn(pool, cls) && (slot = tsspool_freeSlot(pool)) >= 0)
+    {
+      pool->busy[slot]      = 1;
+      pool->slotClass[slot] = cls;
+      pool->active[cls]++;
+      conn = &pool->conns[slot];
+      break;
+    }
+
+    // A timeout is handled at the top of the loop
+    if (deadline == NULL)
+    {
+      pthread_cond_wait(&pool->ready[cls], &pool->mutex);
+    }
+    else
+    {
+      pthread_cond_timedwait(&pool->ready[cls], &pool->mutex, deadline);
+    }
+  }
+  pool->waiting[cls]--;
+
+  // Pass a wake-up on that was not used, or lower classes that were
+  // held back by this waiter may be next
+  tsspool_wakeNext(pool);
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (conn == NULL)
+  {
+    if (dropped)
+    {
+      DBGFN("Checkout of class %d dropped, deadline passed.", cls);
+    }
+    else
+    {
+      ERRFN("Connection pool is closed.");
+    }
+    return NULL;
+  }
+
+  // Connect outside the lock, other threads can keep working meanwhile
+  if (tssconn_open(conn) != 0)
+  {
+    tsspool_release(pool, conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+
+
+void tsspool_release(
+  TSS_POOL  *pool,
+  TSS_CONN  *conn)
+{
+  int slot = conn - pool->conns;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (!pool->open || slot >= pool->size)
+  {
+    tssconn_close(conn);
+  }
+  pool->busy[slot] = 0;
+  pool->active[pool->slotClass[slot]]--;
+  tsspool_wakeNext(pool);
+  pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,100 @@
+#ifndef _TSSPOOL_H_
+#define _TSSPOOL_H_
+
+#include <pthread.h>
+#include <time.h>
+
+#include "tssconn.h"
+
+#define TSSPOOL_MAX_SIZE     (16) /* Upper limit for the POOL_SIZE ctrl  */
+#define TSSPOOL_DEFAULT_SIZE  (4)
+#define TSSPOOL_MAX_TCTI   (256) /* Longest "socket:..."/"device:..." spec */
+
+/*
+ * Priority classes of checkouts. A released connection goes to the
+ * highest class that has waiters and is below its limit, so queued
+ * signatures never wait behind entropy refills.
+ */
+#define TSSPOOL_CLASS_SIGN       (0) /* Handshake signatures               */
+#define TSSPOOL_CLASS_FOREGROUND (1) /* Other commands a caller waits for  */
+#define TSSPOOL_CLASS_BACKGROUND (2) /* Entropy refills, bulk work         */
+#define TSSPOOL_NR_CLASSES       (3)
+#define TSSPOOL_DEFAULT_BACKGROUND_LIMIT (1) /* Connections for background */
+
+/*
+ * A pool of independent TCTI + system context pairs. Every connection
+ * can have one command in flight at the resource manager, so N worker
+ * threads holding N connections can overlap their TPM commands.
+ * Connections are opened lazily on first checkout and stay open until
+ * the pool is closed. Checkouts are scheduled by priority class, each
+ * class may be limited to a number of connections (0: no limit), and a
+ * checkout with a deadline is dropped instead of waiting past it.
+ */
+typedef struct {
+  TSS_CONN          conns[TSSPOOL_MAX_SIZE];
+  int               busy[TSSPOOL_MAX_SIZE];
+  int               slotClass[TSSPOOL_MAX_SIZE];
+  int               active[TSSPOOL_NR_CLASSES];   /* Checked out        */
+  int               waiting[TSSPOOL_NR_CLASSES];
+  int               limit[TSSPOOL_NR_CLASSES];
+  unsigned long     drops[TSSPOOL_NR_CLASSES];    /* Deadline passed    */
+  int               size;      /* Number of usable connections        */
+  int               open;      /* Checkouts allowed                   */
+  char              tctiHost[TSSPOOL_MAX_TCTI];   /* Set by setTcti    */
+  char              tctiDevice[TSSPOOL_MAX_TCTI];
+  pthread_mutex_t   mutex;
+  pthread_cond_t    ready[TSSPOOL_NR_CLASSES];
+} TSS_POOL;
+
+void tsspool_init(
+  TSS_POOL    *pool,
+  const char  *hostName,
+  int          port,
+  int          size
+);
+
+void tsspool_destroy(
+  TSS_POOL  *pool
+);
+
+int tsspool_open(
+  TSS_POOL  *pool,
+  int        eager
+);
+
+void tsspool_close(
+  TSS_POOL  *pool
+);
+
+int tsspool_setSize(
+  TSS_POOL  *pool,
+  int        size
+);
+
+int tsspool_setTcti(
+  TSS_POOL    *pool,
+  const char  *tcti
+);
+
+int tsspool_setLimit(
+  TSS_POOL  *pool,
+  int        cls,
+  int        limit
+);
+
+unsigned long tsspool_getDrops(
+  TSS_POOL  *pool
+);
+
+TSS_CONN* tsspool_acquire(
+  TSS_POOL               *pool,
+  int                     cls,
+  const struct timespec  *deadline
+);
+
+void tsspool_release(
+  TSS_POOL  *pool,
+  TSS_CONN  *conn
+);
+
+#endif
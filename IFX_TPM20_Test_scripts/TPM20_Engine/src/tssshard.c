@@ -0,0 +1,439 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "tssshard.h"
+#include "tpm20w.h"
+
+
+
+void tssshard_init(
+  TSS_SHARDS  *shards,
+  TSS_POOL    *primary)
+{
+  memset(shards, 0, sizeof(TSS_SHARDS));
+  shards->endpoints[0].pool = primary;
+  shards->nrEndpoints       = 1;
+
+  pthread_mutex_init(&shards->mutex, NULL);
+}
+
+
+
+void tssshard_destroy(
+  TSS_SHARDS  *shards)
+{
+  int i;
+
+  tssshard_close(shards);
+
+  // The primary pool belongs to the caller
+  for (i = 1; i < shards->nrEndpoints; i++)
+  {
+    tsspool_destroy(shards->endpoints[i].pool);
+    free(shards->endpoints[i].pool);
+    shards->endpoints[i].pool = NULL;
+  }
+  shards->nrEndpoints = 1;
+
+  pthread_mutex_destroy(&shards->mutex);
+}
+
+
+
+/**********************************************************************
+ * Called with the mutex held.
+ **********************************************************************/
+static TSSSHARD_KEY* tssshard_findKey(
+  TSS_ENDPOINT    *endpoint,
+  TPMI_DH_OBJECT   keyHandle)
+{
+  int i;
+
+  for (i = 0; i < endpoint->nrKeys; i++)
+  {
+    if (endpoint->keys[i].keyHandle == keyHandle)
+    {
+      return &endpoint->keys[i];
+    }
+  }
+  return NULL;
+}
+
+
+
+/**********************************************************************
+ * Returns the kind of TCTI of a pool's connections. The event loop and
+ * the dispatcher are chosen for the primary's kind, so all endpoints
+ * must use the same.
+ **********************************************************************/
+static const char* tssshard_tctiKind(
+  TSS_POOL  *pool)
+{
+  if (pool->conns[0].devicePath != NULL)
+  {
+    return "device";
+  }
+  return pool->conns[0].async ? "async" : "socket";
+}
+
+
+
+/**********************************************************************
+ * Adds a TPM: "tcti[,keyHandle=localHandle]...", where tcti is as for
+ * tsspool_setTcti() and each mapping names the handle of a primary key
+ * on this TPM (keys without a mapping have the same handle on both).
+ * The TCTI must be of the same kind (socket, async or device) as the
+ * primary's. Only allowed while closed. Returns 0 on success.
+ **********************************************************************/
+int tssshard_addEndpoint(
+  TSS_SHARDS  *shards,
+  const char  *spec)
+{
+  TSS_ENDPOINT  *endpoint;
+  TSS_POOL      *primary = shards->endpoints[0].pool;
+  char           buffer[TSSPOOL_MAX_TCTI];
+  char          *mapping;
+  char          *next;
+  char          *end;
+  unsigned long  keyHandle;
+  unsigned long  localHandle;
+  int            failed = 0;
+
+  if (shards->open || shards->nrEndpoints >= TSSSHARD_MAX_ENDPOINTS)
+  {
+    ERRFN("Endpoints can only be added before the engine is initialized (max %d).",
+      TSSSHARD_MAX_ENDPOINTS);
+    return -1;
+  }
+  if (spec == NULL || strlen(spec) >= sizeof(buffer))
+  {
+    ERRFN("Invalid endpoint.");
+    return -1;
+  }
+
+  endpoint = &shards->endpoints[shards->nrEndpoints];
+  memset(endpoint, 0, sizeof(TSS_ENDPOINT));
+
+  strcpy(buffer, spec);
+  if ((mapping = strchr(buffer, ',')) != NULL)
+  {
+    *mapping++ = '\0';
+  }
+
+  for (; mapping != NULL; mapping = next)
+  {
+    if ((next = strchr(mapping, ',')) != NULL)
+    {
+      *next++ = '\0';
+    }
+
+    keyHandle = strtoul(mapping, &end, 0);
+    if (*end != '=' || endpoint->nrKeys >= TSSSHARD_MAX_KEYS)
+    {
+      ERRFN("Invalid key mapping \"%s\" (keyHandle=localHandle, max %d).", mapping, TSSSHARD_MAX_KEYS);
+      return -1;
+    }
+    localHandle = strtoul(end + 1, &end, 0);
+    if (*end != '\0')
+    {
+      ERRFN("Invalid key mapping \"%s\" (keyHandle=localHandle).", mapping);
+      return -1;
+    }
+
+    endpoint->keys[endpoint->nrKeys].keyHandle   = (TPMI_DH_OBJECT) keyHandle;
+    endpoint->keys[endpoint->nrKeys].localHandle = (TPMI_DH_OBJECT) localHandle;
+    endpoint->keys[endpoint->nrKeys].state       = TSSSHARD_KEY_UNCHECKED;
+    endpoint->nrKeys++;
+  }
+
+  if ((endpoint->pool = (TSS_POOL*) malloc(sizeof(TSS_POOL))) == NULL)
+  {
+    ERRFN("Out of memory for endpoint.");
+    return -1;
+  }
+  tsspool_init(endpoint->pool, primary->conns[0].hostName, primary->conns[0].port, primary->size);
+  if (tsspool_setTcti(endpoint->pool, buffer) != 0)
+  {
+    failed = 1;
+  }
+  else if (strcmp(tssshard_tctiKind(endpoint->pool), tssshard_tctiKind(primary)) != 0)
+  {
+    ERRFN("Endpoint \"%s\" uses a %s TCTI, the primary a %s TCTI.", buffer,
+      tssshard_tctiKind(endpoint->pool), tssshard_tctiKind(primary));
+    failed = 1;
+  }
+  if (failed)
+  {
+    tsspool_destroy(endpoint->pool);
+    free(endpoint->pool);
+    endpoint->pool = NULL;
+    return -1;
+  }
+
+  shards->nrEndpoints++;
+  DBGFN("Endpoint %d: %s with %d key mappings.", shards->nrEndpoints - 1, buffer, endpoint->nrKeys);
+  return 0;
+}
+
+
+
+/**********************************************************************
+ * Opens the pools of the additional endpoints (the primary pool is
+ * opened by the caller). They connect lazily, so a TPM that is down
+ * only takes its endpoint out of rotation. Fails if an endpoint's TCTI
+ * is of another kind than the primary's. Returns 0 on success.
+ **********************************************************************/
+int tssshard_open(
+  TSS_SHARDS  *shards)
+{
+  int i;
+
+  pthread_mutex_lock(&shards->mutex);
+  // The primary's TCTI may have been changed after endpoints were added
+  for (i = 1; i < shards->nrEndpoints; i++)
+  {
+    if (strcmp(tssshard_tctiKind(shards->endpoints[i].pool),
+               tssshard_tctiKind(shards->endpoints[0].pool)) != 0)
+    {
+      ERRFN("Endpoint %d uses a %s TCTI, the primary a %s TCTI.", i,
+        tssshard_tctiKind(shards->endpoints[i].pool),
+        tssshard_tctiKind(shards->endpoints[0].pool));
+      pthread_mutex_unlock(&shards->mutex);
+      return -1;
+    }
+  }
+  for (i = 0; i < shards->nrEndpoints; i++)
+  {
+    shards->endpoints[i].failedAt = 0;
+    shards->endpoints[i].load     = 0;
+    if (i > 0)
+    {
+      tsspool_open(shards->endpoints[i].pool, 0);
+    }
+  }
+  shards->open = 1;
+  pthread_mutex_unlock(&shards->mutex);
+
+  return 0;
+}
+
+
+
+void tssshard_close(
+  TSS_SHARDS  *shards)
+{
+  int i;
+
+  pthread_mutex_lock(&shards->mutex);
+  for (i = 1; i < shards->nrEndpoints; i++)
+  {
+    tsspool_close(shards->endpoints[i].pool);
+  }
+  shards->open = 0;
+  pthread_mutex_unlock(&shards->mutex);
+}
+
+
+
+/**********************************************************************
+ * Sets the number of connections of every endpoint's pool.
+ **********************************************************************/
+int tssshard_setSize(
+  TSS_SHARDS  *shards,
+  int          size)
+{
+  int i;
+
+  for (i = 0; i < shards->nrEndpoints; i++)
+  {
+    if (tsspool_setSize(shards->endpoints[i].pool, size) != 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+int tssshard_getNrEndpoints(
+  TSS_SHARDS  *shards)
+{
+  return shards->nrEndpoints;
+}
+
+
+
+/**********************************************************************
+ * Selects the endpoint for a signature with keyHandle: the least loaded
+ * one that is in rotation and not known to hold a different key. If
+ * none qualifies, the primary TPM is tried. Returns the endpoint, whose
+ * handle of the key is stored in localHandle. Every pick must be
+ * matched by a tssshard_done().
+ **********************************************************************/
+int tssshard_pick(
+  TSS_SHARDS      *shards,
+  TPMI_DH_OBJECT   keyHandle,
+  TPMI_DH_OBJECT  *localHandle)
+{
+  TSS_ENDPOINT  *endpoint;
+  TSSSHARD_KEY  *key;
+  time_t         now = time(NULL);
+  int            best = -1;
+  int            i;
+
+  pthread_mutex_lock(&shards->mutex);
+
+  for (i = 0; i < shards->nrEndpoints; i++)
+  {
+    endpoint = &shards->endpoints[i];
+    if (endpoint->failedAt != 0 && now - endpoint->failedAt < TSSSHARD_RETRY_DELAY)
+    {
+      continue;
+    }
+    if ((key = tssshard_findKey(endpoint, keyHandle)) != NULL && key->state == TSSSHARD_KEY_MISMATCH)
+    {
+      continue;
+    }
+    if (best < 0 || endpoint->load < shards->endpoints[best].load)
+    {
+      best = i;
+    }
+  }
+  if (best < 0)
+  {
+    best = 0;
+  }
+
+  endpoint = &shards->endpoints[best];
+  key = tssshard_findKey(endpoint, keyHandle);
+  *localHandle = (key != NULL) ? key->localHandle : keyHandle;
+  endpoint->load++;
+
+  pthread_mutex_unlock(&shards->mutex);
+  return best;
+}
+
+
+
+/**********************************************************************
+ * Before the first signature with a key on an endpoint other than the
+ * primary, compares the TPM names of the key on both TPMs, so that a
+ * wrong mapping never yields signatures that do not verify. conn is a
+ * connection of the endpoint. Returns 1 if the keys match, 0 if they
+ * differ and -1 if the check failed.
+ **********************************************************************/
+int tssshard_checkKey(
+  TSS_SHARDS      *shards,
+  int              endpoint,
+  TSS_CONN        *conn,
+  TPMI_DH_OBJECT   keyHandle,
+  TPMI_DH_OBJECT   localHandle)
+{
+  TSS_ENDPOINT  *ep = &shards->endpoints[endpoint];
+  TSSSHARD_KEY  *key;
+  TSS_CONN      *primaryConn;
+  TPM2B_PUBLIC   publicArea;
+  TPM2B_NAME     localName;
+  TPM2B_NAME     primaryName;
+  int            status = -1;
+
+  if (endpoint == 0)
+  {
+    return 1;
+  }
+
+  pthread_mutex_lock(&shards->mutex);
+  if ((key = tssshard_findKey(ep, keyHandle)) != NULL && key->state != TSSSHARD_KEY_UNCHECKED)
+  {
+    status = (key->state == TSSSHARD_KEY_OK) ? 1 : 0;
+    pthread_mutex_unlock(&shards->mutex);
+    return status;
+  }
+  pthread_mutex_unlock(&shards->mutex);
+
+  if (tpm20w_readPublicArea(conn->sysContext, localHandle, &publicArea, &localName) != 0)
+  {
+    ERRFN("Key 0x%x not readable on endpoint %d.", localHandle, endpoint);
+    return -1;
+  }
+
+  if ((primaryConn = tsspool_acquire(shards->endpoints[0].pool, TSSPOOL_CLASS_FOREGROUND, NULL)) == NULL)
+  {
+    return -1;
+  }
+  if (tpm20w_readPublicArea(primaryConn->sysContext, keyHandle, &publicArea, &primaryName) == 0)
+  {
+    status = (localName.t.size == primaryName.t.size &&
+              memcmp(localName.t.name, primaryName.t.name, localName.t.size) == 0) ? 1 : 0;
+  }
+  tsspool_release(shards->endpoints[0].pool, primaryConn);
+
+  if (status < 0)
+  {
+    ERRFN("Key 0x%x not readable on the primary TPM.", keyHandle);
+    return -1;
+  }
+  if (status == 0)
+  {
+    ERRFN("Key 0x%x on endpoint %d is not key 0x%x of the primary TPM, not using it.",
+      localHandle, endpoint, keyHandle);
+  }
+
+  pthread_mutex_lock(&shards->mutex);
+  if ((key = tssshard_findKey(ep, keyHandle)) == NULL && ep->nrKeys < TSSSHARD_MAX_KEYS)
+  {
+    // Same handle on both TPMs, remember the result as well
+    key = &ep->keys[ep->nrKeys++];
+    key->keyHandle   = keyHandle;
+    key->localHandle = localHandle;
+  }
+  if (key != NULL)
+  {
+    key->state = status ? TSSSHARD_KEY_OK : TSSSHARD_KEY_MISMATCH;
+  }
+  pthread_mutex_unlock(&shards->mutex);
+
+  return status;
+}
+
+
+
+TSS_POOL* tssshard_getPool(
+  TSS_SHARDS  *shards,
+  int          endpoint)
+{
+  return shards->endpoints[endpoint].pool;
+}
+
+
+
+/**********************************************************************
+ * Ends a pick. An endpoint that is not healthy (its TPM could not be
+ * reached) is taken out of rotation; a healthy one is back in.
+ **********************************************************************/
+void tssshard_done(
+  TSS_SHARDS  *shards,
+  int          endpoint,
+  int          healthy)
+{
+  TSS_ENDPOINT  *ep = &shards->endpoints[endpoint];
+
+  pthread_mutex_lock(&shards->mutex);
+  ep->load--;
+  if (!healthy)
+  {
+    if (ep->failedAt == 0)
+    {
+      ERRFN("Endpoint %d failed, out of rotation for %d s.", endpoint, TSSSHARD_RETRY_DELAY);
+    }
+    ep->failedAt = time(NULL);
+    ep->failures++;
+  }
+  else if (ep->failedAt != 0)
+  {
+    DBGFN("Endpoint %d back in rotation.", endpoint);
+    ep->failedAt = 0;
+  }
+  pthread_mutex_unlock(&shards->mutex);
+}
@@ -0,0 +1,109 @@
+#ifndef _TSSSHARD_H_
+#define _TSSSHARD_H_
+
+#include <pthread.h>
+#include <time.h>
+
+#include <sapi/tpm20.h>
+
+#include "tsspool.h"
+
+#define TSSSHARD_MAX_ENDPOINTS  (4)  /* Including the primary TPM           */
+#define TSSSHARD_MAX_KEYS      (16)  /* Key handles per endpoint            */
+#define TSSSHARD_RETRY_DELAY   (30)  /* Seconds out of rotation after error */
+
+#define TSSSHARD_KEY_UNCHECKED  (0)
+#define TSSSHARD_KEY_OK         (1)
+#define TSSSHARD_KEY_MISMATCH  (-1)
+
+/*
+ * Where a key loaded from the primary TPM lives on another TPM. The
+ * other TPM must hold the same key (e.g. an imported duplicate); this
+ * is checked once by comparing the TPM names.
+ */
+typedef struct {
+  TPMI_DH_OBJECT  keyHandle;    /* Handle on the primary TPM */
+  TPMI_DH_OBJECT  localHandle;  /* Handle on this endpoint   */
+  int             state;        /* TSSSHARD_KEY_*            */
+} TSSSHARD_KEY;
+
+typedef struct {
+  TSS_POOL       *pool;
+  TSSSHARD_KEY    keys[TSSSHARD_MAX_KEYS];
+  int             nrKeys;
+  int             load;         /* Signatures in progress         */
+  time_t          failedAt;     /* 0: in rotation                 */
+  unsigned long   failures;
+} TSS_ENDPOINT;
+
+/*
+ * Several TPMs that sign with the same keys. Endpoint 0 is the primary
+ * TPM (the engine's pool), which also serves everything but signatures.
+ * A signature goes to the least loaded endpoint in rotation; an
+ * endpoint whose connection breaks is left out for TSSSHARD_RETRY_DELAY
+ * seconds and then gets another chance.
+ */
+typedef struct {
+  TSS_ENDPOINT      endpoints[TSSSHARD_MAX_ENDPOINTS];
+  int               nrEndpoints;
+  int               open;
+  pthread_mutex_t   mutex;
+} TSS_SHARDS;
+
+void tssshard_init(
+  TSS_SHARDS  *shards,
+  TSS_POOL    *primary
+);
+
+void tssshard_destroy(
+  TSS_SHARDS  *shards
+);
+
+int tssshard_addEndpoint(
+  TSS_SHARDS  *shards,
+  const char  *spec
+);
+
+int tssshard_open(
+  TSS_SHARDS  *shards
+);
+
+void tssshard_close(
+  TSS_SHARDS  *shards
+);
+
+int tssshard_setSize(
+  TSS_SHARDS  *shards,
+  int          size
+);
+
+int tssshard_getNrEndpoints(
+  TSS_SHARDS  *shards
+);
+
+int tssshard_pick(
+  TSS_SHARDS      *shards,
+  TPMI_DH_OBJECT   keyHandle,
+  TPMI_DH_OBJECT  *localHandle
+);
+
+int tssshard_checkKey(
+  TSS_SHARDS      *shards,
+  int              endpoint,
+  TSS_CONN        *conn,
+  TPMI_DH_OBJECT   keyHandle,
+  TPMI_DH_OBJECT   localHandle
+);
+
+TSS_POOL* tssshard_getPool(
+  TSS_SHARDS  *shards,
+  int          endpoint
+);
+
+void tssshard_done(
+  TSS_SHARDS  *shards,
+  int          endpoint,
+  int          healthy
+);
+
+#endif
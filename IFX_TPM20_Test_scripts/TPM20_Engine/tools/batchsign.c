@@ -0,0 +1,328 @@
+/*
+ * Signs every regular file in a directory with a TPM key, pipelining
+ * the TPM2_Sign commands over several resource manager connections.
+ * The SHA-256 digests are computed in software; each signature is
+ * written DER encoded to <file>.sig.
+ *
+ *   batchsign -k 0x81020001 [-p password] [-c connections]
+ *             [-H host] [-P port] directory
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/sha.h>
+#include <openssl/ecdsa.h>
+#include <openssl/bn.h>
+
+#include "tpm20w.h"
+#include "tsspool.h"
+
+#define BATCH_SIZE        (64)  /* Digests per tpm20w_signEcdsaWithSha256Batch() */
+#define PATH_MAX_LEN    (1024)
+
+typedef struct {
+  char  path[PATH_MAX_LEN];
+} BATCH_FILE;
+
+static int hashFile(
+  const char     *path,
+  unsigned char  *digest
+);
+
+static int writeSignature(
+  const char            *path,
+  const TPMT_SIGNATURE  *signature
+);
+
+static int signBatch(
+  TSS_POOL        *pool,
+  int              nrConns,
+  BATCH_FILE      *files,
+  int              nrFiles,
+  TPMI_DH_OBJECT   keyHandle,
+  const char      *keyPassword
+);
+
+static void usage(
+  const char  *name
+);
+
+
+
+int main(
+  int    argc,
+  char  *argv[])
+{
+  TSS_POOL         pool;
+  TPMI_DH_OBJECT   keyHandle = 0;
+  const char      *keyPassword = "";
+  const char      *hostName = DEFAULT_HOSTNAME;
+  int              port = DEFAULT_RESMGR_TPM_PORT;
+  int              nrConns = TSSPOOL_DEFAULT_SIZE;
+  int              haveKey = 0;
+  int              opt;
+  int              nrFiles = 0;
+  int              failed = 0;
+  size_t           len;
+  DIR             *dir;
+  struct dirent   *dirEntry;
+  struct stat      st;
+  BATCH_FILE      *files;
+
+  while ((opt = getopt(argc, argv, "k:p:c:H:P:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'k':
+        if (getSizeUint32Hex(optarg, &keyHandle) != 0)
+        {
+          fprintf(stderr, "Invalid key handle '%s'.\n", optarg);
+          return 1;
+        }
+        haveKey = 1;
+        break;
+      case 'p': keyPassword = optarg;       break;
+      case 'c': nrConns     = atoi(optarg); break;
+      case 'H': hostName    = optarg;       break;
+      case 'P': port        = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (!haveKey || optind != argc - 1 ||
+      nrConns < 1 || nrConns > TPM20W_BATCH_MAX_CONTEXTS)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if ((dir = opendir(argv[optind])) == NULL)
+  {
+    fprintf(stderr, "Cannot open directory '%s'.\n", argv[optind]);
+    return 1;
+  }
+
+  if ((files = calloc(BATCH_SIZE, sizeof(BATCH_FILE))) == NULL)
+  {
+    closedir(dir);
+    return 1;
+  }
+
+  tsspool_init(&pool, hostName, port, nrConns);
+  if (tsspool_open(&pool, 1) != 0)
+  {
+    fprintf(stderr, "Cannot connect to the resource manager at %s:%d.\n", hostName, port);
+    tsspool_destroy(&pool);
+    free(files);
+    closedir(dir);
+    return 1;
+  }
+
+  while ((dirEntry = readdir(dir)) != NULL)
+  {
+    len = strlen(dirEntry->d_name);
+    if (len >= 4 && strcmp(dirEntry->d_name + len - 4, ".sig") == 0)
+    {
+      continue;
+    }
+
+    snprintf(files[nrFiles].path, PATH_MAX_LEN, "%s/%s", argv[optind], dirEntry->d_name);
+    if (stat(files[nrFiles].path, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      continue;
+    }
+
+    if (++nrFiles == BATCH_SIZE)
+    {
+      failed += signBatch(&pool, nrConns, files, nrFiles, keyHandle, keyPassword);
+      nrFiles = 0;
+    }
+  }
+  if (nrFiles > 0)
+  {
+    failed += signBatch(&pool, nrConns, files, nrFiles, keyHandle, keyPassword);
+  }
+
+  tsspool_close(&pool);
+  tsspool_destroy(&pool);
+  free(files);
+  closedir(dir);
+
+  return failed ? 2 : 0;
+}
+
+
+
+static void usage(
+  const char  *name)
+{
+  fprintf(stderr,
+    "Usage: %s -k <key handle> [-p <password>] [-c <connections 1..%d>]\n"
+    "          [-H <host>] [-P <port>] <directory>\n",
+    name, TPM20W_BATCH_MAX_CONTEXTS);
+}
+
+
+
+/**********************************************************************
+ * Hashes and signs up to BATCH_SIZE files. Returns the number of
+ * files that could not be signed.
+ **********************************************************************/
+static int signBatch(
+  TSS_POOL        *pool,
+  int              nrConns,
+  BATCH_FILE      *files,
+  int              nrFiles,
+  TPMI_DH_OBJECT   keyHandle,
+  const char      *keyPassword)
+{
+  static unsigned char   digests[BATCH_SIZE][SHA256_DIGEST_LENGTH];
+  static TPMT_SIGNATURE  signatures[BATCH_SIZE];
+  int                    results[BATCH_SIZE];
+  int                    fileIndex[BATCH_SIZE];
+  TSS_CONN              *conns[TPM20W_BATCH_MAX_CONTEXTS];
+  TSS2_SYS_CONTEXT      *sysContexts[TPM20W_BATCH_MAX_CONTEXTS];
+  int                    nrDigests = 0;
+  int                    failed = 0;
+  int                    i;
+
+  for (i = 0; i < nrFiles; i++)
+  {
+    if (hashFile(files[i].path, digests[nrDigests]) != 0)
+    {
+      fprintf(stderr, "Cannot read '%s'.\n", files[i].path);
+      failed++;
+      continue;
+    }
+    fileIndex[nrDigests++] = i;
+  }
+
+  for (i = 0; i < nrConns; i++)
+  {
+    if ((conns[i] = tsspool_acquire(pool, TSSPOOL_CLASS_SIGN, NULL)) == NULL)
+    {
+      break;
+    }
+    sysContexts[i] = conns[i]->sysContext;
+  }
+  nrConns = i;
+
+  if (nrConns == 0 ||
+      tpm20w_signEcdsaWithSha256Batch(
+        sysContexts,
+        nrConns,
+        &digests[0][0],
+        SHA256_DIGEST_LENGTH,
+        nrDigests,
+        keyHandle,
+        keyPassword,
+        signatures,
+        results) < 0)
+  {
+    for (i = 0; i < nrDigests; i++)
+    {
+      results[i] = -1;
+    }
+  }
+
+  for (i = 0; i < nrConns; i++)
+  {
+    tsspool_release(pool, conns[i]);
+  }
+
+  for (i = 0; i < nrDigests; i++)
+  {
+    if (results[i] != 1 || writeSignature(files[fileIndex[i]].path, &signatures[i]) != 0)
+    {
+      fprintf(stderr, "Signing '%s' failed.\n", files[fileIndex[i]].path);
+      failed++;
+    }
+    else
+    {
+      printf("%s.sig\n", files[fileIndex[i]].path);
+    }
+  }
+
+  return failed;
+}
+
+
+
+static int hashFile(
+  const char     *path,
+  unsigned char  *digest)
+{
+  FILE           *file;
+  SHA256_CTX      ctx;
+  unsigned char   buffer[4096];
+  size_t          n;
+  int             status;
+
+  if ((file = fopen(path, "rb")) == NULL)
+  {
+    return -1;
+  }
+
+  SHA256_Init(&ctx);
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    SHA256_Update(&ctx, buffer, n);
+  }
+  status = ferror(file) ? -1 : 0;
+  SHA256_Final(digest, &ctx);
+
+  fclose(file);
+  return status;
+}
+
+
+
+static int writeSignature(
+  const char            *path,
+  const TPMT_SIGNATURE  *signature)
+{
+  char            sigPath[PATH_MAX_LEN + 4];
+  ECDSA_SIG      *sig;
+  unsigned char  *der = NULL;
+  int             derLen;
+  FILE           *file;
+  int             status = -1;
+
+  if ((sig = ECDSA_SIG_new()) == NULL)
+  {
+    return -1;
+  }
+
+  BN_bin2bn(
+    signature->signature.ecdsa.signatureR.t.buffer,
+    signature->signature.ecdsa.signatureR.t.size,
+    sig->r);
+  BN_bin2bn(
+    signature->signature.ecdsa.signatureS.t.buffer,
+    signature->signature.ecdsa.signatureS.t.size,
+    sig->s);
+
+  snprintf(sigPath, sizeof(sigPath), "%s.sig", path);
+  if ((derLen = i2d_ECDSA_SIG(sig, &der)) > 0 &&
+      (file = fopen(sigPath, "wb")) != NULL)
+  {
+    if (fwrite(der, 1, derLen, file) == (size_t) derLen)
+    {
+      status = 0;
+    }
+    if (fclose(file) != 0)
+    {
+      status = -1;
+    }
+  }
+
+  OPENSSL_free(der);
+  ECDSA_SIG_free(sig);
+  return status;
+}